@@ -43,8 +43,6 @@
 #include <amqp.h>
 #include <amqp_framing.h>
 
-#include <assert.h>
-
 #include "utils.h"
 
 #define SUMMARY_EVERY_US 1000000
@@ -57,10 +55,9 @@ static void run(amqp_connection_state_t conn)
   uint64_t previous_report_time = start_time;
   uint64_t next_summary_time = start_time + SUMMARY_EVERY_US;
 
+  amqp_envelope_t envelope;
+  amqp_rpc_reply_t result;
   amqp_frame_t frame;
-  int result;
-  size_t body_received;
-  size_t body_target;
 
   uint64_t now;
 
@@ -78,47 +75,21 @@ static void run(amqp_connection_state_t conn)
     }
 
     amqp_maybe_release_buffers(conn);
-    result = amqp_simple_wait_frame(conn, &frame);
-    if (result < 0) {
-      return;
-    }
-
-    if (frame.frame_type != AMQP_FRAME_METHOD) {
-      continue;
-    }
-
-    if (frame.payload.method.id != AMQP_BASIC_DELIVER_METHOD) {
-      continue;
-    }
-
-    result = amqp_simple_wait_frame(conn, &frame);
-    if (result < 0) {
-      return;
-    }
-
-    if (frame.frame_type != AMQP_FRAME_HEADER) {
-      fprintf(stderr, "Expected header!");
-      abort();
-    }
-
-    body_target = frame.payload.properties.body_size;
-    body_received = 0;
-
-    while (body_received < body_target) {
-      result = amqp_simple_wait_frame(conn, &frame);
-      if (result < 0) {
-        return;
+    result = amqp_consume_message(conn, &envelope);
+    if (result.reply_type != AMQP_RESPONSE_NORMAL) {
+      if (result.reply_type == AMQP_RESPONSE_LIBRARY_EXCEPTION
+          && amqp_frames_enqueued(conn)) {
+        /* some other frame, such as a late basic.consume-ok, was left
+           queued; skip it and keep consuming */
+        if (amqp_simple_wait_frame(conn, &frame) < 0) {
+          return;
+        }
+        continue;
       }
-
-      if (frame.frame_type != AMQP_FRAME_BODY) {
-        fprintf(stderr, "Expected body!");
-        abort();
-      }
-
-      body_received += frame.payload.body_fragment.len;
-      assert(body_received <= body_target);
+      return;
     }
 
+    amqp_destroy_envelope(&envelope);
     received++;
   }
 }
@@ -245,6 +245,16 @@ typedef struct amqp_table_entry_t_ {
   amqp_field_value_t value;
 } amqp_table_entry_t;
 
+/*
+ * Cursor over an encoded table, as returned by amqp_find_encoded_property
+ * for a headers field. See amqp_table_iterator_init.
+ */
+typedef struct amqp_table_iterator_t_ {
+  amqp_bytes_t encoded;
+  size_t offset;
+  size_t limit;
+} amqp_table_iterator_t;
+
 typedef enum {
   AMQP_FIELD_KIND_BOOLEAN = 't',
   AMQP_FIELD_KIND_I8 = 'b',
@@ -266,11 +276,54 @@ typedef enum {
   AMQP_FIELD_KIND_BYTES = 'x'
 } amqp_field_value_kind_t;
 
+/* What a block of memory requested from an amqp_allocator_t is for */
+typedef enum amqp_memory_tag_enum_ {
+  AMQP_MEMORY_CONNECTION = 0, /* connection state and socket buffers */
+  AMQP_MEMORY_POOL,           /* pages and large blocks of amqp_pool_t */
+  AMQP_MEMORY_TABLE,          /* scratch space for decoding tables */
+  AMQP_MEMORY_BYTES,          /* amqp_bytes_malloc, amqp_bytes_malloc_dup */
+  AMQP_MEMORY_SSL,            /* SSL socket write buffers */
+  AMQP_MEMORY_TAG_COUNT
+} amqp_memory_tag_t;
+
+/*
+ * Memory allocation hooks. Every block is freed with the size and tag
+ * it was allocated with, so an allocator can keep per-tag counts, or
+ * hand out size-classed slabs, without keeping headers of its own.
+ * context is passed through unchanged. realloc may be NULL, in which
+ * case alloc, a copy and free are used instead.
+ */
+typedef struct amqp_allocator_t_ {
+  void *(*alloc)(void *context, size_t size, amqp_memory_tag_t tag);
+  void *(*realloc)(void *context, void *ptr, size_t old_size,
+                   size_t new_size, amqp_memory_tag_t tag);
+  void (*free)(void *context, void *ptr, size_t size, amqp_memory_tag_t tag);
+  void *context;
+} amqp_allocator_t;
+
 typedef struct amqp_pool_blocklist_t_ {
   int num_blocks;
   void **blocklist;
 } amqp_pool_blocklist_t;
 
+/* Counters kept by every pool; see amqp_pool_get_stats */
+typedef struct amqp_pool_stats_t_ {
+  size_t held_bytes;      /* taken from the allocator: pages and large
+                             blocks, including those retained for reuse */
+  size_t peak_held_bytes;
+  size_t used_bytes;      /* handed out since the pool was last recycled */
+  size_t peak_used_bytes;
+  int pages;              /* pages held */
+  int large_blocks;       /* large blocks in use */
+  uint64_t total_allocs;  /* amqp_pool_alloc calls, ever */
+  uint64_t total_bytes;   /* bytes they handed out, ever */
+} amqp_pool_stats_t;
+
+/* Allocations bigger than a pool's page size are rounded up to one of
+   this many size classes, four for each doubling of the page size, so
+   that blocks can be reused by later allocations of similar size. */
+#define AMQP_POOL_LARGE_SIZE_CLASSES 32
+
 typedef struct amqp_pool_t_ {
   size_t pagesize;
 
@@ -280,6 +333,18 @@ typedef struct amqp_pool_t_ {
   int next_page;
   char *alloc_block;
   size_t alloc_used;
+
+  /* large blocks kept by recycle_amqp_pool, one list per size class */
+  void *free_large_blocks[AMQP_POOL_LARGE_SIZE_CLASSES];
+  size_t retained_bytes;
+  size_t max_retained_bytes;
+
+  const amqp_allocator_t *allocator;
+  amqp_boolean_t zero_fill; /* whether new pages and blocks are zeroed */
+
+  /* pages and large_blocks are filled in by amqp_pool_get_stats, and
+     total_bytes leaves out used_bytes until the pool is recycled */
+  amqp_pool_stats_t stats;
 } amqp_pool_t;
 
 typedef struct amqp_method_t_ {
@@ -292,6 +357,11 @@ typedef struct amqp_frame_t_ {
   amqp_channel_t channel;
   union {
     amqp_method_t method;
+    struct {
+      amqp_method_number_t id;
+      void *decoded;
+      amqp_bytes_t raw;
+    } encoded_method; /* method, plus its arguments as received */
     struct {
       uint16_t class_id;
       uint64_t body_size;
@@ -330,6 +400,10 @@ typedef struct amqp_connection_state_t_ *amqp_connection_state_t;
 
 typedef struct amqp_socket_t_ amqp_socket_t;
 
+typedef struct amqp_detached_buffers_t_ amqp_detached_buffers_t;
+
+typedef struct amqp_shared_buffer_t_ amqp_shared_buffer_t;
+
 AMQP_PUBLIC_FUNCTION
 char const *
 AMQP_CALL amqp_version(void);
@@ -345,10 +419,31 @@ AMQP_PUBLIC_VARIABLE const amqp_array_t amqp_empty_array;
 #define AMQP_EMPTY_TABLE amqp_empty_table
 #define AMQP_EMPTY_ARRAY amqp_empty_array
 
+/*
+ * Replaces the allocator used by connections and pools created from now
+ * on, and by amqp_bytes_malloc and the SSL sockets. NULL restores the
+ * default, which uses malloc and free. The allocator must stay valid
+ * for as long as anything created with it; set it before creating any
+ * connection, as this is not thread-safe.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_set_default_allocator(const amqp_allocator_t *allocator);
+
+AMQP_PUBLIC_FUNCTION
+const amqp_allocator_t *
+AMQP_CALL amqp_get_default_allocator(void);
+
 AMQP_PUBLIC_FUNCTION
 void
 AMQP_CALL init_amqp_pool(amqp_pool_t *pool, size_t pagesize);
 
+/* Like init_amqp_pool, but the pool's memory comes from allocator. */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL init_amqp_pool_with_allocator(amqp_pool_t *pool, size_t pagesize,
+                                        const amqp_allocator_t *allocator);
+
 AMQP_PUBLIC_FUNCTION
 void
 AMQP_CALL recycle_amqp_pool(amqp_pool_t *pool);
@@ -357,6 +452,28 @@ AMQP_PUBLIC_FUNCTION
 void
 AMQP_CALL empty_amqp_pool(amqp_pool_t *pool);
 
+/*
+ * Sets how many bytes of large blocks recycle_amqp_pool may keep for
+ * reuse instead of freeing them. Blocks beyond the limit are freed; 0
+ * keeps none. Pools start with a limit of 1 MiB.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_pool_set_retention(amqp_pool_t *pool, size_t max_retained_bytes);
+
+/*
+ * Sets whether pages and large blocks the pool gets from its allocator
+ * are zero-filled first. Pools start out zero-filling; memory reused
+ * after recycle_amqp_pool is never zeroed either way.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_pool_set_zero_fill(amqp_pool_t *pool, amqp_boolean_t zero_fill);
+
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_pool_get_stats(const amqp_pool_t *pool, amqp_pool_stats_t *stats);
+
 AMQP_PUBLIC_FUNCTION
 void *
 AMQP_CALL amqp_pool_alloc(amqp_pool_t *pool, size_t amount);
@@ -385,6 +502,74 @@ AMQP_PUBLIC_FUNCTION
 amqp_connection_state_t
 AMQP_CALL amqp_new_connection(void);
 
+/*
+ * Like amqp_new_connection, but the connection, its buffers and its
+ * pools are allocated with allocator rather than the default one.
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_connection_state_t
+AMQP_CALL amqp_new_connection_with_allocator(const amqp_allocator_t *allocator);
+
+/* Options for amqp_new_connection_with_options */
+typedef struct amqp_connection_options_t_ {
+  /* NULL for the default allocator */
+  const amqp_allocator_t *allocator;
+
+  /* Rather than reserving buffers for the largest frames up front,
+   * allocate the socket and outbound buffers only when they are first
+   * needed, and start them small and let them grow with the traffic.
+   * Suits many mostly idle connections, at the cost of a few more
+   * allocations while they are busy. */
+  amqp_boolean_t lazy_buffers;
+
+  /* If non-zero, buffers nothing refers to are freed, as by
+   * amqp_release_idle_buffers, once nothing has been received for this
+   * many milliseconds while waiting for a frame. */
+  int idle_release_ms;
+} amqp_connection_options_t;
+
+/* Fills in options with what amqp_new_connection uses */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_default_connection_options(amqp_connection_options_t *options);
+
+AMQP_PUBLIC_FUNCTION
+amqp_connection_state_t
+AMQP_CALL amqp_new_connection_with_options(const amqp_connection_options_t *options);
+
+/*
+ * Creates a connection entirely within the len bytes at buf, which the
+ * caller keeps valid until amqp_destroy_connection and then frees: the
+ * connection state, its socket and outbound buffers and its channel
+ * pools are all carved out of them, so the connection never allocates
+ * from the heap (the socket is still created by its own constructor, but
+ * the buffers an SSL socket writes through come from buf once it is set
+ * on the connection).
+ * Once they are used up, calls that need more memory fail as they would
+ * if malloc failed, and work again when some is released.
+ *
+ * options may be NULL for the defaults; options->allocator is ignored.
+ * Returns NULL if len is too small to set the connection up. Shared body
+ * fragments and detached buffers live in the same memory, so it has to
+ * outlive them too, and as it is not thread-safe they have to be
+ * released on the thread using the connection.
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_connection_state_t
+AMQP_CALL amqp_connection_init_in(void *buf, size_t len,
+                                  const amqp_connection_options_t *options);
+
+/*
+ * Frees the buffers of a connection that nothing refers to: its socket
+ * and outbound buffers, and the memory kept by channel pools that have
+ * been released. They are allocated again as needed. Frames not yet
+ * released are unaffected. Does nothing while a frame is part way
+ * through being received.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_release_idle_buffers(amqp_connection_state_t state);
+
 AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_get_sockfd(amqp_connection_state_t state);
@@ -428,14 +613,224 @@ AMQP_PUBLIC_FUNCTION
 void
 AMQP_CALL amqp_release_buffers(amqp_connection_state_t state);
 
+/*
+ * In lazy mode, methods that have field accessors (see
+ * amqp_method_has_field_accessors) are not decoded as they arrive:
+ * payload.method.decoded is NULL, and individual fields are read from
+ * payload.encoded_method.raw with the generated accessors, e.g.
+ * amqp_basic_deliver_get_delivery_tag(). amqp_decode_method_into decodes
+ * the whole method into caller storage without touching a pool, and
+ * amqp_decode_method still works too. Off by default.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_set_lazy_method_decoding(amqp_connection_state_t state,
+                                        amqp_boolean_t lazy);
+
+/*
+ * Limits which properties of incoming content headers are decoded into
+ * payload.properties.decoded to those whose flags are set in wanted (for
+ * example AMQP_BASIC_CONTENT_TYPE_FLAG). The others are left out of
+ * _flags; amqp_find_encoded_property can still fetch them from
+ * payload.properties.raw. All properties are decoded by default.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_set_decoded_properties(amqp_connection_state_t state,
+                                      amqp_flags_t wanted);
+
+/*
+ * Applies amqp_pool_set_retention to the pools the connection decodes
+ * frames into, one per channel, which are recycled by
+ * amqp_release_buffers and amqp_maybe_release_buffers_on_channel.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_set_pool_retention(amqp_connection_state_t state,
+                                  size_t max_retained_bytes);
+
+/* Memory taken by one type of frame; see amqp_set_memory_debug */
+typedef struct amqp_frame_memory_stats_t_ {
+  uint64_t frames;
+  uint64_t frame_bytes;   /* the frames themselves, header and end included */
+  uint64_t decoded_bytes; /* pool memory taken by what was decoded from them */
+} amqp_frame_memory_stats_t;
+
+/* Memory held by a connection, as reported by amqp_get_memory_stats */
+typedef struct amqp_memory_stats_t_ {
+  /* summed over the pools of every channel, peaks included, so the peaks
+     are an upper bound; amqp_get_channel_memory_stats has each one */
+  amqp_pool_stats_t channel_pools;
+  int channel_pool_count;
+
+  size_t sock_inbound_bytes; /* the buffer the socket is read into */
+  size_t spare_sock_bytes;   /* a second one, kept for reuse */
+  size_t retired_sock_bytes; /* replaced ones channels still have frames in */
+  size_t outbound_bytes;     /* the buffers frames are encoded and held in */
+  size_t socket_bytes;       /* the socket's own, e.g. SSL writev scratch */
+
+  /* only counted while amqp_set_memory_debug is on */
+  amqp_frame_memory_stats_t method_frames;
+  amqp_frame_memory_stats_t header_frames;
+  amqp_frame_memory_stats_t body_frames;
+  amqp_frame_memory_stats_t heartbeat_frames;
+} amqp_memory_stats_t;
+
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_get_memory_stats(amqp_connection_state_t state,
+                                amqp_memory_stats_t *stats);
+
+/*
+ * Fills in stats for the pool that frames received on channel are
+ * decoded into, or zeroes it if nothing has been received on channel
+ * since it was last released. A channel's pool is given up when it is
+ * released, so the stats start again from zero after that.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_get_channel_memory_stats(amqp_connection_state_t state,
+                                        amqp_channel_t channel,
+                                        amqp_pool_stats_t *stats);
+
+/*
+ * While on, each frame decoded is counted against its type in the
+ * per-frame-type fields of amqp_memory_stats_t, along with the pool
+ * memory decoding it took. This costs a little on every frame, so it is
+ * off by default.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_set_memory_debug(amqp_connection_state_t state,
+                                amqp_boolean_t debug);
+
 AMQP_PUBLIC_FUNCTION
 void
 AMQP_CALL amqp_maybe_release_buffers(amqp_connection_state_t state);
 
+typedef enum amqp_release_policy_enum_ {
+  AMQP_RELEASE_MANUAL = 0,        /* only by the amqp_*release_buffers* calls */
+  AMQP_RELEASE_EACH_MESSAGE,      /* at every message boundary */
+  AMQP_RELEASE_AFTER_BYTES,       /* at a boundary once limit bytes of frames
+                                     have been received on the channel */
+  AMQP_RELEASE_ABOVE_POOL_USAGE   /* at a boundary once the channel's pool
+                                     has limit bytes in use, counting the
+                                     socket buffers its frames pin */
+} amqp_release_policy_enum;
+
+/*
+ * Has the connection release each channel's buffers itself, rather
+ * than relying on calls to amqp_maybe_release_buffers and friends. A
+ * channel's buffers are released, if the policy says they are due, when
+ * a method frame starts to arrive on it (it begins the next message or
+ * RPC reply), and when amqp_consume_message has copied a message into
+ * its envelope. A channel with frames still queued is skipped until
+ * they are read.
+ *
+ * With any policy but AMQP_RELEASE_MANUAL, the default, frames and RPC
+ * replies received on a channel are therefore only valid until the
+ * next method frame is received on that channel, whichever call
+ * receives it; frames returned together by amqp_simple_wait_frames stay
+ * valid until the next call. limit is ignored by the first two policies.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_set_release_policy(amqp_connection_state_t state,
+                                  amqp_release_policy_enum policy,
+                                  size_t limit);
+
+/*
+ * Releases the memory held by frames received on channel, unless frames
+ * for that channel are still queued or one is part way through being
+ * received. Frames on other channels are not affected, so buffers can be
+ * reclaimed channel by channel while the connection as a whole never
+ * goes idle. Frames from the channel must not be used afterwards.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_maybe_release_buffers_on_channel(amqp_connection_state_t state,
+                                                amqp_channel_t channel);
+
+/*
+ * Hands the memory of the frames received on channel since its buffers
+ * were last released (the raw frames, whatever was decoded from them, and
+ * the parts of socket buffers they were decoded in place from) over to a
+ * new amqp_detached_buffers_t, without copying it. The frames stay valid
+ * until that is freed with amqp_free_detached_buffers, even after the
+ * connection's buffers are released or the connection is destroyed.
+ *
+ * Pages are handed over whole, so this pays off for large messages;
+ * amqp_consume_message, which copies little more than the properties, is
+ * cheaper for holding on to many small ones.
+ *
+ * Returns NULL if frames for the channel are still queued or one is part
+ * way through being received, or if there is no memory.
+ *
+ * Detached buffers can be freed from any thread, provided the connection's
+ * allocator can be used from it.
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_detached_buffers_t *
+AMQP_CALL amqp_detach_buffers_on_channel(amqp_connection_state_t state,
+                                         amqp_channel_t channel);
+
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_free_detached_buffers(amqp_detached_buffers_t *buffers);
+
+/*
+ * Takes a counted reference to the memory behind a body frame returned by
+ * the connection, and sets body to the fragment. body stays valid, even
+ * after the connection's buffers are released or the connection is
+ * destroyed, until every reference is dropped with
+ * amqp_shared_buffer_release; references can be added with
+ * amqp_shared_buffer_retain. Both of those may be called from any thread,
+ * provided the connection's allocator can be used from it.
+ *
+ * Fragments decoded in place from the socket buffer, which is most of
+ * them, are shared without copying; the rest are copied into a buffer of
+ * their own. Returns NULL if there is no memory for that.
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_shared_buffer_t *
+AMQP_CALL amqp_share_body_fragment(amqp_connection_state_t state,
+                                   const amqp_frame_t *frame,
+                                   amqp_bytes_t *body);
+
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_shared_buffer_retain(amqp_shared_buffer_t *buffer);
+
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_shared_buffer_release(amqp_shared_buffer_t *buffer);
+
 AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_send_frame(amqp_connection_state_t state, amqp_frame_t const *frame);
 
+/*
+ * Holds back frames sent on the connection, so that many small ones go
+ * out in a few large writes. They are sent by amqp_flush, once
+ * flush_threshold bytes are waiting, or before the connection waits to
+ * receive anything. A flush_threshold of 0, the default, sends each
+ * frame straight away, first flushing any that are held. Frames still
+ * held when the connection is destroyed are discarded.
+ *
+ * Errors writing held frames are reported by whichever call sends them.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_set_output_buffering(amqp_connection_state_t state,
+                                    size_t flush_threshold);
+
+/*
+ * Sends any frames held back by amqp_set_output_buffering.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_flush(amqp_connection_state_t state);
+
 AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_table_entry_cmp(void const *entry1, void const *entry2);
@@ -457,6 +852,80 @@ int
 AMQP_CALL amqp_simple_wait_frame(amqp_connection_state_t state,
                                  amqp_frame_t *decoded_frame);
 
+/*
+ * Like amqp_simple_wait_frame, but gives up once timeout has passed
+ * without a whole frame arriving. The socket is only read after poll()
+ * reports it readable. On timeout, 0 is returned with
+ * decoded_frame->frame_type set to 0; anything already received of the
+ * next frame is kept, and the wait can simply be retried later, for
+ * example when an event loop sees amqp_get_sockfd become readable.
+ * A NULL timeout waits indefinitely.
+ *
+ * With an SSL socket, a partly received TLS record can make the wait
+ * overrun timeout.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_simple_wait_frame_timeout(amqp_connection_state_t state,
+                                         amqp_frame_t *decoded_frame,
+                                         struct timeval *timeout);
+
+/*
+ * Returns a frame if one can be had without blocking, i.e.
+ * amqp_simple_wait_frame_timeout with a zero timeout. frame_type is 0
+ * if there is none yet.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_try_wait_frame(amqp_connection_state_t state,
+                              amqp_frame_t *decoded_frame);
+
+/*
+ * Like amqp_simple_wait_frame, but once at least one frame is available,
+ * also returns every other complete frame that has already been received,
+ * up to max_frames, without reading from the socket again. The number of
+ * frames stored in decoded_frames is returned in num_frames. If decoding
+ * fails after some frames have been returned, the error is reported by the
+ * next call.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_simple_wait_frames(amqp_connection_state_t state,
+                                  amqp_frame_t *decoded_frames,
+                                  int max_frames,
+                                  int *num_frames);
+
+/*
+ * Like amqp_simple_wait_frame, but only returns a frame for channel.
+ * Frames for other channels that arrive first are kept, in order, for
+ * amqp_simple_wait_frame; heartbeats among them are dropped.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_simple_wait_frame_on_channel(amqp_connection_state_t state,
+                                            amqp_channel_t channel,
+                                            amqp_frame_t *decoded_frame);
+
+/*
+ * Reads the body of a message on channel straight into buffers, which
+ * are filled in order and must hold at least body_size bytes between
+ * them. To be called after the message's header frame has been
+ * returned by amqp_simple_wait_frame, with the body_size it carries.
+ *
+ * Body bytes that have not already been received are read from the
+ * socket directly into buffers rather than going through the frame
+ * pool. Other frames that arrive in the meantime are kept for
+ * amqp_simple_wait_frame. On failure the connection is left part way
+ * through a frame and should be closed.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_simple_wait_body(amqp_connection_state_t state,
+                                amqp_channel_t channel,
+                                uint64_t body_size,
+                                amqp_bytes_t *buffers,
+                                int num_buffers);
+
 AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_simple_wait_method(amqp_connection_state_t state,
@@ -526,6 +995,108 @@ AMQP_CALL amqp_basic_publish(amqp_connection_state_t state, amqp_channel_t chann
                              struct amqp_basic_properties_t_ const *properties,
                              amqp_bytes_t body);
 
+/* One message of a batch for amqp_basic_publish_batch */
+typedef struct amqp_message_spec_t_ {
+  amqp_bytes_t exchange;
+  amqp_bytes_t routing_key;
+  amqp_boolean_t mandatory;
+  amqp_boolean_t immediate;
+  /* NULL for none */
+  struct amqp_basic_properties_t_ const *properties;
+  amqp_bytes_t body;
+} amqp_message_spec_t;
+
+/*
+ * Publishes n messages on channel, as amqp_basic_publish would each in
+ * turn, but writing their frames to the socket together in as few
+ * writes as they fit in. Unless sent is NULL, *sent is set to how many
+ * of the messages, from the first, were sent whole.
+ *
+ * If a message can't be encoded, those before it are sent and an error
+ * is returned with nothing of it or the messages after it sent. An error
+ * from the socket leaves the connection unusable, and by then more than
+ * *sent messages may have gone out, the last perhaps in part.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_basic_publish_batch(amqp_connection_state_t state,
+                                   amqp_channel_t channel,
+                                   amqp_message_spec_t const *msgs,
+                                   size_t n, size_t *sent);
+
+/*
+ * The basic.publish method and content properties of a message, encoded
+ * once so that many messages can be published with them. The encoded
+ * bytes belong to the template; fill one in with
+ * amqp_publish_template_init and free it with
+ * amqp_publish_template_destroy.
+ */
+typedef struct amqp_publish_template_t_ {
+  amqp_bytes_t method;     /* the arguments of basic.publish */
+  amqp_bytes_t properties; /* the property flags and fields */
+} amqp_publish_template_t;
+
+/*
+ * Encodes the arguments of amqp_basic_publish other than the channel and
+ * body into tmpl. properties may be NULL for none.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_publish_template_init(amqp_publish_template_t *tmpl,
+                                     amqp_bytes_t exchange,
+                                     amqp_bytes_t routing_key,
+                                     amqp_boolean_t mandatory,
+                                     amqp_boolean_t immediate,
+                                     struct amqp_basic_properties_t_ const *properties);
+
+/*
+ * Replaces the properties encoded in tmpl, leaving the method alone.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_publish_template_set_properties(amqp_publish_template_t *tmpl,
+                                               struct amqp_basic_properties_t_ const *properties);
+
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_publish_template_destroy(amqp_publish_template_t *tmpl);
+
+/*
+ * Publishes body on channel as amqp_basic_publish would with the
+ * arguments tmpl was made from, copying their encoded form rather than
+ * encoding them again.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_basic_publish_with_template(amqp_connection_state_t state,
+                                           amqp_channel_t channel,
+                                           amqp_publish_template_t const *tmpl,
+                                           amqp_bytes_t body);
+
+/*
+ * Publishes len bytes of the file fd as the body of a message, as
+ * amqp_basic_publish would, without holding the whole body in memory.
+ * On a plain TCP socket where sendfile(2) is available the file is sent
+ * from the kernel; otherwise, as for SSL sockets, pipes and other files
+ * sendfile can't send from, it is read in a frame at a time. The body
+ * starts at offset in the file, or at the file's own position, which is
+ * then advanced, if offset is negative.
+ *
+ * The frames announce len bytes before the body is read, so an error
+ * part way through, including the file ending early, leaves the
+ * connection unusable.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_basic_publish_fd(amqp_connection_state_t state,
+                                amqp_channel_t channel,
+                                amqp_bytes_t exchange,
+                                amqp_bytes_t routing_key,
+                                amqp_boolean_t mandatory,
+                                amqp_boolean_t immediate,
+                                struct amqp_basic_properties_t_ const *properties,
+                                int fd, int64_t offset, size_t len);
+
 AMQP_PUBLIC_FUNCTION
 amqp_rpc_reply_t
 AMQP_CALL amqp_channel_close(amqp_connection_state_t state, amqp_channel_t channel,
@@ -580,6 +1151,37 @@ AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_encode_table(amqp_bytes_t encoded, amqp_table_t *input, size_t *offset);
 
+/*
+ * Prepares iter to walk the encoded table in encoded, which starts with
+ * the table's 32-bit length. Returns 0, or -ERROR_BAD_AMQP_DATA if the
+ * length runs past the end of encoded.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_iterator_init(amqp_table_iterator_t *iter, amqp_bytes_t encoded);
+
+/*
+ * Decodes the next entry of the table into entry. Returns 1 if an entry
+ * was produced, 0 at the end of the table, or a negative error code.
+ * Keys and string values point into the encoded table; pool is only
+ * used for nested tables and arrays.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_iterator_next(amqp_table_iterator_t *iter, amqp_pool_t *pool,
+                                   amqp_table_entry_t *entry);
+
+/*
+ * Looks up key in an encoded table (length prefix included) without
+ * decoding the entries in front of it. Returns 1 and fills in value if
+ * the key is present, 0 if it is not, or a negative error code. As with
+ * the iterator, only a nested table or array value uses pool.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_lookup(amqp_bytes_t encoded, amqp_bytes_t key,
+                            amqp_pool_t *pool, amqp_field_value_t *value);
+
 struct amqp_connection_info {
   char *user;
   char *password;
@@ -669,4 +1271,50 @@ AMQP_END_DECLS
 
 #include <amqp_framing.h>
 
+AMQP_BEGIN_DECLS
+
+/*
+ * A message received through basic.deliver. Everything it refers to,
+ * the strings, the properties and the body, is owned by the envelope
+ * and stays valid until amqp_destroy_envelope, whatever happens to the
+ * connection's buffers in the meantime.
+ */
+typedef struct amqp_envelope_t_ {
+  amqp_channel_t channel;
+  amqp_bytes_t consumer_tag;
+  uint64_t delivery_tag;
+  amqp_boolean_t redelivered;
+  amqp_bytes_t exchange;
+  amqp_bytes_t routing_key;
+  amqp_basic_properties_t properties;
+  amqp_bytes_t body;
+
+  amqp_pool_t pool; /* holds all of the above */
+} amqp_envelope_t;
+
+/*
+ * Waits for the next message delivered to a consumer and reads the
+ * whole of it, delivery, properties and body, into envelope. The body
+ * is read straight into a single allocation sized from the content
+ * header, with no per-frame copies.
+ *
+ * If the next frame is something other than basic.deliver, such as
+ * basic.cancel or channel.close, it is left to be returned by
+ * amqp_simple_wait_frame, and a library exception is returned;
+ * amqp_frames_enqueued is then true.
+ *
+ * On success the caller must free the envelope with
+ * amqp_destroy_envelope; on failure nothing is left to free.
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_rpc_reply_t
+AMQP_CALL amqp_consume_message(amqp_connection_state_t state,
+                               amqp_envelope_t *envelope);
+
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_destroy_envelope(amqp_envelope_t *envelope);
+
+AMQP_END_DECLS
+
 #endif /* AMQP_H */
@@ -55,6 +55,7 @@ static const char *client_error_strings[ERROR_MAX] = {
   "incompatible AMQP version", /* ERROR_INCOMPATIBLE_AMQP_VERSION */
   "connection closed unexpectedly", /* ERROR_CONNECTION_CLOSED */
   "could not parse AMQP URL", /* ERROR_BAD_AMQP_URL */
+  "unexpected frame", /* ERROR_UNEXPECTED_FRAME */
 };
 
 char *amqp_error_string(int err)
@@ -115,11 +116,6 @@ int amqp_basic_publish(amqp_connection_state_t state,
                        amqp_basic_properties_t const *properties,
                        amqp_bytes_t body)
 {
-  amqp_frame_t f;
-  size_t body_offset;
-  size_t usable_body_payload_size = state->frame_max - (HEADER_SIZE + FOOTER_SIZE);
-  int res;
-
   amqp_basic_publish_t m;
   amqp_basic_properties_t default_properties;
 
@@ -129,52 +125,15 @@ int amqp_basic_publish(amqp_connection_state_t state,
   m.immediate = immediate;
   m.ticket = 0;
 
-  res = amqp_send_method(state, channel, AMQP_BASIC_PUBLISH_METHOD, &m);
-  if (res < 0) {
-    return res;
-  }
-
   if (properties == NULL) {
     memset(&default_properties, 0, sizeof(default_properties));
     properties = &default_properties;
   }
 
-  f.frame_type = AMQP_FRAME_HEADER;
-  f.channel = channel;
-  f.payload.properties.class_id = AMQP_BASIC_CLASS;
-  f.payload.properties.body_size = body.len;
-  f.payload.properties.decoded = (void *) properties;
-
-  res = amqp_send_frame(state, &f);
-  if (res < 0) {
-    return res;
-  }
-
-  body_offset = 0;
-  while (body_offset < body.len) {
-    size_t remaining = body.len - body_offset;
-
-    if (remaining == 0) {
-      break;
-    }
-
-    f.frame_type = AMQP_FRAME_BODY;
-    f.channel = channel;
-    f.payload.body_fragment.bytes = amqp_offset(body.bytes, body_offset);
-    if (remaining >= usable_body_payload_size) {
-      f.payload.body_fragment.len = usable_body_payload_size;
-    } else {
-      f.payload.body_fragment.len = remaining;
-    }
-
-    body_offset += f.payload.body_fragment.len;
-    res = amqp_send_frame(state, &f);
-    if (res < 0) {
-      return res;
-    }
-  }
-
-  return 0;
+  return amqp_send_method_with_content(state, channel,
+                                       AMQP_BASIC_PUBLISH_METHOD, &m,
+                                       AMQP_BASIC_CLASS, (void *)properties,
+                                       body);
 }
 
 amqp_rpc_reply_t amqp_channel_close(amqp_connection_state_t state,
@@ -42,15 +42,23 @@
 #include "amqp_private.h"
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define INITIAL_FRAME_POOL_PAGE_SIZE 65536
-#define INITIAL_DECODING_POOL_PAGE_SIZE 131072
 #define INITIAL_INBOUND_SOCK_BUFFER_SIZE 131072
 
+/* where buffers start, and the socket buffer's floor, with lazy_buffers */
+#define LAZY_INBOUND_SOCK_BUFFER_SIZE 4096
+#define LAZY_OUTBOUND_BUFFER_SIZE 4096
+
+/* channel pools are many and mostly small; frames bigger than a page
+   get blocks of their own */
+#define CHANNEL_POOL_PAGE_SIZE 4096
+
 #define ENFORCE_STATE(statevec, statenum)                                                 \
   {                                                                                       \
     amqp_connection_state_t _check_state = (statevec);                                    \
@@ -63,16 +71,47 @@
 
 amqp_connection_state_t amqp_new_connection(void)
 {
-  int res;
-  amqp_connection_state_t state =
-    (amqp_connection_state_t) calloc(1, sizeof(struct amqp_connection_state_t_));
+  return amqp_new_connection_with_allocator(amqp_get_default_allocator());
+}
 
-  if (state == NULL) {
-    return NULL;
+amqp_connection_state_t
+amqp_new_connection_with_allocator(const amqp_allocator_t *allocator)
+{
+  amqp_connection_options_t options;
+
+  amqp_default_connection_options(&options);
+  options.allocator = allocator;
+  return amqp_new_connection_with_options(&options);
+}
+
+void amqp_default_connection_options(amqp_connection_options_t *options)
+{
+  options->allocator = NULL;
+  options->lazy_buffers = 0;
+  options->idle_release_ms = 0;
+}
+
+static void free_connection_state(amqp_connection_state_t state)
+{
+  if (!state->in_caller_memory) {
+    amqp_mem_free(state->allocator, state,
+                  sizeof(struct amqp_connection_state_t_),
+                  AMQP_MEMORY_CONNECTION);
   }
+}
 
-  init_amqp_pool(&state->frame_pool, INITIAL_FRAME_POOL_PAGE_SIZE);
-  init_amqp_pool(&state->decoding_pool, INITIAL_DECODING_POOL_PAGE_SIZE);
+/* Sets up a zeroed state, or frees it and returns NULL */
+static amqp_connection_state_t
+init_connection(amqp_connection_state_t state,
+                const amqp_allocator_t *allocator,
+                const amqp_connection_options_t *options)
+{
+  int res;
+
+  state->allocator = allocator;
+  state->pool_retention = AMQP_DEFAULT_POOL_RETENTION;
+  state->lazy_buffers = options->lazy_buffers;
+  state->idle_release_ms = options->idle_release_ms;
 
   res = amqp_tune_connection(state, 0, INITIAL_FRAME_POOL_PAGE_SIZE, 0);
   if (-ERROR_NO_MEMORY == res) {
@@ -81,18 +120,26 @@ amqp_connection_state_t amqp_new_connection(void)
     goto out_nomem;
   }
 
-  state->inbound_buffer.bytes = amqp_pool_alloc(&state->frame_pool, state->inbound_buffer.len);
-  if (state->inbound_buffer.bytes == NULL) {
-    goto out_nomem;
-  }
+  state->inbound_buffer.bytes = state->header_buffer;
+  state->inbound_buffer.len = sizeof(state->header_buffer);
+  state->decoded_properties = ~(amqp_flags_t)0;
 
   state->state = CONNECTION_STATE_INITIAL;
   /* the server protocol version response is 8 bytes, which conveniently
      is also the minimum frame size */
   state->target_size = 8;
 
-  state->sock_inbound_buffer.len = INITIAL_INBOUND_SOCK_BUFFER_SIZE;
-  state->sock_inbound_buffer.bytes = malloc(INITIAL_INBOUND_SOCK_BUFFER_SIZE);
+  if (state->lazy_buffers) {
+    /* the socket buffer is allocated by the first read */
+    state->sock_inbound_size = LAZY_INBOUND_SOCK_BUFFER_SIZE;
+    state->sock_inbound_min_size = LAZY_INBOUND_SOCK_BUFFER_SIZE;
+    return state;
+  }
+
+  state->sock_inbound_size = INITIAL_INBOUND_SOCK_BUFFER_SIZE;
+  state->sock_inbound_min_size = MIN_INBOUND_SOCK_BUFFER_SIZE;
+  state->sock_inbound_buffer =
+    amqp_alloc_sock_buffer(allocator, INITIAL_INBOUND_SOCK_BUFFER_SIZE);
   if (state->sock_inbound_buffer.bytes == NULL) {
     goto out_nomem;
   }
@@ -100,13 +147,59 @@ amqp_connection_state_t amqp_new_connection(void)
   return state;
 
 out_nomem:
-  free(state->sock_inbound_buffer.bytes);
-  empty_amqp_pool(&state->frame_pool);
-  empty_amqp_pool(&state->decoding_pool);
-  free(state);
+  amqp_mem_free(allocator, state->outbound_buffer.bytes,
+                state->outbound_buffer.len, AMQP_MEMORY_CONNECTION);
+  free_connection_state(state);
   return NULL;
 }
 
+amqp_connection_state_t
+amqp_new_connection_with_options(const amqp_connection_options_t *options)
+{
+  const amqp_allocator_t *allocator = options->allocator != NULL
+                                      ? options->allocator
+                                      : amqp_get_default_allocator();
+  amqp_connection_state_t state =
+    (amqp_connection_state_t) amqp_mem_calloc(allocator,
+        sizeof(struct amqp_connection_state_t_), AMQP_MEMORY_CONNECTION);
+
+  if (state == NULL) {
+    return NULL;
+  }
+  return init_connection(state, allocator, options);
+}
+
+amqp_connection_state_t
+amqp_connection_init_in(void *buf, size_t len,
+                        const amqp_connection_options_t *options)
+{
+  amqp_connection_options_t defaults;
+  amqp_connection_state_t state;
+  const amqp_allocator_t *allocator;
+  uintptr_t start = ((uintptr_t)buf + sizeof(arena_unit_t) - 1)
+                    / sizeof(arena_unit_t) * sizeof(arena_unit_t);
+  size_t used = (start - (uintptr_t)buf)
+                + sizeof(struct amqp_connection_state_t_);
+
+  if (options == NULL) {
+    amqp_default_connection_options(&defaults);
+    options = &defaults;
+  }
+  if (len < used) {
+    return NULL;
+  }
+
+  /* the state goes first, and the arena has the rest */
+  allocator = amqp_arena_init((char *)buf + used, len - used);
+  if (allocator == NULL) {
+    return NULL;
+  }
+  state = (amqp_connection_state_t)start;
+  memset(state, 0, sizeof(*state));
+  state->in_caller_memory = 1;
+  return init_connection(state, allocator, options);
+}
+
 int amqp_get_sockfd(amqp_connection_state_t state)
 {
   return state->socket ? amqp_socket_get_sockfd(state->socket) : -1;
@@ -127,6 +220,9 @@ void amqp_set_socket(amqp_connection_state_t state, amqp_socket_t *socket)
 {
   amqp_socket_close(state->socket);
   state->socket = socket;
+  /* so that SSL buffers come from the arena of a connection in caller
+     memory too */
+  amqp_socket_set_allocator(socket, state->allocator);
 }
 
 int amqp_tune_connection(amqp_connection_state_t state,
@@ -142,17 +238,26 @@ int amqp_tune_connection(amqp_connection_state_t state,
   state->frame_max = frame_max;
   state->heartbeat = heartbeat;
 
-  empty_amqp_pool(&state->frame_pool);
-  init_amqp_pool(&state->frame_pool, frame_max);
+  if (state->lazy_buffers) {
+    /* a small buffer is kept; it grows to frame_max if a frame needs it */
+    if (state->outbound_buffer.len > (size_t)frame_max) {
+      amqp_mem_free(state->allocator, state->outbound_buffer.bytes,
+                    state->outbound_buffer.len, AMQP_MEMORY_CONNECTION);
+      state->outbound_buffer.bytes = NULL;
+      state->outbound_buffer.len = 0;
+    }
+    return 0;
+  }
 
-  state->inbound_buffer.len = frame_max;
-  state->outbound_buffer.len = frame_max;
-  newbuf = realloc(state->outbound_buffer.bytes, frame_max);
+  newbuf = amqp_mem_realloc(state->allocator, state->outbound_buffer.bytes,
+                            state->outbound_buffer.len, frame_max,
+                            AMQP_MEMORY_CONNECTION);
   if (newbuf == NULL) {
     amqp_destroy_connection(state);
     return -ERROR_NO_MEMORY;
   }
   state->outbound_buffer.bytes = newbuf;
+  state->outbound_buffer.len = frame_max;
 
   return 0;
 }
@@ -162,18 +267,243 @@ int amqp_get_channel_max(amqp_connection_state_t state)
   return state->channel_max;
 }
 
+static void init_channel_pool(amqp_connection_state_t state,
+                              amqp_channel_pool_t *entry)
+{
+  init_amqp_pool_with_allocator(&entry->pool, CHANNEL_POOL_PAGE_SIZE,
+                                state->allocator);
+  amqp_pool_set_retention(&entry->pool, state->pool_retention);
+  /* everything in these pools is written before it is read */
+  amqp_pool_set_zero_fill(&entry->pool, 0);
+  entry->pinned_sock_buffers = NULL;
+  entry->pinned_bytes = 0;
+  entry->received_bytes = 0;
+}
+
+amqp_channel_pool_t *amqp_get_channel_pool(amqp_connection_state_t state,
+                                           amqp_channel_t channel)
+{
+  amqp_channel_pool_t **bucket =
+    &state->channel_pools[channel % CHANNEL_POOL_TABLE_SIZE];
+  amqp_channel_pool_t *entry;
+
+  for (entry = *bucket; entry != NULL; entry = entry->next) {
+    if (entry->channel == channel) {
+      return entry;
+    }
+  }
+
+  if (state->spare_channel_pool != NULL) {
+    entry = state->spare_channel_pool;
+    state->spare_channel_pool = NULL;
+  } else {
+    entry = amqp_mem_alloc(state->allocator, sizeof(amqp_channel_pool_t),
+                           AMQP_MEMORY_CONNECTION);
+    if (entry == NULL) {
+      return NULL;
+    }
+    init_channel_pool(state, entry);
+  }
+  entry->channel = channel;
+
+  entry->next = *bucket;
+  *bucket = entry;
+  return entry;
+}
+
+amqp_channel_pool_t *amqp_find_channel_pool(amqp_connection_state_t state,
+                                            amqp_channel_t channel)
+{
+  amqp_channel_pool_t *entry;
+
+  for (entry = state->channel_pools[channel % CHANNEL_POOL_TABLE_SIZE];
+       entry != NULL; entry = entry->next) {
+    if (entry->channel == channel) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void free_channel_pool(amqp_connection_state_t state,
+                              amqp_channel_pool_t *entry)
+{
+  empty_amqp_pool(&entry->pool);
+  amqp_mem_free(state->allocator, entry, sizeof(amqp_channel_pool_t),
+                AMQP_MEMORY_CONNECTION);
+}
+
+/*
+ * Releases everything in a channel's pool and drops the pool, so that
+ * a connection only keeps pools for channels with frames outstanding.
+ * One released pool is kept, recycled, for whichever channel next
+ * receives a frame.
+ */
+static void release_channel_pool(amqp_connection_state_t state,
+                                 amqp_channel_pool_t *entry)
+{
+  amqp_channel_pool_t **link =
+    &state->channel_pools[entry->channel % CHANNEL_POOL_TABLE_SIZE];
+
+  while (*link != entry) {
+    link = &(*link)->next;
+  }
+  *link = entry->next;
+
+  /* the pin links live in the pool, so this must happen before it is
+     recycled */
+  amqp_unpin_sock_buffers(state, entry->pinned_sock_buffers);
+  entry->pinned_sock_buffers = NULL;
+  entry->pinned_bytes = 0;
+  entry->received_bytes = 0;
+
+  if (state->spare_channel_pool == NULL) {
+    recycle_amqp_pool(&entry->pool);
+    entry->next = NULL;
+    state->spare_channel_pool = entry;
+  } else {
+    free_channel_pool(state, entry);
+  }
+}
+
+static amqp_boolean_t channel_buffers_in_use(amqp_connection_state_t state,
+                                             amqp_channel_t channel);
+
+void amqp_apply_release_policy(amqp_connection_state_t state,
+                               amqp_channel_t channel)
+{
+  amqp_channel_pool_t *entry;
+
+  if (state->release_policy == AMQP_RELEASE_MANUAL || state->release_held) {
+    return;
+  }
+  entry = amqp_find_channel_pool(state, channel);
+  if (entry == NULL || channel_buffers_in_use(state, channel)) {
+    return;
+  }
+
+  switch (state->release_policy) {
+  case AMQP_RELEASE_AFTER_BYTES:
+    if (entry->received_bytes < state->release_limit) {
+      return;
+    }
+    break;
+  case AMQP_RELEASE_ABOVE_POOL_USAGE:
+    if (entry->pool.stats.used_bytes + entry->pinned_bytes
+        < state->release_limit) {
+      return;
+    }
+    break;
+  default:
+    break;
+  }
+  release_channel_pool(state, entry);
+}
+
+void amqp_frame_started(amqp_connection_state_t state, void *raw_frame,
+                        size_t frame_size)
+{
+  amqp_channel_t channel;
+
+  if (state->release_policy == AMQP_RELEASE_MANUAL) {
+    return;
+  }
+
+  channel = amqp_d16(raw_frame, 1);
+  if (amqp_d8(raw_frame, 0) == AMQP_FRAME_METHOD) {
+    amqp_apply_release_policy(state, channel);
+  }
+  if (state->release_policy == AMQP_RELEASE_AFTER_BYTES) {
+    amqp_channel_pool_t *entry = amqp_get_channel_pool(state, channel);
+    if (entry != NULL) {
+      entry->received_bytes += frame_size;
+    }
+  }
+}
+
+void amqp_release_idle_buffers(amqp_connection_state_t state)
+{
+  int i;
+
+  if (state->state == CONNECTION_STATE_HEADER
+      || state->state == CONNECTION_STATE_BODY
+      || amqp_data_in_buffer(state)) {
+    return;
+  }
+
+  /* channels with frames in the socket buffer still pin it */
+  amqp_free_sock_buffer(state->sock_inbound_buffer);
+  state->sock_inbound_buffer.bytes = NULL;
+  state->sock_inbound_buffer.len = 0;
+  state->sock_inbound_offset = 0;
+  state->sock_inbound_limit = 0;
+  amqp_free_sock_buffer(state->spare_sock_buffer);
+  state->spare_sock_buffer.bytes = NULL;
+  state->spare_sock_buffer.len = 0;
+  if (state->lazy_buffers) {
+    state->sock_inbound_size = state->sock_inbound_min_size;
+  }
+
+  amqp_mem_free(state->allocator, state->outbound_buffer.bytes,
+                state->outbound_buffer.len, AMQP_MEMORY_CONNECTION);
+  state->outbound_buffer.bytes = NULL;
+  state->outbound_buffer.len = 0;
+  if (state->held_output_len == 0) {
+    amqp_mem_free(state->allocator, state->held_output.bytes,
+                  state->held_output.len, AMQP_MEMORY_CONNECTION);
+    state->held_output.bytes = NULL;
+    state->held_output.len = 0;
+  }
+
+  if (state->spare_channel_pool != NULL) {
+    free_channel_pool(state, state->spare_channel_pool);
+    state->spare_channel_pool = NULL;
+  }
+  for (i = 0; i < CHANNEL_POOL_TABLE_SIZE; i++) {
+    amqp_channel_pool_t **link = &state->channel_pools[i];
+    while (*link != NULL) {
+      amqp_channel_pool_t *entry = *link;
+      if (entry->pool.stats.used_bytes == 0
+          && entry->pinned_sock_buffers == NULL) {
+        *link = entry->next;
+        free_channel_pool(state, entry);
+      } else {
+        link = &entry->next;
+      }
+    }
+  }
+}
+
 int amqp_destroy_connection(amqp_connection_state_t state)
 {
   int status = 0;
   if (state) {
-    empty_amqp_pool(&state->frame_pool);
-    empty_amqp_pool(&state->decoding_pool);
-    free(state->outbound_buffer.bytes);
-    free(state->sock_inbound_buffer.bytes);
+    const amqp_allocator_t *allocator = state->allocator;
+    int i;
+
+    /* buffers that detached or shared frames still pin are freed by
+       whatever unpins them last */
+    amqp_free_sock_buffer(state->sock_inbound_buffer);
+    amqp_free_sock_buffer(state->spare_sock_buffer);
+    for (i = 0; i < CHANNEL_POOL_TABLE_SIZE; i++) {
+      while (state->channel_pools[i] != NULL) {
+        amqp_channel_pool_t *entry = state->channel_pools[i];
+        state->channel_pools[i] = entry->next;
+        amqp_unpin_sock_buffers(NULL, entry->pinned_sock_buffers);
+        free_channel_pool(state, entry);
+      }
+    }
+    if (state->spare_channel_pool != NULL) {
+      free_channel_pool(state, state->spare_channel_pool);
+    }
+    amqp_mem_free(allocator, state->outbound_buffer.bytes,
+                  state->outbound_buffer.len, AMQP_MEMORY_CONNECTION);
+    amqp_mem_free(allocator, state->held_output.bytes,
+                  state->held_output.len, AMQP_MEMORY_CONNECTION);
     if (amqp_socket_close(state->socket) < 0) {
       status = -amqp_socket_error(state->socket);
     }
-    free(state);
+    free_connection_state(state);
   }
   return status;
 }
@@ -191,12 +521,15 @@ static size_t consume_data(amqp_connection_state_t state,
 {
   /* how much data is available and will fit? */
   size_t bytes_consumed = state->target_size - state->inbound_offset;
+  void *dest = amqp_offset(state->inbound_buffer.bytes, state->inbound_offset);
   if (received_data->len < bytes_consumed) {
     bytes_consumed = received_data->len;
   }
 
-  memcpy(amqp_offset(state->inbound_buffer.bytes, state->inbound_offset),
-         received_data->bytes, bytes_consumed);
+  /* the data may have been read straight into place */
+  if (dest != received_data->bytes) {
+    memcpy(dest, received_data->bytes, bytes_consumed);
+  }
   state->inbound_offset += bytes_consumed;
   received_data->bytes = amqp_offset(received_data->bytes, bytes_consumed);
   received_data->len -= bytes_consumed;
@@ -204,6 +537,148 @@ static size_t consume_data(amqp_connection_state_t state,
   return bytes_consumed;
 }
 
+static size_t channel_pool_used_bytes(amqp_connection_state_t state,
+                                      amqp_channel_t channel)
+{
+  amqp_channel_pool_t *entry = amqp_find_channel_pool(state, channel);
+  return entry != NULL ? entry->pool.stats.used_bytes : 0;
+}
+
+static void count_frame_memory(amqp_connection_state_t state,
+                               const amqp_frame_t *frame, size_t frame_size,
+                               size_t decoded_bytes)
+{
+  amqp_frame_memory_stats_t *stats;
+
+  switch (frame->frame_type) {
+  case AMQP_FRAME_METHOD:
+    stats = &state->method_frame_memory;
+    break;
+  case AMQP_FRAME_HEADER:
+    stats = &state->header_frame_memory;
+    break;
+  case AMQP_FRAME_BODY:
+    stats = &state->body_frame_memory;
+    break;
+  case AMQP_FRAME_HEARTBEAT:
+    stats = &state->heartbeat_frame_memory;
+    break;
+  default:
+    return;
+  }
+
+  stats->frames++;
+  stats->frame_bytes += frame_size;
+  stats->decoded_bytes += decoded_bytes;
+}
+
+static int decode_frame_inner(amqp_connection_state_t state,
+                              void *raw_frame, size_t frame_size,
+                              amqp_frame_t *decoded_frame)
+{
+  amqp_channel_pool_t *channel_pool;
+  amqp_bytes_t encoded;
+  int res;
+
+  /* Check frame end marker (footer) */
+  if (amqp_d8(raw_frame, frame_size - 1) != AMQP_FRAME_END) {
+    return -ERROR_BAD_AMQP_DATA;
+  }
+
+  decoded_frame->frame_type = amqp_d8(raw_frame, 0);
+  decoded_frame->channel = amqp_d16(raw_frame, 1);
+
+  switch (decoded_frame->frame_type) {
+  case AMQP_FRAME_METHOD:
+    decoded_frame->payload.method.id = amqp_d32(raw_frame, HEADER_SIZE);
+    encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 4);
+    encoded.len = frame_size - HEADER_SIZE - 4 - FOOTER_SIZE;
+    decoded_frame->payload.encoded_method.raw = encoded;
+
+    if (state->lazy_method_decoding
+        && amqp_method_has_field_accessors(decoded_frame->payload.method.id)) {
+      decoded_frame->payload.method.decoded = NULL;
+      break;
+    }
+
+    channel_pool = amqp_get_channel_pool(state, decoded_frame->channel);
+    if (channel_pool == NULL) {
+      return -ERROR_NO_MEMORY;
+    }
+    res = amqp_decode_method(decoded_frame->payload.method.id,
+                             &channel_pool->pool, encoded,
+                             &decoded_frame->payload.method.decoded);
+    if (res < 0) {
+      return res;
+    }
+
+    break;
+
+  case AMQP_FRAME_HEADER:
+    decoded_frame->payload.properties.class_id
+      = amqp_d16(raw_frame, HEADER_SIZE);
+    /* unused 2-byte weight field goes here */
+    decoded_frame->payload.properties.body_size
+      = amqp_d64(raw_frame, HEADER_SIZE + 4);
+    encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 12);
+    encoded.len = frame_size - HEADER_SIZE - 12 - FOOTER_SIZE;
+    decoded_frame->payload.properties.raw = encoded;
+
+    channel_pool = amqp_get_channel_pool(state, decoded_frame->channel);
+    if (channel_pool == NULL) {
+      return -ERROR_NO_MEMORY;
+    }
+    res = amqp_decode_properties_selective(
+            decoded_frame->payload.properties.class_id, &channel_pool->pool,
+            encoded, state->decoded_properties,
+            &decoded_frame->payload.properties.decoded);
+    if (res < 0) {
+      return res;
+    }
+
+    break;
+
+  case AMQP_FRAME_BODY:
+    decoded_frame->payload.body_fragment.len
+      = frame_size - HEADER_SIZE - FOOTER_SIZE;
+    decoded_frame->payload.body_fragment.bytes
+      = amqp_offset(raw_frame, HEADER_SIZE);
+    break;
+
+  case AMQP_FRAME_HEARTBEAT:
+    break;
+
+  default:
+    /* Ignore the frame */
+    decoded_frame->frame_type = 0;
+    break;
+  }
+
+  return 0;
+}
+
+static int decode_frame(amqp_connection_state_t state,
+                        void *raw_frame, size_t frame_size,
+                        amqp_frame_t *decoded_frame)
+{
+  amqp_channel_t channel;
+  size_t used_before;
+  int res;
+
+  if (!state->memory_debug) {
+    return decode_frame_inner(state, raw_frame, frame_size, decoded_frame);
+  }
+
+  channel = amqp_d16(raw_frame, 1);
+  used_before = channel_pool_used_bytes(state, channel);
+  res = decode_frame_inner(state, raw_frame, frame_size, decoded_frame);
+  if (res == 0) {
+    count_frame_memory(state, decoded_frame, frame_size,
+                       channel_pool_used_bytes(state, channel) - used_before);
+  }
+  return res;
+}
+
 int amqp_handle_input(amqp_connection_state_t state,
                       amqp_bytes_t received_data,
                       amqp_frame_t *decoded_frame)
@@ -220,16 +695,8 @@ int amqp_handle_input(amqp_connection_state_t state,
   }
 
   if (state->state == CONNECTION_STATE_IDLE) {
-    state->inbound_buffer.bytes = amqp_pool_alloc(&state->frame_pool,
-                                  state->inbound_buffer.len);
-    if (state->inbound_buffer.bytes == NULL)
-      /* state->inbound_buffer.len is always nonzero, because it
-      corresponds to frame_max, which is not permitted to be less
-      than AMQP_FRAME_MIN_SIZE (currently 4096 bytes). */
-    {
-      return -ERROR_NO_MEMORY;
-    }
-
+    state->inbound_buffer.bytes = state->header_buffer;
+    state->inbound_buffer.len = sizeof(state->header_buffer);
     state->state = CONNECTION_STATE_HEADER;
   }
 
@@ -270,8 +737,27 @@ int amqp_handle_input(amqp_connection_state_t state,
     /* frame length is 3 bytes in */
     state->target_size
       = amqp_d32(raw_frame, 3) + HEADER_SIZE + FOOTER_SIZE;
+    amqp_frame_started(state, raw_frame, state->target_size);
     state->state = CONNECTION_STATE_BODY;
 
+    /* now that the size is known, move the frame out of header_buffer
+       into a block of exactly the right size, unless it is empty (a
+       heartbeat, say) and already fits */
+    if (state->target_size > state->inbound_buffer.len) {
+      amqp_channel_pool_t *channel_pool =
+        amqp_get_channel_pool(state, amqp_d16(raw_frame, 1));
+      if (channel_pool == NULL) {
+        return -ERROR_NO_MEMORY;
+      }
+      raw_frame = amqp_pool_alloc(&channel_pool->pool, state->target_size);
+      if (raw_frame == NULL) {
+        return -ERROR_NO_MEMORY;
+      }
+      memcpy(raw_frame, state->header_buffer, state->inbound_offset);
+      state->inbound_buffer.bytes = raw_frame;
+      state->inbound_buffer.len = state->target_size;
+    }
+
     bytes_consumed += consume_data(state, &received_data);
 
     /* do we have target_size data yet? if not, return with the
@@ -283,75 +769,195 @@ int amqp_handle_input(amqp_connection_state_t state,
     /* fall through to process body */
 
   case CONNECTION_STATE_BODY: {
-    amqp_bytes_t encoded;
-    int res;
-
-    /* Check frame end marker (footer) */
-    if (amqp_d8(raw_frame, state->target_size - 1) != AMQP_FRAME_END) {
-      return -ERROR_BAD_AMQP_DATA;
+    int res = decode_frame(state, raw_frame, state->target_size,
+                           decoded_frame);
+    if (res < 0) {
+      return res;
     }
 
-    decoded_frame->frame_type = amqp_d8(raw_frame, 0);
-    decoded_frame->channel = amqp_d16(raw_frame, 1);
+    return_to_idle(state);
+    return bytes_consumed;
+  }
 
-    switch (decoded_frame->frame_type) {
-    case AMQP_FRAME_METHOD:
-      decoded_frame->payload.method.id = amqp_d32(raw_frame, HEADER_SIZE);
-      encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 4);
-      encoded.len = state->target_size - HEADER_SIZE - 4 - FOOTER_SIZE;
+  default:
+    amqp_abort("Internal error: invalid amqp_connection_state_t->state %d", state->state);
+    return bytes_consumed;
+  }
+}
 
-      res = amqp_decode_method(decoded_frame->payload.method.id,
-                               &state->decoding_pool, encoded,
-                               &decoded_frame->payload.method.decoded);
-      if (res < 0) {
-        return res;
-      }
+int amqp_handle_input_in_place(amqp_connection_state_t state,
+                               amqp_bytes_t received_data,
+                               amqp_frame_t *decoded_frame)
+{
+  size_t frame_size;
+  int res;
 
-      break;
+  decoded_frame->frame_type = 0;
 
-    case AMQP_FRAME_HEADER:
-      decoded_frame->payload.properties.class_id
-        = amqp_d16(raw_frame, HEADER_SIZE);
-      /* unused 2-byte weight field goes here */
-      decoded_frame->payload.properties.body_size
-        = amqp_d64(raw_frame, HEADER_SIZE + 4);
-      encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 12);
-      encoded.len = state->target_size - HEADER_SIZE - 12 - FOOTER_SIZE;
-      decoded_frame->payload.properties.raw = encoded;
-
-      res = amqp_decode_properties(decoded_frame->payload.properties.class_id,
-                                   &state->decoding_pool, encoded,
-                                   &decoded_frame->payload.properties.decoded);
-      if (res < 0) {
-        return res;
-      }
+  /* A partially received frame has to be completed through
+     amqp_handle_input, and so does the server's protocol header */
+  if (state->state != CONNECTION_STATE_IDLE
+      || received_data.len < HEADER_SIZE) {
+    return 0;
+  }
 
-      break;
+  frame_size = amqp_d32(received_data.bytes, 3) + HEADER_SIZE + FOOTER_SIZE;
+  if (received_data.len < frame_size) {
+    return 0;
+  }
 
-    case AMQP_FRAME_BODY:
-      decoded_frame->payload.body_fragment.len
-        = state->target_size - HEADER_SIZE - FOOTER_SIZE;
-      decoded_frame->payload.body_fragment.bytes
-        = amqp_offset(raw_frame, HEADER_SIZE);
-      break;
+  amqp_frame_started(state, received_data.bytes, frame_size);
+  res = decode_frame(state, received_data.bytes, frame_size, decoded_frame);
+  if (res < 0) {
+    return res;
+  }
 
-    case AMQP_FRAME_HEARTBEAT:
-      break;
+  return frame_size;
+}
 
-    default:
-      /* Ignore the frame */
-      decoded_frame->frame_type = 0;
-      break;
+int amqp_decode_started_frame(amqp_connection_state_t state,
+                              amqp_bytes_t raw_frame,
+                              amqp_frame_t *decoded_frame)
+{
+  decoded_frame->frame_type = 0;
+  return decode_frame(state, raw_frame.bytes, raw_frame.len, decoded_frame);
+}
+
+void amqp_set_lazy_method_decoding(amqp_connection_state_t state,
+                                   amqp_boolean_t lazy)
+{
+  state->lazy_method_decoding = lazy;
+}
+
+void amqp_set_pool_retention(amqp_connection_state_t state,
+                             size_t max_retained_bytes)
+{
+  int i;
+
+  state->pool_retention = max_retained_bytes;
+  for (i = 0; i < CHANNEL_POOL_TABLE_SIZE; i++) {
+    amqp_channel_pool_t *entry;
+    for (entry = state->channel_pools[i]; entry != NULL; entry = entry->next) {
+      amqp_pool_set_retention(&entry->pool, max_retained_bytes);
     }
+  }
+  if (state->spare_channel_pool != NULL) {
+    amqp_pool_set_retention(&state->spare_channel_pool->pool,
+                            max_retained_bytes);
+  }
+}
 
-    return_to_idle(state);
-    return bytes_consumed;
+void amqp_set_release_policy(amqp_connection_state_t state,
+                             amqp_release_policy_enum policy, size_t limit)
+{
+  state->release_policy = policy;
+  state->release_limit = limit;
+}
+
+void amqp_set_memory_debug(amqp_connection_state_t state,
+                           amqp_boolean_t debug)
+{
+  state->memory_debug = debug;
+}
+
+void amqp_get_channel_memory_stats(amqp_connection_state_t state,
+                                   amqp_channel_t channel,
+                                   amqp_pool_stats_t *stats)
+{
+  amqp_channel_pool_t *entry = amqp_find_channel_pool(state, channel);
+
+  if (entry != NULL) {
+    amqp_pool_get_stats(&entry->pool, stats);
+  } else {
+    memset(stats, 0, sizeof(*stats));
   }
+}
 
-  default:
-    amqp_abort("Internal error: invalid amqp_connection_state_t->state %d", state->state);
-    return bytes_consumed;
+/* Whether link is the first in the channel pools to pin its buffer */
+static amqp_boolean_t first_pin(amqp_connection_state_t state,
+                                amqp_link_t *pin)
+{
+  int i;
+
+  for (i = 0; i < CHANNEL_POOL_TABLE_SIZE; i++) {
+    amqp_channel_pool_t *entry;
+    for (entry = state->channel_pools[i]; entry != NULL; entry = entry->next) {
+      amqp_link_t *link;
+      for (link = entry->pinned_sock_buffers; link != NULL; link = link->next) {
+        if (link == pin) {
+          return 1;
+        }
+        if (link->data == pin->data) {
+          return 0;
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+static void add_pool_stats(amqp_pool_stats_t *sum, amqp_pool_t *pool)
+{
+  amqp_pool_stats_t pool_stats;
+
+  amqp_pool_get_stats(pool, &pool_stats);
+  sum->held_bytes += pool_stats.held_bytes;
+  sum->peak_held_bytes += pool_stats.peak_held_bytes;
+  sum->used_bytes += pool_stats.used_bytes;
+  sum->peak_used_bytes += pool_stats.peak_used_bytes;
+  sum->pages += pool_stats.pages;
+  sum->large_blocks += pool_stats.large_blocks;
+  sum->total_allocs += pool_stats.total_allocs;
+  sum->total_bytes += pool_stats.total_bytes;
+}
+
+void amqp_get_memory_stats(amqp_connection_state_t state,
+                           amqp_memory_stats_t *stats)
+{
+  amqp_shared_buffer_t *current = NULL;
+  int i;
+
+  memset(stats, 0, sizeof(*stats));
+  if (state->sock_inbound_buffer.bytes != NULL) {
+    current = amqp_sock_buffer_of(state->sock_inbound_buffer);
   }
+
+  if (state->spare_channel_pool != NULL) {
+    add_pool_stats(&stats->channel_pools, &state->spare_channel_pool->pool);
+  }
+  for (i = 0; i < CHANNEL_POOL_TABLE_SIZE; i++) {
+    amqp_channel_pool_t *entry;
+    for (entry = state->channel_pools[i]; entry != NULL; entry = entry->next) {
+      amqp_link_t *link;
+
+      add_pool_stats(&stats->channel_pools, &entry->pool);
+      stats->channel_pool_count++;
+
+      /* a buffer pinned by several channels is only counted once */
+      for (link = entry->pinned_sock_buffers; link != NULL; link = link->next) {
+        amqp_shared_buffer_t *pinned = link->data;
+        if (pinned != current && first_pin(state, link)) {
+          stats->retired_sock_bytes += pinned->size;
+        }
+      }
+    }
+  }
+
+  stats->sock_inbound_bytes = state->sock_inbound_buffer.len;
+  stats->spare_sock_bytes = state->spare_sock_buffer.len;
+  stats->outbound_bytes = state->outbound_buffer.len + state->held_output.len;
+  stats->socket_bytes = amqp_socket_buffer_size(state->socket);
+
+  stats->method_frames = state->method_frame_memory;
+  stats->header_frames = state->header_frame_memory;
+  stats->body_frames = state->body_frame_memory;
+  stats->heartbeat_frames = state->heartbeat_frame_memory;
+}
+
+void amqp_set_decoded_properties(amqp_connection_state_t state,
+                                 amqp_flags_t wanted)
+{
+  state->decoded_properties = wanted;
 }
 
 amqp_boolean_t amqp_release_buffers_ok(amqp_connection_state_t state)
@@ -361,14 +967,19 @@ amqp_boolean_t amqp_release_buffers_ok(amqp_connection_state_t state)
 
 void amqp_release_buffers(amqp_connection_state_t state)
 {
+  int i;
+
   ENFORCE_STATE(state, CONNECTION_STATE_IDLE);
 
   if (state->first_queued_frame) {
     amqp_abort("Programming error: attempt to amqp_release_buffers while waiting events enqueued");
   }
 
-  recycle_amqp_pool(&state->frame_pool);
-  recycle_amqp_pool(&state->decoding_pool);
+  for (i = 0; i < CHANNEL_POOL_TABLE_SIZE; i++) {
+    while (state->channel_pools[i] != NULL) {
+      release_channel_pool(state, state->channel_pools[i]);
+    }
+  }
 }
 
 void amqp_maybe_release_buffers(amqp_connection_state_t state)
@@ -378,87 +989,1051 @@ void amqp_maybe_release_buffers(amqp_connection_state_t state)
   }
 }
 
-int amqp_send_frame(amqp_connection_state_t state,
-                    const amqp_frame_t *frame)
+/* Whether frames on channel are queued, or one is part way through being
+   received (it is in its channel's pool) */
+static amqp_boolean_t channel_buffers_in_use(amqp_connection_state_t state,
+                                             amqp_channel_t channel)
 {
-  void *out_frame = state->outbound_buffer.bytes;
-  int res;
+  amqp_link_t *link;
+
+  if (state->state == CONNECTION_STATE_BODY
+      && amqp_d16(state->inbound_buffer.bytes, 1) == channel) {
+    return 1;
+  }
+
+  for (link = state->first_queued_frame; link != NULL; link = link->next) {
+    amqp_frame_t *frame = link->data;
+    if (frame->channel == channel) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void amqp_maybe_release_buffers_on_channel(amqp_connection_state_t state,
+                                           amqp_channel_t channel)
+{
+  amqp_channel_pool_t *entry;
+
+  if (channel_buffers_in_use(state, channel)) {
+    return;
+  }
+
+  entry = amqp_find_channel_pool(state, channel);
+  if (entry != NULL) {
+    release_channel_pool(state, entry);
+  }
+}
+
+amqp_detached_buffers_t *
+amqp_detach_buffers_on_channel(amqp_connection_state_t state,
+                               amqp_channel_t channel)
+{
+  amqp_detached_buffers_t *buffers;
+  amqp_channel_pool_t *entry;
+
+  if (channel_buffers_in_use(state, channel)) {
+    return NULL;
+  }
+  entry = amqp_get_channel_pool(state, channel);
+  if (entry == NULL) {
+    return NULL;
+  }
+  buffers = amqp_mem_alloc(state->allocator, sizeof(amqp_detached_buffers_t),
+                           AMQP_MEMORY_CONNECTION);
+  if (buffers == NULL) {
+    return NULL;
+  }
+
+  /* the pool's pages and blocks, and its pins on socket buffers, change
+     hands; the channel starts again with an empty pool */
+  buffers->allocator = state->allocator;
+  buffers->pool = entry->pool;
+  buffers->pinned_sock_buffers = entry->pinned_sock_buffers;
+
+  init_channel_pool(state, entry);
+
+  return buffers;
+}
+
+void amqp_free_detached_buffers(amqp_detached_buffers_t *buffers)
+{
+  if (buffers != NULL) {
+    amqp_unpin_sock_buffers(NULL, buffers->pinned_sock_buffers);
+    empty_amqp_pool(&buffers->pool);
+    amqp_mem_free(buffers->allocator, buffers,
+                  sizeof(amqp_detached_buffers_t), AMQP_MEMORY_CONNECTION);
+  }
+}
+
+static int resize_outbound_buffer(amqp_connection_state_t state, size_t size)
+{
+  void *newbuf = amqp_mem_realloc(state->allocator,
+                                  state->outbound_buffer.bytes,
+                                  state->outbound_buffer.len, size,
+                                  AMQP_MEMORY_CONNECTION);
+  if (newbuf == NULL) {
+    return -ERROR_NO_MEMORY;
+  }
+  state->outbound_buffer.bytes = newbuf;
+  state->outbound_buffer.len = size;
+  return 0;
+}
+
+/* Lazy buffers start small; returns 1 if the outbound buffer could be
+   grown to frame_max for another go at a frame that didn't fit */
+static int grow_outbound_buffer(amqp_connection_state_t state)
+{
+  return state->outbound_buffer.len < (size_t)state->frame_max
+         && resize_outbound_buffer(state, state->frame_max) == 0;
+}
+
+static int ensure_outbound_buffer(amqp_connection_state_t state)
+{
+  size_t size = state->frame_max;
+
+  if (state->outbound_buffer.bytes != NULL) {
+    return 0;
+  }
+  if (state->lazy_buffers && size > LAZY_OUTBOUND_BUFFER_SIZE) {
+    size = LAZY_OUTBOUND_BUFFER_SIZE;
+  }
+  return resize_outbound_buffer(state, size);
+}
+
+/*
+ * Encodes a method, header or heartbeat frame into the outbound buffer
+ * at offset. Returns the length of the whole frame, or
+ * -ERROR_BAD_AMQP_DATA if it doesn't fit in the rest of the buffer.
+ */
+static int encode_frame_at(amqp_connection_state_t state,
+                           const amqp_frame_t *frame, size_t offset)
+{
+  void *out_frame = amqp_offset(state->outbound_buffer.bytes, offset);
+  size_t room = state->outbound_buffer.len - offset;
+  size_t out_frame_len;
+  amqp_bytes_t encoded;
+  int res;
+
+  /* enough for the fixed part of any of them */
+  if (offset > state->outbound_buffer.len
+      || room < HEADER_SIZE + 12 + FOOTER_SIZE) {
+    return -ERROR_BAD_AMQP_DATA;
+  }
 
   amqp_e8(out_frame, 0, frame->frame_type);
   amqp_e16(out_frame, 1, frame->channel);
 
-  if (frame->frame_type == AMQP_FRAME_BODY) {
-    /* For a body frame, rather than copying data around, we use
-       writev to compose the frame */
-    struct iovec iov[3];
-    uint8_t frame_end_byte = AMQP_FRAME_END;
-    const amqp_bytes_t *body = &frame->payload.body_fragment;
-
-    amqp_e32(out_frame, 3, body->len);
-
-    iov[0].iov_base = out_frame;
-    iov[0].iov_len = HEADER_SIZE;
-    iov[1].iov_base = body->bytes;
-    iov[1].iov_len = body->len;
-    iov[2].iov_base = &frame_end_byte;
-    iov[2].iov_len = FOOTER_SIZE;
-
-    res = amqp_socket_writev(state->socket, iov, 3);
-  } else {
-    size_t out_frame_len;
-    amqp_bytes_t encoded;
+  switch (frame->frame_type) {
+  case AMQP_FRAME_METHOD:
+    amqp_e32(out_frame, HEADER_SIZE, frame->payload.method.id);
+
+    encoded.bytes = amqp_offset(out_frame, HEADER_SIZE + 4);
+    encoded.len = room - HEADER_SIZE - 4 - FOOTER_SIZE;
+
+    res = amqp_encode_method(frame->payload.method.id,
+                             frame->payload.method.decoded, encoded);
+    if (res < 0) {
+      return res;
+    }
+
+    out_frame_len = res + 4;
+    break;
+
+  case AMQP_FRAME_HEADER:
+    amqp_e16(out_frame, HEADER_SIZE, frame->payload.properties.class_id);
+    amqp_e16(out_frame, HEADER_SIZE+2, 0); /* "weight" */
+    amqp_e64(out_frame, HEADER_SIZE+4, frame->payload.properties.body_size);
+
+    encoded.bytes = amqp_offset(out_frame, HEADER_SIZE + 12);
+    encoded.len = room - HEADER_SIZE - 12 - FOOTER_SIZE;
+
+    res = amqp_encode_properties(frame->payload.properties.class_id,
+                                 frame->payload.properties.decoded, encoded);
+    if (res < 0) {
+      return res;
+    }
+
+    out_frame_len = res + 12;
+    break;
+
+  case AMQP_FRAME_HEARTBEAT:
+    out_frame_len = 0;
+    break;
+
+  default:
+    abort();
+  }
+
+  amqp_e32(out_frame, 3, out_frame_len);
+  amqp_e8(out_frame, out_frame_len + HEADER_SIZE, AMQP_FRAME_END);
+  return (int)(out_frame_len + HEADER_SIZE + FOOTER_SIZE);
+}
+
+/* The most pieces gathered into one writev */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define MAX_GATHER_IOV IOV_MAX
+#else
+#define MAX_GATHER_IOV 64
+#endif
+
+/*
+ * Frames waiting to go out together in one writev. Method and header
+ * frames, and the headers and ends of body frames, are encoded one after
+ * another in the outbound buffer; bodies are sent from wherever the
+ * caller has them. The outbound buffer only grows when nothing is
+ * gathered, so the pieces pointing into it stay valid. The last slot is
+ * kept for held output to go out in front.
+ */
+typedef struct gather_t_ {
+  struct iovec iov[MAX_GATHER_IOV];
+  int iovcnt;
+  size_t used; /* bytes of the outbound buffer */
+} gather_t;
+
+static void gather_init(gather_t *out)
+{
+  out->iovcnt = 0;
+  out->used = 0;
+}
+
+/* Adds len bytes at data, joining them onto the last piece if they
+   follow on from it */
+static void gather_bytes(gather_t *out, void *data, size_t len)
+{
+  if (out->iovcnt > 0) {
+    struct iovec *last = &out->iov[out->iovcnt - 1];
+    if ((char *)last->iov_base + last->iov_len == (char *)data) {
+      last->iov_len += len;
+      return;
+    }
+  }
+  out->iov[out->iovcnt].iov_base = data;
+  out->iov[out->iovcnt].iov_len = len;
+  out->iovcnt++;
+}
+
+/* Copies what is gathered onto the end of the held output */
+static int hold_gathered(amqp_connection_state_t state, gather_t *out,
+                         size_t len)
+{
+  int i;
+
+  if (state->held_output_len + len > state->held_output.len) {
+    size_t size = state->held_output.len > 0 ? state->held_output.len : 4096;
+    void *newbuf;
+
+    while (size < state->held_output_len + len) {
+      size *= 2;
+    }
+    newbuf = amqp_mem_realloc(state->allocator, state->held_output.bytes,
+                              state->held_output.len, size,
+                              AMQP_MEMORY_CONNECTION);
+    if (newbuf == NULL) {
+      return -ERROR_NO_MEMORY;
+    }
+    state->held_output.bytes = newbuf;
+    state->held_output.len = size;
+  }
+
+  for (i = 0; i < out->iovcnt; i++) {
+    memcpy(amqp_offset(state->held_output.bytes, state->held_output_len),
+           out->iov[i].iov_base, out->iov[i].iov_len);
+    state->held_output_len += out->iov[i].iov_len;
+  }
+  return 0;
+}
 
-    switch (frame->frame_type) {
-    case AMQP_FRAME_METHOD:
-      amqp_e32(out_frame, HEADER_SIZE, frame->payload.method.id);
+/* Sends what is gathered, behind any held output */
+static int gather_send(amqp_connection_state_t state, gather_t *out)
+{
+  int res = 0;
+
+  if (state->held_output_len > 0) {
+    /* gathering leaves a slot free for this */
+    memmove(&out->iov[1], &out->iov[0], out->iovcnt * sizeof(struct iovec));
+    out->iov[0].iov_base = state->held_output.bytes;
+    out->iov[0].iov_len = state->held_output_len;
+    out->iovcnt++;
+    state->held_output_len = 0;
+  }
+  if (out->iovcnt > 0
+      && amqp_socket_writev_all(state->socket, out->iov, out->iovcnt) < 0) {
+    res = -amqp_socket_error(state->socket);
+  }
+  gather_init(out);
+  return res;
+}
 
-      encoded.bytes = amqp_offset(out_frame, HEADER_SIZE + 4);
-      encoded.len = state->outbound_buffer.len - HEADER_SIZE - 4 - FOOTER_SIZE;
+/* Like gather_send, but with output buffering on what is gathered is
+   held instead while the total stays under the threshold */
+static int gather_flush(amqp_connection_state_t state, gather_t *out)
+{
+  size_t len = 0;
+  int res;
+  int i;
+
+  for (i = 0; i < out->iovcnt; i++) {
+    len += out->iov[i].iov_len;
+  }
+
+  if (state->output_threshold > 0
+      && state->held_output_len + len < state->output_threshold) {
+    res = hold_gathered(state, out, len);
+    gather_init(out);
+    return res;
+  }
+  return gather_send(state, out);
+}
+
+/* Adds a method, header or heartbeat frame, first sending what is
+   gathered if there is no room for it */
+static int gather_frame(amqp_connection_state_t state, gather_t *out,
+                        const amqp_frame_t *frame)
+{
+  int res;
+
+  if (out->iovcnt == MAX_GATHER_IOV - 1) {
+    res = gather_flush(state, out);
+    if (res < 0) {
+      return res;
+    }
+  }
 
-      res = amqp_encode_method(frame->payload.method.id,
-                               frame->payload.method.decoded, encoded);
+  while ((res = encode_frame_at(state, frame, out->used))
+         == -ERROR_BAD_AMQP_DATA) {
+    if (out->used == 0) {
+      if (!grow_outbound_buffer(state)) {
+        return res;
+      }
+    } else {
+      res = gather_flush(state, out);
       if (res < 0) {
         return res;
       }
+    }
+  }
+  if (res < 0) {
+    return res;
+  }
 
-      out_frame_len = res + 4;
-      break;
+  gather_bytes(out, amqp_offset(state->outbound_buffer.bytes, out->used),
+               res);
+  out->used += res;
+  return 0;
+}
 
-    case AMQP_FRAME_HEADER:
-      amqp_e16(out_frame, HEADER_SIZE, frame->payload.properties.class_id);
-      amqp_e16(out_frame, HEADER_SIZE+2, 0); /* "weight" */
-      amqp_e64(out_frame, HEADER_SIZE+4, frame->payload.properties.body_size);
+/* Adds a frame whose payload is prefix followed by payload, both
+   already encoded */
+static int gather_encoded_frame(amqp_connection_state_t state, gather_t *out,
+                                uint8_t frame_type, amqp_channel_t channel,
+                                const void *prefix, size_t prefix_len,
+                                amqp_bytes_t payload)
+{
+  size_t frame_len = HEADER_SIZE + prefix_len + payload.len + FOOTER_SIZE;
+  void *frame;
+  int res;
 
-      encoded.bytes = amqp_offset(out_frame, HEADER_SIZE + 12);
-      encoded.len = state->outbound_buffer.len - HEADER_SIZE - 12 - FOOTER_SIZE;
+  if (out->iovcnt == MAX_GATHER_IOV - 1) {
+    res = gather_flush(state, out);
+    if (res < 0) {
+      return res;
+    }
+  }
 
-      res = amqp_encode_properties(frame->payload.properties.class_id,
-                                   frame->payload.properties.decoded, encoded);
+  while (out->used + frame_len > state->outbound_buffer.len) {
+    if (out->used == 0) {
+      if (!grow_outbound_buffer(state)) {
+        return -ERROR_BAD_AMQP_DATA;
+      }
+    } else {
+      res = gather_flush(state, out);
       if (res < 0) {
         return res;
       }
+    }
+  }
+
+  frame = amqp_offset(state->outbound_buffer.bytes, out->used);
+  amqp_e8(frame, 0, frame_type);
+  amqp_e16(frame, 1, channel);
+  amqp_e32(frame, 3, frame_len - HEADER_SIZE - FOOTER_SIZE);
+  memcpy(amqp_offset(frame, HEADER_SIZE), prefix, prefix_len);
+  if (payload.len > 0) {
+    memcpy(amqp_offset(frame, HEADER_SIZE + prefix_len), payload.bytes,
+           payload.len);
+  }
+  amqp_e8(frame, frame_len - FOOTER_SIZE, AMQP_FRAME_END);
+
+  gather_bytes(out, frame, frame_len);
+  out->used += frame_len;
+  return 0;
+}
+
+/* Bodies up to this size are copied in with their frame, rather than
+   taking a piece of the writev to themselves */
+#define GATHER_COPY_MAX 512
+
+/* Adds a body frame; the body itself is sent from where it is, unless
+   it is small */
+static int gather_body_frame(amqp_connection_state_t state, gather_t *out,
+                             amqp_channel_t channel, amqp_bytes_t body)
+{
+  void *frame_header;
+  amqp_boolean_t copy_body = body.len <= GATHER_COPY_MAX
+                             && HEADER_SIZE + body.len + FOOTER_SIZE
+                                <= state->outbound_buffer.len;
+  size_t frame_len = HEADER_SIZE + FOOTER_SIZE + (copy_body ? body.len : 0);
+  int res;
+
+  if (out->iovcnt + 3 > MAX_GATHER_IOV - 1
+      || out->used + frame_len > state->outbound_buffer.len) {
+    res = gather_flush(state, out);
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  frame_header = amqp_offset(state->outbound_buffer.bytes, out->used);
+  amqp_e8(frame_header, 0, AMQP_FRAME_BODY);
+  amqp_e16(frame_header, 1, channel);
+  amqp_e32(frame_header, 3, body.len);
+
+  if (copy_body) {
+    if (body.len > 0) {
+      memcpy(amqp_offset(frame_header, HEADER_SIZE), body.bytes, body.len);
+    }
+    amqp_e8(frame_header, HEADER_SIZE + body.len, AMQP_FRAME_END);
+    gather_bytes(out, frame_header, frame_len);
+    out->used += frame_len;
+    return 0;
+  }
+
+  /* the frame end goes straight after the header in the buffer, so
+     that it joins up with whatever is gathered next */
+  amqp_e8(frame_header, HEADER_SIZE, AMQP_FRAME_END);
+
+  gather_bytes(out, frame_header, HEADER_SIZE);
+  gather_bytes(out, body.bytes, body.len);
+  gather_bytes(out, amqp_offset(frame_header, HEADER_SIZE), FOOTER_SIZE);
+  out->used += frame_len;
+  return 0;
+}
+
+/* Adds body in as many body frames as frame_max calls for */
+static int gather_body_frames(amqp_connection_state_t state, gather_t *out,
+                              amqp_channel_t channel, amqp_bytes_t body)
+{
+  size_t usable_body_payload_size =
+    state->frame_max - (HEADER_SIZE + FOOTER_SIZE);
+  size_t body_offset;
+  int res;
+
+  for (body_offset = 0; body_offset < body.len;
+       body_offset += usable_body_payload_size) {
+    amqp_bytes_t fragment;
+
+    fragment.bytes = amqp_offset(body.bytes, body_offset);
+    fragment.len = body.len - body_offset;
+    if (fragment.len > usable_body_payload_size) {
+      fragment.len = usable_body_payload_size;
+    }
+    res = gather_body_frame(state, out, channel, fragment);
+    if (res < 0) {
+      return res;
+    }
+  }
+  return 0;
+}
+
+int amqp_send_frame(amqp_connection_state_t state,
+                    const amqp_frame_t *frame)
+{
+  gather_t out;
+  int res;
+
+  res = ensure_outbound_buffer(state);
+  if (res < 0) {
+    return res;
+  }
+
+  gather_init(&out);
+  if (frame->frame_type == AMQP_FRAME_BODY) {
+    res = gather_body_frame(state, &out, frame->channel,
+                            frame->payload.body_fragment);
+  } else {
+    res = gather_frame(state, &out, frame);
+  }
+  if (res < 0) {
+    return res;
+  }
+  return gather_flush(state, &out);
+}
+
+/*
+ * Adds a method frame and the content header after it, both or neither,
+ * so that a method that can't be encoded doesn't leave half a message
+ * behind. Returns 1, having added nothing, if they don't fit behind
+ * what is already gathered and that has to be sent first.
+ */
+static int gather_content_head(amqp_connection_state_t state,
+                               gather_t *out,
+                               amqp_channel_t channel,
+                               amqp_method_number_t method_id,
+                               void *decoded_method,
+                               uint16_t class_id,
+                               void *decoded_properties,
+                               uint64_t body_size)
+{
+  amqp_frame_t method;
+  amqp_frame_t header;
+  int method_len;
+  int header_len;
+
+  method.frame_type = AMQP_FRAME_METHOD;
+  method.channel = channel;
+  method.payload.method.id = method_id;
+  method.payload.method.decoded = decoded_method;
+
+  header.frame_type = AMQP_FRAME_HEADER;
+  header.channel = channel;
+  header.payload.properties.class_id = class_id;
+  header.payload.properties.body_size = body_size;
+  header.payload.properties.decoded = decoded_properties;
+
+  if (out->iovcnt == MAX_GATHER_IOV - 1) {
+    return 1;
+  }
 
-      out_frame_len = res + 12;
+  while (1) {
+    int res;
+
+    method_len = encode_frame_at(state, &method, out->used);
+    header_len = method_len < 0 ? method_len
+                 : encode_frame_at(state, &header, out->used + method_len);
+    if (header_len >= 0) {
       break;
+    }
+    res = header_len;
+    if (res != -ERROR_BAD_AMQP_DATA) {
+      return res;
+    }
+    if (out->used > 0) {
+      return 1;
+    }
+    if (!grow_outbound_buffer(state)) {
+      return res;
+    }
+  }
+
+  gather_bytes(out, amqp_offset(state->outbound_buffer.bytes, out->used),
+               method_len + header_len);
+  out->used += method_len + header_len;
+  return 0;
+}
+
+/* Adds a method frame followed by a content header and body frames */
+static int gather_method_with_content(amqp_connection_state_t state,
+                                      gather_t *out,
+                                      amqp_channel_t channel,
+                                      amqp_method_number_t method_id,
+                                      void *decoded_method,
+                                      uint16_t class_id,
+                                      void *decoded_properties,
+                                      amqp_bytes_t body)
+{
+  int res = gather_content_head(state, out, channel, method_id,
+                                decoded_method, class_id,
+                                decoded_properties, body.len);
+  if (res == 1) {
+    res = gather_flush(state, out);
+    if (res < 0) {
+      return res;
+    }
+    res = gather_content_head(state, out, channel, method_id,
+                              decoded_method, class_id,
+                              decoded_properties, body.len);
+  }
+  if (res < 0) {
+    return res;
+  }
+
+  return gather_body_frames(state, out, channel, body);
+}
+
+int amqp_send_method_with_content(amqp_connection_state_t state,
+                                  amqp_channel_t channel,
+                                  amqp_method_number_t method_id,
+                                  void *decoded_method,
+                                  uint16_t class_id,
+                                  void *decoded_properties,
+                                  amqp_bytes_t body)
+{
+  gather_t out;
+  int res;
+
+  res = ensure_outbound_buffer(state);
+  if (res < 0) {
+    return res;
+  }
+
+  gather_init(&out);
+  res = gather_method_with_content(state, &out, channel, method_id,
+                                   decoded_method, class_id,
+                                   decoded_properties, body);
+  if (res < 0) {
+    return res;
+  }
+  return gather_flush(state, &out);
+}
+
+int amqp_basic_publish_batch(amqp_connection_state_t state,
+                             amqp_channel_t channel,
+                             const amqp_message_spec_t *msgs,
+                             size_t n, size_t *sent)
+{
+  amqp_basic_properties_t default_properties;
+  gather_t out;
+  size_t done = 0; /* messages known to be sent or held whole */
+  size_t i;
+  int res;
+
+  if (sent != NULL) {
+    *sent = 0;
+  }
+  res = ensure_outbound_buffer(state);
+  if (res < 0) {
+    return res;
+  }
 
-    case AMQP_FRAME_HEARTBEAT:
-      out_frame_len = 0;
+  memset(&default_properties, 0, sizeof(default_properties));
+  gather_init(&out);
+  for (i = 0; i < n; i++) {
+    amqp_basic_publish_t m;
+    const amqp_basic_properties_t *properties = msgs[i].properties;
+
+    m.ticket = 0;
+    m.exchange = msgs[i].exchange;
+    m.routing_key = msgs[i].routing_key;
+    m.mandatory = msgs[i].mandatory;
+    m.immediate = msgs[i].immediate;
+    if (properties == NULL) {
+      properties = &default_properties;
+    }
+
+    /* everything gathered so far is whole messages, so this is where
+       they can go out if message i can't be encoded */
+    res = gather_content_head(state, &out, channel,
+                              AMQP_BASIC_PUBLISH_METHOD, &m,
+                              AMQP_BASIC_CLASS, (void *)properties,
+                              msgs[i].body.len);
+    if (res == 1) {
+      res = gather_flush(state, &out);
+      if (res < 0) {
+        break;
+      }
+      done = i;
+      res = gather_content_head(state, &out, channel,
+                                AMQP_BASIC_PUBLISH_METHOD, &m,
+                                AMQP_BASIC_CLASS, (void *)properties,
+                                msgs[i].body.len);
+    }
+    if (res < 0) {
+      if (gather_flush(state, &out) == 0) {
+        done = i;
+      }
       break;
+    }
 
-    default:
-      abort();
+    /* from here on only the socket can fail */
+    res = gather_body_frames(state, &out, channel, msgs[i].body);
+    if (res < 0) {
+      break;
+    }
+    if (out.iovcnt == 0) {
+      done = i + 1;
     }
+  }
 
-    amqp_e32(out_frame, 3, out_frame_len);
-    amqp_e8(out_frame, out_frame_len + HEADER_SIZE, AMQP_FRAME_END);
-    res = amqp_socket_send(state->socket, out_frame,
-                           out_frame_len + HEADER_SIZE + FOOTER_SIZE,
-                           MSG_NOSIGNAL);
+  if (res >= 0) {
+    res = gather_flush(state, &out);
+    if (res == 0) {
+      done = n;
+    }
   }
+  if (sent != NULL) {
+    *sent = done;
+  }
+  return res;
+}
+
+/*
+ * Encodes the arguments of basic.publish, or if decoded_method is NULL
+ * the basic properties, into freshly allocated bytes of just the right
+ * size.
+ */
+static int encode_template_part(amqp_bytes_t *encoded, void *decoded_method,
+                                void *decoded_properties)
+{
+  size_t size = 256;
+
+  while (1) {
+    amqp_bytes_t scratch = amqp_bytes_malloc(size);
+    int res;
+
+    if (scratch.bytes == NULL) {
+      return -ERROR_NO_MEMORY;
+    }
+    if (decoded_method != NULL) {
+      res = amqp_encode_method(AMQP_BASIC_PUBLISH_METHOD, decoded_method,
+                               scratch);
+    } else {
+      res = amqp_encode_properties(AMQP_BASIC_CLASS, decoded_properties,
+                                   scratch);
+    }
+
+    if (res >= 0) {
+      *encoded = amqp_bytes_malloc(res);
+      if (encoded->bytes == NULL && res > 0) {
+        amqp_bytes_free(scratch);
+        return -ERROR_NO_MEMORY;
+      }
+      if (res > 0) {
+        memcpy(encoded->bytes, scratch.bytes, res);
+      }
+      amqp_bytes_free(scratch);
+      return 0;
+    }
+
+    amqp_bytes_free(scratch);
+    if (res != -ERROR_BAD_AMQP_DATA || size > INT_MAX / 2) {
+      return res;
+    }
+    size *= 2;
+  }
+}
+
+int amqp_publish_template_init(amqp_publish_template_t *tmpl,
+                               amqp_bytes_t exchange,
+                               amqp_bytes_t routing_key,
+                               amqp_boolean_t mandatory,
+                               amqp_boolean_t immediate,
+                               const amqp_basic_properties_t *properties)
+{
+  amqp_basic_publish_t m;
+  int res;
 
+  tmpl->method = amqp_empty_bytes;
+  tmpl->properties = amqp_empty_bytes;
+
+  m.ticket = 0;
+  m.exchange = exchange;
+  m.routing_key = routing_key;
+  m.mandatory = mandatory;
+  m.immediate = immediate;
+  res = encode_template_part(&tmpl->method, &m, NULL);
   if (res < 0) {
-    return -amqp_socket_error(state->socket);
-  } else {
+    return res;
+  }
+
+  res = amqp_publish_template_set_properties(tmpl, properties);
+  if (res < 0) {
+    amqp_publish_template_destroy(tmpl);
+  }
+  return res;
+}
+
+int amqp_publish_template_set_properties(amqp_publish_template_t *tmpl,
+                                         const amqp_basic_properties_t *properties)
+{
+  amqp_basic_properties_t default_properties;
+  amqp_bytes_t encoded;
+  int res;
+
+  if (properties == NULL) {
+    memset(&default_properties, 0, sizeof(default_properties));
+    properties = &default_properties;
+  }
+
+  res = encode_template_part(&encoded, NULL, (void *)properties);
+  if (res < 0) {
+    return res;
+  }
+  amqp_bytes_free(tmpl->properties);
+  tmpl->properties = encoded;
+  return 0;
+}
+
+void amqp_publish_template_destroy(amqp_publish_template_t *tmpl)
+{
+  amqp_bytes_free(tmpl->method);
+  amqp_bytes_free(tmpl->properties);
+  tmpl->method = amqp_empty_bytes;
+  tmpl->properties = amqp_empty_bytes;
+}
+
+int amqp_basic_publish_with_template(amqp_connection_state_t state,
+                                     amqp_channel_t channel,
+                                     const amqp_publish_template_t *tmpl,
+                                     amqp_bytes_t body)
+{
+  size_t head_len = HEADER_SIZE + 4 + tmpl->method.len + FOOTER_SIZE
+                    + HEADER_SIZE + 12 + tmpl->properties.len + FOOTER_SIZE;
+  char prefix[12];
+  gather_t out;
+  int res;
+
+  res = ensure_outbound_buffer(state);
+  if (res < 0) {
+    return res;
+  }
+  /* make room for the method and header frames together first, so that
+     the method never goes out without its header */
+  while (head_len > state->outbound_buffer.len) {
+    if (!grow_outbound_buffer(state)) {
+      return -ERROR_BAD_AMQP_DATA;
+    }
+  }
+  gather_init(&out);
+
+  amqp_e32(prefix, 0, AMQP_BASIC_PUBLISH_METHOD);
+  res = gather_encoded_frame(state, &out, AMQP_FRAME_METHOD, channel,
+                             prefix, 4, tmpl->method);
+  if (res < 0) {
+    return res;
+  }
+
+  amqp_e16(prefix, 0, AMQP_BASIC_CLASS);
+  amqp_e16(prefix, 2, 0); /* "weight" */
+  amqp_e64(prefix, 4, body.len);
+  res = gather_encoded_frame(state, &out, AMQP_FRAME_HEADER, channel,
+                             prefix, 12, tmpl->properties);
+  if (res < 0) {
+    return res;
+  }
+
+  res = gather_body_frames(state, &out, channel, body);
+  if (res < 0) {
+    return res;
+  }
+
+  return gather_flush(state, &out);
+}
+
+/* Makes room for size more bytes of the outbound buffer and one more
+   piece, sending what is gathered if need be */
+static int gather_room(amqp_connection_state_t state, gather_t *out,
+                       size_t size)
+{
+  if (out->iovcnt == MAX_GATHER_IOV - 1
+      || out->used + size > state->outbound_buffer.len) {
+    return gather_flush(state, out);
+  }
+  return 0;
+}
+
+/* Adds len bytes read from fd, a buffer at a time */
+static int gather_file_bytes(amqp_connection_state_t state, gather_t *out,
+                             int fd, int64_t *offset, size_t len)
+{
+  while (len > 0) {
+    size_t room = state->outbound_buffer.len - out->used;
+    void *dest = amqp_offset(state->outbound_buffer.bytes, out->used);
+    ssize_t res;
+
+    if (room == 0 || out->iovcnt == MAX_GATHER_IOV - 1) {
+      res = gather_flush(state, out);
+      if (res < 0) {
+        return (int)res;
+      }
+      continue;
+    }
+
+    res = amqp_os_file_read(fd, dest, room < len ? room : len, offset);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -(ERROR_CATEGORY_OS | errno);
+    }
+    if (res == 0) {
+      /* the file is shorter than the header frame said */
+      return -ERROR_BAD_AMQP_DATA;
+    }
+    gather_bytes(out, dest, res);
+    out->used += res;
+    len -= res;
+  }
+  return 0;
+}
+
+/*
+ * Sends what is gathered, then up to *len bytes of fd with sendfile,
+ * taking off *len what was sent. Returns 1 if the file can't be sent
+ * that way and nothing of it has been, so it has to be read instead.
+ */
+static int send_file_bytes(amqp_connection_state_t state, gather_t *out,
+                           int fd, int64_t *offset, size_t *len,
+                           amqp_boolean_t first)
+{
+  int res = gather_send(state, out);
+  if (res < 0) {
+    return res;
+  }
+
+  while (*len > 0) {
+    off_t file_offset = offset == NULL ? 0 : (off_t)*offset;
+    ssize_t sent;
+
+    if (offset != NULL && file_offset != *offset) {
+      return -(ERROR_CATEGORY_OS | EOVERFLOW);
+    }
+    sent = amqp_socket_sendfile(state->socket, fd,
+                                offset == NULL ? NULL : &file_offset, *len);
+    if (sent < 0) {
+      int error = amqp_socket_error(state->socket);
+      if (error == (ERROR_CATEGORY_OS | EINTR)) {
+        continue;
+      }
+      if (first && (error == (ERROR_CATEGORY_OS | EINVAL)
+                    || error == (ERROR_CATEGORY_OS | ENOSYS))) {
+        return 1;
+      }
+      return -error;
+    }
+    if (sent == 0) {
+      return -ERROR_BAD_AMQP_DATA;
+    }
+    if (offset != NULL) {
+      *offset = file_offset;
+    }
+    first = 0;
+    *len -= sent;
+  }
+  return 0;
+}
+
+int amqp_basic_publish_fd(amqp_connection_state_t state,
+                          amqp_channel_t channel,
+                          amqp_bytes_t exchange,
+                          amqp_bytes_t routing_key,
+                          amqp_boolean_t mandatory,
+                          amqp_boolean_t immediate,
+                          const amqp_basic_properties_t *properties,
+                          int fd, int64_t offset, size_t len)
+{
+  size_t usable_body_payload_size =
+    state->frame_max - (HEADER_SIZE + FOOTER_SIZE);
+  amqp_basic_properties_t default_properties;
+  amqp_boolean_t use_sendfile = amqp_socket_can_sendfile(state->socket);
+  amqp_boolean_t first = 1;
+  int64_t *file_offset = offset < 0 ? NULL : &offset;
+  size_t body_offset;
+  amqp_basic_publish_t m;
+  amqp_frame_t f;
+  gather_t out;
+  int res;
+
+  res = ensure_outbound_buffer(state);
+  if (res < 0) {
+    return res;
+  }
+  /* file contents are read in a frame at a time if need be */
+  grow_outbound_buffer(state);
+  gather_init(&out);
+
+  m.ticket = 0;
+  m.exchange = exchange;
+  m.routing_key = routing_key;
+  m.mandatory = mandatory;
+  m.immediate = immediate;
+  if (properties == NULL) {
+    memset(&default_properties, 0, sizeof(default_properties));
+    properties = &default_properties;
+  }
+
+  f.frame_type = AMQP_FRAME_METHOD;
+  f.channel = channel;
+  f.payload.method.id = AMQP_BASIC_PUBLISH_METHOD;
+  f.payload.method.decoded = &m;
+  res = gather_frame(state, &out, &f);
+  if (res < 0) {
+    return res;
+  }
+
+  f.frame_type = AMQP_FRAME_HEADER;
+  f.payload.properties.class_id = AMQP_BASIC_CLASS;
+  f.payload.properties.body_size = len;
+  f.payload.properties.decoded = (void *)properties;
+  res = gather_frame(state, &out, &f);
+  if (res < 0) {
+    return res;
+  }
+
+  for (body_offset = 0; body_offset < len;
+       body_offset += usable_body_payload_size) {
+    size_t fragment_len = len - body_offset;
+    void *frame_header;
+
+    if (fragment_len > usable_body_payload_size) {
+      fragment_len = usable_body_payload_size;
+    }
+
+    res = gather_room(state, &out, HEADER_SIZE);
+    if (res < 0) {
+      return res;
+    }
+    frame_header = amqp_offset(state->outbound_buffer.bytes, out.used);
+    amqp_e8(frame_header, 0, AMQP_FRAME_BODY);
+    amqp_e16(frame_header, 1, channel);
+    amqp_e32(frame_header, 3, fragment_len);
+    gather_bytes(&out, frame_header, HEADER_SIZE);
+    out.used += HEADER_SIZE;
+
+    if (use_sendfile) {
+      res = send_file_bytes(state, &out, fd, file_offset, &fragment_len,
+                            first);
+      if (res < 0) {
+        return res;
+      }
+      use_sendfile = res == 0;
+      first = 0;
+    }
+    res = gather_file_bytes(state, &out, fd, file_offset, fragment_len);
+    if (res < 0) {
+      return res;
+    }
+
+    res = gather_room(state, &out, FOOTER_SIZE);
+    if (res < 0) {
+      return res;
+    }
+    amqp_e8(state->outbound_buffer.bytes, out.used, AMQP_FRAME_END);
+    gather_bytes(&out, amqp_offset(state->outbound_buffer.bytes, out.used),
+                 FOOTER_SIZE);
+    out.used += FOOTER_SIZE;
+  }
+
+  return gather_flush(state, &out);
+}
+
+int amqp_flush(amqp_connection_state_t state)
+{
+  gather_t out;
+
+  if (state->held_output_len == 0) {
     return 0;
   }
+  gather_init(&out);
+  return gather_send(state, &out);
+}
+
+int amqp_set_output_buffering(amqp_connection_state_t state,
+                              size_t flush_threshold)
+{
+  state->output_threshold = flush_threshold;
+  if (flush_threshold == 0) {
+    return amqp_flush(state);
+  }
+  return 0;
 }
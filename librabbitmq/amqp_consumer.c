@@ -0,0 +1,168 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The decoded properties and any tables in them take pages of the
+   envelope's pool; the strings and the body share one large block. */
+#define ENVELOPE_POOL_PAGE_SIZE 4096
+
+static amqp_rpc_reply_t consume_error(amqp_envelope_t *envelope, int res)
+{
+  amqp_rpc_reply_t result;
+
+  amqp_destroy_envelope(envelope);
+
+  memset(&result, 0, sizeof(result));
+  result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+  result.library_error = -res;
+  return result;
+}
+
+amqp_rpc_reply_t amqp_consume_message(amqp_connection_state_t state,
+                                      amqp_envelope_t *envelope)
+{
+  amqp_rpc_reply_t result;
+  amqp_frame_t frame;
+  amqp_bytes_t args;
+  amqp_bytes_t props;
+  amqp_basic_deliver_t deliver;
+  uint64_t body_size;
+  void *decoded;
+  char *p;
+  int res;
+
+  memset(envelope, 0, sizeof(*envelope));
+  init_amqp_pool_with_allocator(&envelope->pool, ENVELOPE_POOL_PAGE_SIZE,
+                                state->allocator);
+  amqp_pool_set_retention(&envelope->pool, 0);
+  amqp_pool_set_zero_fill(&envelope->pool, 0);
+
+  do {
+    res = amqp_simple_wait_frame(state, &frame);
+    if (res < 0) {
+      return consume_error(envelope, res);
+    }
+  } while (frame.frame_type == AMQP_FRAME_HEARTBEAT);
+
+  if (frame.frame_type != AMQP_FRAME_METHOD
+      || frame.payload.method.id != AMQP_BASIC_DELIVER_METHOD) {
+    /* not ours to handle; leave it for amqp_simple_wait_frame */
+    res = amqp_put_back_frame(state, &frame);
+    return consume_error(envelope, res < 0 ? res : -ERROR_UNEXPECTED_FRAME);
+  }
+
+  envelope->channel = frame.channel;
+  /* stays valid until the connection's buffers are next released */
+  args = frame.payload.encoded_method.raw;
+
+  res = amqp_simple_wait_frame_on_channel(state, envelope->channel, &frame);
+  if (res < 0) {
+    return consume_error(envelope, res);
+  }
+  if (frame.frame_type != AMQP_FRAME_HEADER
+      || frame.payload.properties.class_id != AMQP_BASIC_CLASS) {
+    return consume_error(envelope, -ERROR_BAD_AMQP_DATA);
+  }
+  props = frame.payload.properties.raw;
+  body_size = frame.payload.properties.body_size;
+
+  if (body_size > SIZE_MAX - args.len - props.len) {
+    return consume_error(envelope, -ERROR_NO_MEMORY);
+  }
+
+  /* The block holds the method arguments and the encoded properties,
+     which the decoded strings point into, followed by the body. */
+  p = amqp_pool_alloc(&envelope->pool,
+                      args.len + props.len + (size_t)body_size);
+  if (p == NULL && args.len + props.len + body_size > 0) {
+    return consume_error(envelope, -ERROR_NO_MEMORY);
+  }
+
+  memcpy(p, args.bytes, args.len);
+  args.bytes = p;
+  p += args.len;
+  memcpy(p, props.bytes, props.len);
+  props.bytes = p;
+  p += props.len;
+
+  res = amqp_decode_method_into(AMQP_BASIC_DELIVER_METHOD, args, &deliver);
+  if (res < 0) {
+    return consume_error(envelope, res);
+  }
+  envelope->consumer_tag = deliver.consumer_tag;
+  envelope->delivery_tag = deliver.delivery_tag;
+  envelope->redelivered = deliver.redelivered;
+  envelope->exchange = deliver.exchange;
+  envelope->routing_key = deliver.routing_key;
+
+  res = amqp_decode_properties(AMQP_BASIC_CLASS, &envelope->pool, props,
+                               &decoded);
+  if (res < 0) {
+    return consume_error(envelope, res);
+  }
+  envelope->properties = *(amqp_basic_properties_t *)decoded;
+
+  envelope->body.len = (size_t)body_size;
+  envelope->body.bytes = p;
+  if (body_size > 0) {
+    res = amqp_simple_wait_body(state, envelope->channel, body_size,
+                                &envelope->body, 1);
+    if (res < 0) {
+      return consume_error(envelope, res);
+    }
+  }
+
+  /* everything is in the envelope now */
+  amqp_apply_release_policy(state, envelope->channel);
+
+  memset(&result, 0, sizeof(result));
+  result.reply_type = AMQP_RESPONSE_NORMAL;
+  return result;
+}
+
+void amqp_destroy_envelope(amqp_envelope_t *envelope)
+{
+  empty_amqp_pool(&envelope->pool);
+  envelope->body = amqp_empty_bytes;
+}
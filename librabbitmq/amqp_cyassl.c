@@ -43,6 +43,7 @@ struct amqp_ssl_socket_t {
   int sockfd;
   char *buffer;
   size_t length;
+  const amqp_allocator_t *allocator; /* for buffer */
   int last_error;
 };
 
@@ -80,8 +81,9 @@ amqp_ssl_socket_writev(void *base,
     bytes += iov[i].iov_len;
   }
   if (self->length < bytes) {
-    free(self->buffer);
-    self->buffer = malloc(bytes);
+    amqp_mem_free(self->allocator, self->buffer, self->length,
+                  AMQP_MEMORY_SSL);
+    self->buffer = amqp_mem_alloc(self->allocator, bytes, AMQP_MEMORY_SSL);
     if (!self->buffer) {
       self->length = 0;
       self->last_error = ERROR_NO_MEMORY;
@@ -135,7 +137,8 @@ amqp_ssl_socket_close(void *base)
   if (self) {
     CyaSSL_free(self->ssl);
     CyaSSL_CTX_free(self->ctx);
-    free(self->buffer);
+    amqp_mem_free(self->allocator, self->buffer, self->length,
+                  AMQP_MEMORY_SSL);
     free(self);
   }
   return status;
@@ -181,6 +184,31 @@ amqp_ssl_socket_open(void *base, const char *host, int port)
   return 0;
 }
 
+static size_t
+amqp_ssl_socket_buffer_size(void *base)
+{
+  struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
+  return self->length;
+}
+
+static size_t
+amqp_ssl_socket_pending(void *base)
+{
+  struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
+  return self->ssl != NULL ? (size_t)CyaSSL_pending(self->ssl) : 0;
+}
+
+static void
+amqp_ssl_socket_set_allocator(void *base, const amqp_allocator_t *allocator)
+{
+  struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
+  amqp_mem_free(self->allocator, self->buffer, self->length,
+                AMQP_MEMORY_SSL);
+  self->buffer = NULL;
+  self->length = 0;
+  self->allocator = allocator;
+}
+
 static const struct amqp_socket_class_t amqp_ssl_socket_class = {
   amqp_ssl_socket_writev, /* writev */
   amqp_ssl_socket_send, /* send */
@@ -188,7 +216,12 @@ static const struct amqp_socket_class_t amqp_ssl_socket_class = {
   amqp_ssl_socket_open, /* open */
   amqp_ssl_socket_close, /* close */
   amqp_ssl_socket_error, /* error */
-  amqp_ssl_socket_get_sockfd /* get_sockfd */
+  amqp_ssl_socket_get_sockfd, /* get_sockfd */
+  NULL, /* readv */
+  amqp_ssl_socket_buffer_size, /* buffer_size */
+  NULL, /* sendfile */
+  amqp_ssl_socket_pending, /* pending */
+  amqp_ssl_socket_set_allocator /* set_allocator */
 };
 
 amqp_socket_t *
@@ -198,6 +231,7 @@ amqp_ssl_socket_new(void)
   if (!self) {
     goto error;
   }
+  self->allocator = amqp_get_default_allocator();
   CyaSSL_Init();
   self->ctx = CyaSSL_CTX_new(CyaSSLv23_client_method());
   if (!self->ctx) {
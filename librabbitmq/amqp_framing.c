@@ -172,6 +172,15 @@ amqp_boolean_t amqp_method_has_content(amqp_method_number_t methodNumber) {
   }
 }
 
+amqp_boolean_t amqp_method_has_field_accessors(amqp_method_number_t methodNumber) {
+  switch (methodNumber) {
+    case AMQP_BASIC_DELIVER_METHOD: return 1;
+    case AMQP_BASIC_ACK_METHOD: return 1;
+    case AMQP_BASIC_NACK_METHOD: return 1;
+    default: return 0;
+  }
+}
+
 int amqp_decode_method(amqp_method_number_t methodNumber,
                        amqp_pool_t *pool,
                        amqp_bytes_t encoded,
@@ -822,28 +831,10 @@ int amqp_decode_method(amqp_method_number_t methodNumber,
     }
     case AMQP_BASIC_DELIVER_METHOD: {
       amqp_basic_deliver_t *m = (amqp_basic_deliver_t *) amqp_pool_alloc(pool, sizeof(amqp_basic_deliver_t));
+      int res;
       if (m == NULL) { return -ERROR_NO_MEMORY; }
-      {
-        uint8_t len;
-        if (!amqp_decode_8(encoded, &offset, &len)
-            || !amqp_decode_bytes(encoded, &offset, &m->consumer_tag, len))
-          return -ERROR_BAD_AMQP_DATA;
-      }
-      if (!amqp_decode_64(encoded, &offset, &m->delivery_tag)) return -ERROR_BAD_AMQP_DATA;
-      if (!amqp_decode_8(encoded, &offset, &bit_buffer)) return -ERROR_BAD_AMQP_DATA;
-      m->redelivered = (bit_buffer & (1 << 0)) ? 1 : 0;
-      {
-        uint8_t len;
-        if (!amqp_decode_8(encoded, &offset, &len)
-            || !amqp_decode_bytes(encoded, &offset, &m->exchange, len))
-          return -ERROR_BAD_AMQP_DATA;
-      }
-      {
-        uint8_t len;
-        if (!amqp_decode_8(encoded, &offset, &len)
-            || !amqp_decode_bytes(encoded, &offset, &m->routing_key, len))
-          return -ERROR_BAD_AMQP_DATA;
-      }
+      res = amqp_decode_method_into(methodNumber, encoded, m);
+      if (res < 0) { return res; }
       *decoded = m;
       return 0;
     }
@@ -898,10 +889,10 @@ int amqp_decode_method(amqp_method_number_t methodNumber,
     }
     case AMQP_BASIC_ACK_METHOD: {
       amqp_basic_ack_t *m = (amqp_basic_ack_t *) amqp_pool_alloc(pool, sizeof(amqp_basic_ack_t));
+      int res;
       if (m == NULL) { return -ERROR_NO_MEMORY; }
-      if (!amqp_decode_64(encoded, &offset, &m->delivery_tag)) return -ERROR_BAD_AMQP_DATA;
-      if (!amqp_decode_8(encoded, &offset, &bit_buffer)) return -ERROR_BAD_AMQP_DATA;
-      m->multiple = (bit_buffer & (1 << 0)) ? 1 : 0;
+      res = amqp_decode_method_into(methodNumber, encoded, m);
+      if (res < 0) { return res; }
       *decoded = m;
       return 0;
     }
@@ -937,11 +928,10 @@ int amqp_decode_method(amqp_method_number_t methodNumber,
     }
     case AMQP_BASIC_NACK_METHOD: {
       amqp_basic_nack_t *m = (amqp_basic_nack_t *) amqp_pool_alloc(pool, sizeof(amqp_basic_nack_t));
+      int res;
       if (m == NULL) { return -ERROR_NO_MEMORY; }
-      if (!amqp_decode_64(encoded, &offset, &m->delivery_tag)) return -ERROR_BAD_AMQP_DATA;
-      if (!amqp_decode_8(encoded, &offset, &bit_buffer)) return -ERROR_BAD_AMQP_DATA;
-      m->multiple = (bit_buffer & (1 << 0)) ? 1 : 0;
-      m->requeue = (bit_buffer & (1 << 1)) ? 1 : 0;
+      res = amqp_decode_method_into(methodNumber, encoded, m);
+      if (res < 0) { return res; }
       *decoded = m;
       return 0;
     }
@@ -992,173 +982,357 @@ int amqp_decode_method(amqp_method_number_t methodNumber,
   }
 }
 
-int amqp_decode_properties(uint16_t class_id,
-                           amqp_pool_t *pool,
-                           amqp_bytes_t encoded,
-                           void **decoded)
+int amqp_decode_method_into(amqp_method_number_t methodNumber,
+                            amqp_bytes_t encoded,
+                            void *decoded)
 {
   size_t offset = 0;
+  uint8_t bit_buffer;
+
+  switch (methodNumber) {
+    case AMQP_BASIC_DELIVER_METHOD: {
+      amqp_basic_deliver_t *m = (amqp_basic_deliver_t *) decoded;
+      {
+        uint8_t len;
+        if (!amqp_decode_8(encoded, &offset, &len)
+            || !amqp_decode_bytes(encoded, &offset, &m->consumer_tag, len))
+          return -ERROR_BAD_AMQP_DATA;
+      }
+      if (!amqp_decode_64(encoded, &offset, &m->delivery_tag)) return -ERROR_BAD_AMQP_DATA;
+      if (!amqp_decode_8(encoded, &offset, &bit_buffer)) return -ERROR_BAD_AMQP_DATA;
+      m->redelivered = (bit_buffer & (1 << 0)) ? 1 : 0;
+      {
+        uint8_t len;
+        if (!amqp_decode_8(encoded, &offset, &len)
+            || !amqp_decode_bytes(encoded, &offset, &m->exchange, len))
+          return -ERROR_BAD_AMQP_DATA;
+      }
+      {
+        uint8_t len;
+        if (!amqp_decode_8(encoded, &offset, &len)
+            || !amqp_decode_bytes(encoded, &offset, &m->routing_key, len))
+          return -ERROR_BAD_AMQP_DATA;
+      }
+      return 0;
+    }
+    case AMQP_BASIC_ACK_METHOD: {
+      amqp_basic_ack_t *m = (amqp_basic_ack_t *) decoded;
+      if (!amqp_decode_64(encoded, &offset, &m->delivery_tag)) return -ERROR_BAD_AMQP_DATA;
+      if (!amqp_decode_8(encoded, &offset, &bit_buffer)) return -ERROR_BAD_AMQP_DATA;
+      m->multiple = (bit_buffer & (1 << 0)) ? 1 : 0;
+      return 0;
+    }
+    case AMQP_BASIC_NACK_METHOD: {
+      amqp_basic_nack_t *m = (amqp_basic_nack_t *) decoded;
+      if (!amqp_decode_64(encoded, &offset, &m->delivery_tag)) return -ERROR_BAD_AMQP_DATA;
+      if (!amqp_decode_8(encoded, &offset, &bit_buffer)) return -ERROR_BAD_AMQP_DATA;
+      m->multiple = (bit_buffer & (1 << 0)) ? 1 : 0;
+      m->requeue = (bit_buffer & (1 << 1)) ? 1 : 0;
+      return 0;
+    }
+    default: return -ERROR_UNKNOWN_METHOD;
+  }
+}
 
-  amqp_flags_t flags = 0;
+static int amqp_decode_property_flags(amqp_bytes_t encoded,
+                                      size_t *offset,
+                                      amqp_flags_t *flags)
+{
   int flagword_index = 0;
   uint16_t partial_flags;
 
+  *flags = 0;
   do {
-    if (!amqp_decode_16(encoded, &offset, &partial_flags))
+    if (!amqp_decode_16(encoded, offset, &partial_flags))
       return -ERROR_BAD_AMQP_DATA;
-    flags |= (partial_flags << (flagword_index * 16));
+    *flags |= (partial_flags << (flagword_index * 16));
     flagword_index++;
   } while (partial_flags & 1);
 
+  return 0;
+}
+
+int amqp_decode_properties(uint16_t class_id,
+                           amqp_pool_t *pool,
+                           amqp_bytes_t encoded,
+                           void **decoded)
+{
+  return amqp_decode_properties_selective(class_id, pool, encoded,
+                                          ~(amqp_flags_t) 0, decoded);
+}
+
+int amqp_decode_properties_selective(uint16_t class_id,
+                                     amqp_pool_t *pool,
+                                     amqp_bytes_t encoded,
+                                     amqp_flags_t wanted,
+                                     void **decoded)
+{
+  size_t offset = 0;
+  amqp_flags_t flags;
+  int res = amqp_decode_property_flags(encoded, &offset, &flags);
+  if (res < 0) return res;
+
   switch (class_id) {
     case 10: {
       amqp_connection_properties_t *p = (amqp_connection_properties_t *) amqp_pool_alloc(pool, sizeof(amqp_connection_properties_t));
       if (p == NULL) { return -ERROR_NO_MEMORY; }
-      p->_flags = flags;
+      p->_flags = flags & wanted;
       *decoded = p;
       return 0;
     }
     case 20: {
       amqp_channel_properties_t *p = (amqp_channel_properties_t *) amqp_pool_alloc(pool, sizeof(amqp_channel_properties_t));
       if (p == NULL) { return -ERROR_NO_MEMORY; }
-      p->_flags = flags;
+      p->_flags = flags & wanted;
       *decoded = p;
       return 0;
     }
     case 30: {
       amqp_access_properties_t *p = (amqp_access_properties_t *) amqp_pool_alloc(pool, sizeof(amqp_access_properties_t));
       if (p == NULL) { return -ERROR_NO_MEMORY; }
-      p->_flags = flags;
+      p->_flags = flags & wanted;
       *decoded = p;
       return 0;
     }
     case 40: {
       amqp_exchange_properties_t *p = (amqp_exchange_properties_t *) amqp_pool_alloc(pool, sizeof(amqp_exchange_properties_t));
       if (p == NULL) { return -ERROR_NO_MEMORY; }
-      p->_flags = flags;
+      p->_flags = flags & wanted;
       *decoded = p;
       return 0;
     }
     case 50: {
       amqp_queue_properties_t *p = (amqp_queue_properties_t *) amqp_pool_alloc(pool, sizeof(amqp_queue_properties_t));
       if (p == NULL) { return -ERROR_NO_MEMORY; }
-      p->_flags = flags;
+      p->_flags = flags & wanted;
       *decoded = p;
       return 0;
     }
     case 60: {
       amqp_basic_properties_t *p = (amqp_basic_properties_t *) amqp_pool_alloc(pool, sizeof(amqp_basic_properties_t));
       if (p == NULL) { return -ERROR_NO_MEMORY; }
-      p->_flags = flags;
+      p->_flags = flags & wanted;
       if (flags & AMQP_BASIC_CONTENT_TYPE_FLAG) {
-      {
-        uint8_t len;
-        if (!amqp_decode_8(encoded, &offset, &len)
-            || !amqp_decode_bytes(encoded, &offset, &p->content_type, len))
-          return -ERROR_BAD_AMQP_DATA;
-      }
+        if (wanted & AMQP_BASIC_CONTENT_TYPE_FLAG) {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || !amqp_decode_bytes(encoded, &offset, &p->content_type, len))
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        } else {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || (offset += len) > encoded.len)
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        }
       }
       if (flags & AMQP_BASIC_CONTENT_ENCODING_FLAG) {
-      {
-        uint8_t len;
-        if (!amqp_decode_8(encoded, &offset, &len)
-            || !amqp_decode_bytes(encoded, &offset, &p->content_encoding, len))
-          return -ERROR_BAD_AMQP_DATA;
-      }
+        if (wanted & AMQP_BASIC_CONTENT_ENCODING_FLAG) {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || !amqp_decode_bytes(encoded, &offset, &p->content_encoding, len))
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        } else {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || (offset += len) > encoded.len)
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        }
       }
       if (flags & AMQP_BASIC_HEADERS_FLAG) {
-      {
-        int res = amqp_decode_table(encoded, pool, &(p->headers), &offset);
-        if (res < 0) return res;
-      }
+        if (wanted & AMQP_BASIC_HEADERS_FLAG) {
+          {
+            int res = amqp_decode_table(encoded, pool, &(p->headers), &offset);
+            if (res < 0) return res;
+          }
+        } else {
+          {
+            uint32_t len;
+            if (!amqp_decode_32(encoded, &offset, &len)
+                || (offset += len) > encoded.len)
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        }
       }
       if (flags & AMQP_BASIC_DELIVERY_MODE_FLAG) {
-      if (!amqp_decode_8(encoded, &offset, &p->delivery_mode)) return -ERROR_BAD_AMQP_DATA;
+        if (wanted & AMQP_BASIC_DELIVERY_MODE_FLAG) {
+          if (!amqp_decode_8(encoded, &offset, &p->delivery_mode)) return -ERROR_BAD_AMQP_DATA;
+        } else {
+          offset += 1;
+        }
       }
       if (flags & AMQP_BASIC_PRIORITY_FLAG) {
-      if (!amqp_decode_8(encoded, &offset, &p->priority)) return -ERROR_BAD_AMQP_DATA;
+        if (wanted & AMQP_BASIC_PRIORITY_FLAG) {
+          if (!amqp_decode_8(encoded, &offset, &p->priority)) return -ERROR_BAD_AMQP_DATA;
+        } else {
+          offset += 1;
+        }
       }
       if (flags & AMQP_BASIC_CORRELATION_ID_FLAG) {
-      {
-        uint8_t len;
-        if (!amqp_decode_8(encoded, &offset, &len)
-            || !amqp_decode_bytes(encoded, &offset, &p->correlation_id, len))
-          return -ERROR_BAD_AMQP_DATA;
-      }
+        if (wanted & AMQP_BASIC_CORRELATION_ID_FLAG) {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || !amqp_decode_bytes(encoded, &offset, &p->correlation_id, len))
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        } else {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || (offset += len) > encoded.len)
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        }
       }
       if (flags & AMQP_BASIC_REPLY_TO_FLAG) {
-      {
-        uint8_t len;
-        if (!amqp_decode_8(encoded, &offset, &len)
-            || !amqp_decode_bytes(encoded, &offset, &p->reply_to, len))
-          return -ERROR_BAD_AMQP_DATA;
-      }
+        if (wanted & AMQP_BASIC_REPLY_TO_FLAG) {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || !amqp_decode_bytes(encoded, &offset, &p->reply_to, len))
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        } else {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || (offset += len) > encoded.len)
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        }
       }
       if (flags & AMQP_BASIC_EXPIRATION_FLAG) {
-      {
-        uint8_t len;
-        if (!amqp_decode_8(encoded, &offset, &len)
-            || !amqp_decode_bytes(encoded, &offset, &p->expiration, len))
-          return -ERROR_BAD_AMQP_DATA;
-      }
+        if (wanted & AMQP_BASIC_EXPIRATION_FLAG) {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || !amqp_decode_bytes(encoded, &offset, &p->expiration, len))
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        } else {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || (offset += len) > encoded.len)
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        }
       }
       if (flags & AMQP_BASIC_MESSAGE_ID_FLAG) {
-      {
-        uint8_t len;
-        if (!amqp_decode_8(encoded, &offset, &len)
-            || !amqp_decode_bytes(encoded, &offset, &p->message_id, len))
-          return -ERROR_BAD_AMQP_DATA;
-      }
+        if (wanted & AMQP_BASIC_MESSAGE_ID_FLAG) {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || !amqp_decode_bytes(encoded, &offset, &p->message_id, len))
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        } else {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || (offset += len) > encoded.len)
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        }
       }
       if (flags & AMQP_BASIC_TIMESTAMP_FLAG) {
-      if (!amqp_decode_64(encoded, &offset, &p->timestamp)) return -ERROR_BAD_AMQP_DATA;
+        if (wanted & AMQP_BASIC_TIMESTAMP_FLAG) {
+          if (!amqp_decode_64(encoded, &offset, &p->timestamp)) return -ERROR_BAD_AMQP_DATA;
+        } else {
+          offset += 8;
+        }
       }
       if (flags & AMQP_BASIC_TYPE_FLAG) {
-      {
-        uint8_t len;
-        if (!amqp_decode_8(encoded, &offset, &len)
-            || !amqp_decode_bytes(encoded, &offset, &p->type, len))
-          return -ERROR_BAD_AMQP_DATA;
-      }
+        if (wanted & AMQP_BASIC_TYPE_FLAG) {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || !amqp_decode_bytes(encoded, &offset, &p->type, len))
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        } else {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || (offset += len) > encoded.len)
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        }
       }
       if (flags & AMQP_BASIC_USER_ID_FLAG) {
-      {
-        uint8_t len;
-        if (!amqp_decode_8(encoded, &offset, &len)
-            || !amqp_decode_bytes(encoded, &offset, &p->user_id, len))
-          return -ERROR_BAD_AMQP_DATA;
-      }
+        if (wanted & AMQP_BASIC_USER_ID_FLAG) {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || !amqp_decode_bytes(encoded, &offset, &p->user_id, len))
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        } else {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || (offset += len) > encoded.len)
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        }
       }
       if (flags & AMQP_BASIC_APP_ID_FLAG) {
-      {
-        uint8_t len;
-        if (!amqp_decode_8(encoded, &offset, &len)
-            || !amqp_decode_bytes(encoded, &offset, &p->app_id, len))
-          return -ERROR_BAD_AMQP_DATA;
-      }
+        if (wanted & AMQP_BASIC_APP_ID_FLAG) {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || !amqp_decode_bytes(encoded, &offset, &p->app_id, len))
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        } else {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || (offset += len) > encoded.len)
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        }
       }
       if (flags & AMQP_BASIC_CLUSTER_ID_FLAG) {
-      {
-        uint8_t len;
-        if (!amqp_decode_8(encoded, &offset, &len)
-            || !amqp_decode_bytes(encoded, &offset, &p->cluster_id, len))
-          return -ERROR_BAD_AMQP_DATA;
-      }
-      }
+        if (wanted & AMQP_BASIC_CLUSTER_ID_FLAG) {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || !amqp_decode_bytes(encoded, &offset, &p->cluster_id, len))
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        } else {
+          {
+            uint8_t len;
+            if (!amqp_decode_8(encoded, &offset, &len)
+                || (offset += len) > encoded.len)
+              return -ERROR_BAD_AMQP_DATA;
+          }
+        }
+      }
+      if (offset > encoded.len) return -ERROR_BAD_AMQP_DATA;
       *decoded = p;
       return 0;
     }
     case 90: {
       amqp_tx_properties_t *p = (amqp_tx_properties_t *) amqp_pool_alloc(pool, sizeof(amqp_tx_properties_t));
       if (p == NULL) { return -ERROR_NO_MEMORY; }
-      p->_flags = flags;
+      p->_flags = flags & wanted;
       *decoded = p;
       return 0;
     }
     case 85: {
       amqp_confirm_properties_t *p = (amqp_confirm_properties_t *) amqp_pool_alloc(pool, sizeof(amqp_confirm_properties_t));
       if (p == NULL) { return -ERROR_NO_MEMORY; }
-      p->_flags = flags;
+      p->_flags = flags & wanted;
       *decoded = p;
       return 0;
     }
@@ -1166,6 +1340,175 @@ int amqp_decode_properties(uint16_t class_id,
   }
 }
 
+int amqp_find_encoded_property(uint16_t class_id,
+                               amqp_bytes_t encoded,
+                               amqp_flags_t flag,
+                               amqp_bytes_t *value)
+{
+  size_t offset = 0;
+  size_t start;
+  amqp_flags_t flags;
+  int res = amqp_decode_property_flags(encoded, &offset, &flags);
+  if (res < 0) return res;
+
+  if (!(flags & flag)) return 0;
+
+  /* skip the properties before the one wanted, then that one too */
+  switch (class_id) {
+    case 10:
+      break;
+    case 20:
+      break;
+    case 30:
+      break;
+    case 40:
+      break;
+    case 50:
+      break;
+    case 60:
+      if (flags & AMQP_BASIC_CONTENT_TYPE_FLAG) {
+        start = offset;
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len)
+              || (offset += len) > encoded.len)
+            return -ERROR_BAD_AMQP_DATA;
+        }
+        if (flag == AMQP_BASIC_CONTENT_TYPE_FLAG) goto found;
+      }
+      if (flags & AMQP_BASIC_CONTENT_ENCODING_FLAG) {
+        start = offset;
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len)
+              || (offset += len) > encoded.len)
+            return -ERROR_BAD_AMQP_DATA;
+        }
+        if (flag == AMQP_BASIC_CONTENT_ENCODING_FLAG) goto found;
+      }
+      if (flags & AMQP_BASIC_HEADERS_FLAG) {
+        start = offset;
+        {
+          uint32_t len;
+          if (!amqp_decode_32(encoded, &offset, &len)
+              || (offset += len) > encoded.len)
+            return -ERROR_BAD_AMQP_DATA;
+        }
+        if (flag == AMQP_BASIC_HEADERS_FLAG) goto found;
+      }
+      if (flags & AMQP_BASIC_DELIVERY_MODE_FLAG) {
+        start = offset;
+        offset += 1;
+        if (flag == AMQP_BASIC_DELIVERY_MODE_FLAG) goto found;
+      }
+      if (flags & AMQP_BASIC_PRIORITY_FLAG) {
+        start = offset;
+        offset += 1;
+        if (flag == AMQP_BASIC_PRIORITY_FLAG) goto found;
+      }
+      if (flags & AMQP_BASIC_CORRELATION_ID_FLAG) {
+        start = offset;
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len)
+              || (offset += len) > encoded.len)
+            return -ERROR_BAD_AMQP_DATA;
+        }
+        if (flag == AMQP_BASIC_CORRELATION_ID_FLAG) goto found;
+      }
+      if (flags & AMQP_BASIC_REPLY_TO_FLAG) {
+        start = offset;
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len)
+              || (offset += len) > encoded.len)
+            return -ERROR_BAD_AMQP_DATA;
+        }
+        if (flag == AMQP_BASIC_REPLY_TO_FLAG) goto found;
+      }
+      if (flags & AMQP_BASIC_EXPIRATION_FLAG) {
+        start = offset;
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len)
+              || (offset += len) > encoded.len)
+            return -ERROR_BAD_AMQP_DATA;
+        }
+        if (flag == AMQP_BASIC_EXPIRATION_FLAG) goto found;
+      }
+      if (flags & AMQP_BASIC_MESSAGE_ID_FLAG) {
+        start = offset;
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len)
+              || (offset += len) > encoded.len)
+            return -ERROR_BAD_AMQP_DATA;
+        }
+        if (flag == AMQP_BASIC_MESSAGE_ID_FLAG) goto found;
+      }
+      if (flags & AMQP_BASIC_TIMESTAMP_FLAG) {
+        start = offset;
+        offset += 8;
+        if (flag == AMQP_BASIC_TIMESTAMP_FLAG) goto found;
+      }
+      if (flags & AMQP_BASIC_TYPE_FLAG) {
+        start = offset;
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len)
+              || (offset += len) > encoded.len)
+            return -ERROR_BAD_AMQP_DATA;
+        }
+        if (flag == AMQP_BASIC_TYPE_FLAG) goto found;
+      }
+      if (flags & AMQP_BASIC_USER_ID_FLAG) {
+        start = offset;
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len)
+              || (offset += len) > encoded.len)
+            return -ERROR_BAD_AMQP_DATA;
+        }
+        if (flag == AMQP_BASIC_USER_ID_FLAG) goto found;
+      }
+      if (flags & AMQP_BASIC_APP_ID_FLAG) {
+        start = offset;
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len)
+              || (offset += len) > encoded.len)
+            return -ERROR_BAD_AMQP_DATA;
+        }
+        if (flag == AMQP_BASIC_APP_ID_FLAG) goto found;
+      }
+      if (flags & AMQP_BASIC_CLUSTER_ID_FLAG) {
+        start = offset;
+        {
+          uint8_t len;
+          if (!amqp_decode_8(encoded, &offset, &len)
+              || (offset += len) > encoded.len)
+            return -ERROR_BAD_AMQP_DATA;
+        }
+        if (flag == AMQP_BASIC_CLUSTER_ID_FLAG) goto found;
+      }
+      break;
+    case 90:
+      break;
+    case 85:
+      break;
+    default: return -ERROR_UNKNOWN_CLASS;
+  }
+
+  /* flag is not a property of this class */
+  return 0;
+
+found:
+  if (offset > encoded.len) return -ERROR_BAD_AMQP_DATA;
+  value->bytes = amqp_offset(encoded.bytes, start);
+  value->len = offset - start;
+  return 1;
+}
+
 int amqp_encode_method(amqp_method_number_t methodNumber,
                        void *decoded,
                        amqp_bytes_t encoded)
@@ -1852,6 +2195,145 @@ int amqp_encode_properties(uint16_t class_id,
   }
 }
 
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_deliver_get_consumer_tag(amqp_bytes_t encoded, amqp_bytes_t *value)
+{
+  size_t offset = 0;
+
+  {
+    uint8_t len;
+    if (!amqp_decode_8(encoded, &offset, &len)
+        || !amqp_decode_bytes(encoded, &offset, &(*value), len))
+      return -ERROR_BAD_AMQP_DATA;
+  }
+  return 0;
+}
+
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_deliver_get_delivery_tag(amqp_bytes_t encoded, uint64_t *value)
+{
+  size_t offset = 0;
+
+  {
+    uint8_t len;
+    if (!amqp_decode_8(encoded, &offset, &len)
+        || (offset += len) > encoded.len)
+      return -ERROR_BAD_AMQP_DATA;
+  }
+  if (!amqp_decode_64(encoded, &offset, &(*value))) return -ERROR_BAD_AMQP_DATA;
+  return 0;
+}
+
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_deliver_get_redelivered(amqp_bytes_t encoded, amqp_boolean_t *value)
+{
+  size_t offset = 0;
+  uint8_t bit_buffer;
+
+  {
+    uint8_t len;
+    if (!amqp_decode_8(encoded, &offset, &len)
+        || (offset += len) > encoded.len)
+      return -ERROR_BAD_AMQP_DATA;
+  }
+  offset += 8;
+  if (!amqp_decode_8(encoded, &offset, &bit_buffer)) return -ERROR_BAD_AMQP_DATA;
+  *value = (bit_buffer & (1 << 0)) ? 1 : 0;
+  return 0;
+}
+
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_deliver_get_exchange(amqp_bytes_t encoded, amqp_bytes_t *value)
+{
+  size_t offset = 0;
+
+  {
+    uint8_t len;
+    if (!amqp_decode_8(encoded, &offset, &len)
+        || (offset += len) > encoded.len)
+      return -ERROR_BAD_AMQP_DATA;
+  }
+  offset += 9;
+  {
+    uint8_t len;
+    if (!amqp_decode_8(encoded, &offset, &len)
+        || !amqp_decode_bytes(encoded, &offset, &(*value), len))
+      return -ERROR_BAD_AMQP_DATA;
+  }
+  return 0;
+}
+
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_deliver_get_routing_key(amqp_bytes_t encoded, amqp_bytes_t *value)
+{
+  size_t offset = 0;
+
+  {
+    uint8_t len;
+    if (!amqp_decode_8(encoded, &offset, &len)
+        || (offset += len) > encoded.len)
+      return -ERROR_BAD_AMQP_DATA;
+  }
+  offset += 9;
+  {
+    uint8_t len;
+    if (!amqp_decode_8(encoded, &offset, &len)
+        || (offset += len) > encoded.len)
+      return -ERROR_BAD_AMQP_DATA;
+  }
+  {
+    uint8_t len;
+    if (!amqp_decode_8(encoded, &offset, &len)
+        || !amqp_decode_bytes(encoded, &offset, &(*value), len))
+      return -ERROR_BAD_AMQP_DATA;
+  }
+  return 0;
+}
+
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_ack_get_delivery_tag(amqp_bytes_t encoded, uint64_t *value)
+{
+  size_t offset = 0;
+
+  if (!amqp_decode_64(encoded, &offset, &(*value))) return -ERROR_BAD_AMQP_DATA;
+  return 0;
+}
+
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_ack_get_multiple(amqp_bytes_t encoded, amqp_boolean_t *value)
+{
+  size_t offset = 0;
+  uint8_t bit_buffer;
+
+  offset += 8;
+  if (!amqp_decode_8(encoded, &offset, &bit_buffer)) return -ERROR_BAD_AMQP_DATA;
+  *value = (bit_buffer & (1 << 0)) ? 1 : 0;
+  return 0;
+}
+
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_nack_get_delivery_tag(amqp_bytes_t encoded, uint64_t *value)
+{
+  size_t offset = 0;
+
+  if (!amqp_decode_64(encoded, &offset, &(*value))) return -ERROR_BAD_AMQP_DATA;
+  return 0;
+}
+
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_nack_get_multiple(amqp_bytes_t encoded, amqp_boolean_t *value)
+{
+  size_t offset = 0;
+  uint8_t bit_buffer;
+
+  offset += 8;
+  if (!amqp_decode_8(encoded, &offset, &bit_buffer)) return -ERROR_BAD_AMQP_DATA;
+  *value = (bit_buffer & (1 << 0)) ? 1 : 0;
+  return 0;
+}
+
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_nack_get_requeue(amqp_bytes_t encoded, amqp_boolean_t *value)
+{
+  size_t offset = 0;
+  uint8_t bit_buffer;
+
+  offset += 8;
+  if (!amqp_decode_8(encoded, &offset, &bit_buffer)) return -ERROR_BAD_AMQP_DATA;
+  *value = (bit_buffer & (1 << 1)) ? 1 : 0;
+  return 0;
+}
+
 AMQP_PUBLIC_FUNCTION amqp_channel_open_ok_t * AMQP_CALL amqp_channel_open(amqp_connection_state_t state, amqp_channel_t channel)
 {
   amqp_channel_open_t req;
@@ -89,6 +89,10 @@ AMQP_PUBLIC_FUNCTION
 amqp_boolean_t
 AMQP_CALL amqp_method_has_content(amqp_method_number_t methodNumber);
 
+AMQP_PUBLIC_FUNCTION
+amqp_boolean_t
+AMQP_CALL amqp_method_has_field_accessors(amqp_method_number_t methodNumber);
+
 AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_decode_method(amqp_method_number_t methodNumber,
@@ -96,6 +100,19 @@ AMQP_CALL amqp_decode_method(amqp_method_number_t methodNumber,
 		   amqp_bytes_t encoded,
 		   void **decoded);
 
+/*
+ * Decodes a method into caller-provided storage, without allocating:
+ * decoded must point to the method's struct, e.g. an amqp_basic_ack_t.
+ * String fields point into encoded. Only methods for which
+ * amqp_method_has_field_accessors is true are supported; any other
+ * method gives -ERROR_UNKNOWN_METHOD.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_decode_method_into(amqp_method_number_t methodNumber,
+		   amqp_bytes_t encoded,
+		   void *decoded);
+
 AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_decode_properties(uint16_t class_id,
@@ -103,6 +120,21 @@ AMQP_CALL amqp_decode_properties(uint16_t class_id,
             amqp_bytes_t encoded,
             void **decoded);
 
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_decode_properties_selective(uint16_t class_id,
+            amqp_pool_t *pool,
+            amqp_bytes_t encoded,
+            amqp_flags_t wanted,
+            void **decoded);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_find_encoded_property(uint16_t class_id,
+            amqp_bytes_t encoded,
+            amqp_flags_t flag,
+            amqp_bytes_t *value);
+
 AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_encode_method(amqp_method_number_t methodNumber,
@@ -603,6 +635,19 @@ typedef struct amqp_confirm_properties_t_ {
   char dummy; /* Dummy field to avoid empty struct */
 } amqp_confirm_properties_t;
 
+/* Field accessors for encoded methods */
+
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_deliver_get_consumer_tag(amqp_bytes_t encoded, amqp_bytes_t *value);
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_deliver_get_delivery_tag(amqp_bytes_t encoded, uint64_t *value);
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_deliver_get_redelivered(amqp_bytes_t encoded, amqp_boolean_t *value);
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_deliver_get_exchange(amqp_bytes_t encoded, amqp_bytes_t *value);
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_deliver_get_routing_key(amqp_bytes_t encoded, amqp_bytes_t *value);
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_ack_get_delivery_tag(amqp_bytes_t encoded, uint64_t *value);
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_ack_get_multiple(amqp_bytes_t encoded, amqp_boolean_t *value);
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_nack_get_delivery_tag(amqp_bytes_t encoded, uint64_t *value);
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_nack_get_multiple(amqp_bytes_t encoded, amqp_boolean_t *value);
+AMQP_PUBLIC_FUNCTION int AMQP_CALL amqp_basic_nack_get_requeue(amqp_bytes_t encoded, amqp_boolean_t *value);
+
 /* API functions for methods */
 
 AMQP_PUBLIC_FUNCTION amqp_channel_open_ok_t * AMQP_CALL amqp_channel_open(amqp_connection_state_t state, amqp_channel_t channel);
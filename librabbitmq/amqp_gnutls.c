@@ -45,6 +45,7 @@ struct amqp_ssl_socket_t {
   char *host;
   char *buffer;
   size_t length;
+  const amqp_allocator_t *allocator; /* for buffer */
   int last_error;
 };
 
@@ -81,14 +82,15 @@ amqp_ssl_socket_writev(void *base,
     bytes += iov[i].iov_len;
   }
   if (self->length < bytes) {
-    free(self->buffer);
-    self->buffer = malloc(bytes);
+    amqp_mem_free(self->allocator, self->buffer, self->length,
+                  AMQP_MEMORY_SSL);
+    self->buffer = amqp_mem_alloc(self->allocator, bytes, AMQP_MEMORY_SSL);
     if (!self->buffer) {
       self->length = 0;
       self->last_error = ERROR_NO_MEMORY;
       goto exit;
     }
-    self->length = 0;
+    self->length = bytes;
   }
   bufferp = self->buffer;
   for (i = 0; i < iovcnt; ++i) {
@@ -162,7 +164,8 @@ amqp_ssl_socket_close(void *base)
     gnutls_deinit(self->session);
     gnutls_certificate_free_credentials(self->credentials);
     free(self->host);
-    free(self->buffer);
+    amqp_mem_free(self->allocator, self->buffer, self->length,
+                  AMQP_MEMORY_SSL);
     free(self);
   }
   return status;
@@ -241,6 +244,32 @@ error:
   return GNUTLS_E_CERTIFICATE_ERROR;
 }
 
+static size_t
+amqp_ssl_socket_buffer_size(void *base)
+{
+  struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
+  return self->length;
+}
+
+static size_t
+amqp_ssl_socket_pending(void *base)
+{
+  struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
+  return self->session != NULL ? gnutls_record_check_pending(self->session)
+                               : 0;
+}
+
+static void
+amqp_ssl_socket_set_allocator(void *base, const amqp_allocator_t *allocator)
+{
+  struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
+  amqp_mem_free(self->allocator, self->buffer, self->length,
+                AMQP_MEMORY_SSL);
+  self->buffer = NULL;
+  self->length = 0;
+  self->allocator = allocator;
+}
+
 static const struct amqp_socket_class_t amqp_ssl_socket_class = {
   amqp_ssl_socket_writev, /* writev */
   amqp_ssl_socket_send, /* send */
@@ -248,7 +277,12 @@ static const struct amqp_socket_class_t amqp_ssl_socket_class = {
   amqp_ssl_socket_open, /* open */
   amqp_ssl_socket_close, /* close */
   amqp_ssl_socket_error, /* error */
-  amqp_ssl_socket_get_sockfd /* get_sockfd */
+  amqp_ssl_socket_get_sockfd, /* get_sockfd */
+  NULL, /* readv */
+  amqp_ssl_socket_buffer_size, /* buffer_size */
+  NULL, /* sendfile */
+  amqp_ssl_socket_pending, /* pending */
+  amqp_ssl_socket_set_allocator /* set_allocator */
 };
 
 amqp_socket_t *
@@ -260,6 +294,7 @@ amqp_ssl_socket_new(void)
   if (!self) {
     goto error;
   }
+  self->allocator = amqp_get_default_allocator();
   gnutls_global_init();
   status = gnutls_init(&self->session, GNUTLS_CLIENT);
   if (GNUTLS_E_SUCCESS != status) {
@@ -51,8 +51,177 @@ char const *amqp_version(void)
   return VERSION; /* defined in config.h */
 }
 
+static void *malloc_alloc(AMQP_UNUSED void *context, size_t size,
+                          AMQP_UNUSED amqp_memory_tag_t tag)
+{
+  return malloc(size);
+}
+
+static void *malloc_realloc(AMQP_UNUSED void *context, void *ptr,
+                            AMQP_UNUSED size_t old_size, size_t new_size,
+                            AMQP_UNUSED amqp_memory_tag_t tag)
+{
+  return realloc(ptr, new_size);
+}
+
+static void malloc_free(AMQP_UNUSED void *context, void *ptr,
+                        AMQP_UNUSED size_t size,
+                        AMQP_UNUSED amqp_memory_tag_t tag)
+{
+  free(ptr);
+}
+
+static const amqp_allocator_t malloc_allocator = {
+  malloc_alloc,
+  malloc_realloc,
+  malloc_free,
+  NULL
+};
+
+static const amqp_allocator_t *default_allocator = &malloc_allocator;
+
+void amqp_set_default_allocator(const amqp_allocator_t *allocator)
+{
+  default_allocator = allocator ? allocator : &malloc_allocator;
+}
+
+const amqp_allocator_t *amqp_get_default_allocator(void)
+{
+  return default_allocator;
+}
+
+void *amqp_mem_realloc(const amqp_allocator_t *allocator, void *ptr,
+                       size_t old_size, size_t new_size,
+                       amqp_memory_tag_t tag)
+{
+  void *result;
+
+  if (ptr == NULL) {
+    return amqp_mem_alloc(allocator, new_size, tag);
+  }
+  if (allocator->realloc != NULL) {
+    return allocator->realloc(allocator->context, ptr, old_size, new_size,
+                              tag);
+  }
+
+  result = amqp_mem_alloc(allocator, new_size, tag);
+  if (result != NULL) {
+    memcpy(result, ptr, old_size < new_size ? old_size : new_size);
+    amqp_mem_free(allocator, ptr, old_size, tag);
+  }
+  return result;
+}
+
+typedef struct arena_t_ {
+  amqp_allocator_t allocator;
+  arena_unit_t *free_list; /* in address order */
+} arena_t;
+
+static size_t arena_units(size_t size)
+{
+  return size == 0 ? 1 : (size - 1) / sizeof(arena_unit_t) + 1;
+}
+
+/* First fit, so that the memory at the start gets reused */
+static void *arena_alloc(void *context, size_t size,
+                         AMQP_UNUSED amqp_memory_tag_t tag)
+{
+  arena_t *arena = context;
+  arena_unit_t **prev;
+  size_t units;
+
+  if (size > SIZE_MAX - sizeof(arena_unit_t)) {
+    return NULL;
+  }
+  units = arena_units(size);
+
+  for (prev = &arena->free_list; *prev != NULL; prev = &(*prev)->free.next) {
+    arena_unit_t *run = *prev;
+    if (run->free.units > units) {
+      arena_unit_t *rest = run + units;
+      rest->free.units = run->free.units - units;
+      rest->free.next = run->free.next;
+      *prev = rest;
+      return run;
+    }
+    if (run->free.units == units) {
+      *prev = run->free.next;
+      return run;
+    }
+  }
+  return NULL;
+}
+
+static void arena_free(void *context, void *ptr, size_t size,
+                       AMQP_UNUSED amqp_memory_tag_t tag)
+{
+  arena_t *arena = context;
+  arena_unit_t *run = ptr;
+  arena_unit_t **prev = &arena->free_list;
+
+  while (*prev != NULL && *prev < run) {
+    prev = &(*prev)->free.next;
+  }
+
+  run->free.units = arena_units(size);
+  run->free.next = *prev;
+  if (run->free.next == run + run->free.units) {
+    run->free.units += run->free.next->free.units;
+    run->free.next = run->free.next->free.next;
+  }
+  *prev = run;
+
+  /* and with the run before, which prev points into */
+  if (prev != &arena->free_list) {
+    arena_unit_t *before = (arena_unit_t *)((char *)prev
+                           - offsetof(arena_unit_t, free.next));
+    if (before + before->free.units == run) {
+      before->free.units += run->free.units;
+      before->free.next = run->free.next;
+    }
+  }
+}
+
+const amqp_allocator_t *amqp_arena_init(void *buf, size_t len)
+{
+  uintptr_t start = ((uintptr_t)buf + sizeof(arena_unit_t) - 1)
+                    / sizeof(arena_unit_t) * sizeof(arena_unit_t);
+  size_t header = arena_units(sizeof(arena_t)) * sizeof(arena_unit_t);
+  arena_t *arena = (arena_t *)start;
+  size_t units;
+
+  if (len < start - (uintptr_t)buf + header + sizeof(arena_unit_t)) {
+    return NULL;
+  }
+  units = (len - (start - (uintptr_t)buf) - header) / sizeof(arena_unit_t);
+
+  arena->allocator.alloc = arena_alloc;
+  arena->allocator.realloc = NULL;
+  arena->allocator.free = arena_free;
+  arena->allocator.context = arena;
+  arena->free_list = (arena_unit_t *)(start + header);
+  arena->free_list->free.units = units;
+  arena->free_list->free.next = NULL;
+  return &arena->allocator;
+}
+
+/* Every large block starts with one of these; the caller gets the
+   memory after it. next links blocks on a free list. */
+typedef struct large_block_t_ {
+  size_t size; /* usable size */
+  struct large_block_t_ *next;
+} large_block_t;
+
 void init_amqp_pool(amqp_pool_t *pool, size_t pagesize)
 {
+  init_amqp_pool_with_allocator(pool, pagesize, default_allocator);
+}
+
+void init_amqp_pool_with_allocator(amqp_pool_t *pool, size_t pagesize,
+                                   const amqp_allocator_t *allocator)
+{
+  int i;
+
   pool->pagesize = pagesize ? pagesize : 4096;
 
   pool->pages.num_blocks = 0;
@@ -64,25 +233,154 @@ void init_amqp_pool(amqp_pool_t *pool, size_t pagesize)
   pool->next_page = 0;
   pool->alloc_block = NULL;
   pool->alloc_used = 0;
+
+  for (i = 0; i < AMQP_POOL_LARGE_SIZE_CLASSES; i++) {
+    pool->free_large_blocks[i] = NULL;
+  }
+  pool->retained_bytes = 0;
+  pool->max_retained_bytes = AMQP_DEFAULT_POOL_RETENTION;
+
+  pool->allocator = allocator;
+  pool->zero_fill = 1;
+
+  memset(&pool->stats, 0, sizeof(pool->stats));
 }
 
-static void empty_blocklist(amqp_pool_blocklist_t *x)
+void amqp_pool_set_retention(amqp_pool_t *pool, size_t max_retained_bytes)
 {
-  int i;
+  pool->max_retained_bytes = max_retained_bytes;
+}
 
-  for (i = 0; i < x->num_blocks; i++) {
-    free(x->blocklist[i]);
+void amqp_pool_set_zero_fill(amqp_pool_t *pool, amqp_boolean_t zero_fill)
+{
+  pool->zero_fill = zero_fill;
+}
+
+void amqp_pool_get_stats(const amqp_pool_t *pool, amqp_pool_stats_t *stats)
+{
+  *stats = pool->stats;
+  if (stats->used_bytes > stats->peak_used_bytes) {
+    stats->peak_used_bytes = stats->used_bytes;
+  }
+  stats->total_bytes += stats->used_bytes;
+  stats->pages = pool->pages.num_blocks;
+  stats->large_blocks = pool->large_blocks.num_blocks;
+}
+
+static void add_held_bytes(amqp_pool_t *pool, size_t bytes)
+{
+  pool->stats.held_bytes += bytes;
+  if (pool->stats.held_bytes > pool->stats.peak_held_bytes) {
+    pool->stats.peak_held_bytes = pool->stats.held_bytes;
+  }
+}
+
+static void *alloc_pool_memory(amqp_pool_t *pool, size_t size)
+{
+  if (pool->zero_fill) {
+    return amqp_mem_calloc(pool->allocator, size, AMQP_MEMORY_POOL);
+  }
+  return amqp_mem_alloc(pool->allocator, size, AMQP_MEMORY_POOL);
+}
+
+/*
+ * Finds the smallest size class that holds amount bytes. Returns its
+ * index and stores its size in class_size, or returns -1 if amount is
+ * too big to be size-classed.
+ */
+static int large_size_class(size_t pagesize, size_t amount,
+                            size_t *class_size)
+{
+  size_t base = pagesize;
+  int c;
+
+  for (c = 0; c < AMQP_POOL_LARGE_SIZE_CLASSES; c++) {
+    if (c > 0 && c % 4 == 0) {
+      if (base > SIZE_MAX / 4) {
+        return -1;
+      }
+      base *= 2;
+    }
+    *class_size = (base + base / 4 * (c % 4 + 1) + 7) & ~(size_t)7;
+    if (amount <= *class_size) {
+      return c;
+    }
   }
-  if (x->blocklist != NULL) {
-    free(x->blocklist);
+  return -1;
+}
+
+/* Block lists are grown by doubling, so a list is full whenever its
+   length is a power of two */
+static size_t blocklist_capacity(int num_blocks)
+{
+  size_t capacity = 1;
+  while (capacity < (size_t)num_blocks) {
+    capacity *= 2;
   }
+  return capacity;
+}
+
+static void free_blocklist(const amqp_allocator_t *allocator,
+                           amqp_pool_blocklist_t *x)
+{
+  amqp_mem_free(allocator, x->blocklist,
+                sizeof(void *) * blocklist_capacity(x->num_blocks),
+                AMQP_MEMORY_POOL);
   x->num_blocks = 0;
   x->blocklist = NULL;
 }
 
+static void empty_blocklist(const amqp_allocator_t *allocator,
+                            amqp_pool_blocklist_t *x, size_t block_size)
+{
+  int i;
+
+  for (i = 0; i < x->num_blocks; i++) {
+    amqp_mem_free(allocator, x->blocklist[i], block_size, AMQP_MEMORY_POOL);
+  }
+  free_blocklist(allocator, x);
+}
+
+static void free_large_block(amqp_pool_t *pool, large_block_t *block)
+{
+  pool->stats.held_bytes -= block->size;
+  amqp_mem_free(pool->allocator, block, sizeof(large_block_t) + block->size,
+                AMQP_MEMORY_POOL);
+}
+
+/* Moves the large blocks in use onto the free lists, up to the
+   retention limit, and frees the rest */
+static void retain_large_blocks(amqp_pool_t *pool)
+{
+  int i;
+
+  for (i = 0; i < pool->large_blocks.num_blocks; i++) {
+    large_block_t *block = pool->large_blocks.blocklist[i];
+    size_t class_size;
+    int c = large_size_class(pool->pagesize, block->size, &class_size);
+
+    if (c >= 0 && class_size == block->size
+        && pool->retained_bytes <= pool->max_retained_bytes
+        && block->size <= pool->max_retained_bytes - pool->retained_bytes) {
+      block->next = pool->free_large_blocks[c];
+      pool->free_large_blocks[c] = block;
+      pool->retained_bytes += block->size;
+    } else {
+      free_large_block(pool, block);
+    }
+  }
+  free_blocklist(pool->allocator, &pool->large_blocks);
+}
+
 void recycle_amqp_pool(amqp_pool_t *pool)
 {
-  empty_blocklist(&pool->large_blocks);
+  if (pool->stats.used_bytes > pool->stats.peak_used_bytes) {
+    pool->stats.peak_used_bytes = pool->stats.used_bytes;
+  }
+  pool->stats.total_bytes += pool->stats.used_bytes;
+  pool->stats.used_bytes = 0;
+
+  retain_large_blocks(pool);
   pool->next_page = 0;
   pool->alloc_block = NULL;
   pool->alloc_used = 0;
@@ -90,22 +388,31 @@ void recycle_amqp_pool(amqp_pool_t *pool)
 
 void empty_amqp_pool(amqp_pool_t *pool)
 {
+  int i;
+
   recycle_amqp_pool(pool);
-  empty_blocklist(&pool->pages);
+  for (i = 0; i < AMQP_POOL_LARGE_SIZE_CLASSES; i++) {
+    while (pool->free_large_blocks[i] != NULL) {
+      large_block_t *block = pool->free_large_blocks[i];
+      pool->free_large_blocks[i] = block->next;
+      free_large_block(pool, block);
+    }
+  }
+  pool->retained_bytes = 0;
+  pool->stats.held_bytes -= pool->pagesize * pool->pages.num_blocks;
+  empty_blocklist(pool->allocator, &pool->pages, pool->pagesize);
 }
 
 /* Returns 1 on success, 0 on failure */
-static int record_pool_block(amqp_pool_blocklist_t *x, void *block)
+static int record_pool_block(const amqp_allocator_t *allocator,
+                             amqp_pool_blocklist_t *x, void *block)
 {
-  size_t blocklistlength = sizeof(void *) * (x->num_blocks + 1);
-
-  if (x->blocklist == NULL) {
-    x->blocklist = malloc(blocklistlength);
-    if (x->blocklist == NULL) {
-      return 0;
-    }
-  } else {
-    void *newbl = realloc(x->blocklist, blocklistlength);
+  if (x->blocklist == NULL || (x->num_blocks & (x->num_blocks - 1)) == 0) {
+    size_t old_length = sizeof(void *) * x->num_blocks;
+    void *newbl = amqp_mem_realloc(allocator, x->blocklist,
+                                   old_length ? old_length : sizeof(void *),
+                                   old_length ? old_length * 2 : sizeof(void *),
+                                   AMQP_MEMORY_POOL);
     if (newbl == NULL) {
       return 0;
     }
@@ -117,6 +424,38 @@ static int record_pool_block(amqp_pool_blocklist_t *x, void *block)
   return 1;
 }
 
+static void *alloc_large_block(amqp_pool_t *pool, size_t amount)
+{
+  large_block_t *block;
+  size_t size;
+  int c = large_size_class(pool->pagesize, amount, &size);
+
+  if (c >= 0 && pool->free_large_blocks[c] != NULL) {
+    block = pool->free_large_blocks[c];
+    pool->free_large_blocks[c] = block->next;
+    pool->retained_bytes -= block->size;
+  } else {
+    if (c < 0) {
+      size = amount;
+    }
+    if (size > SIZE_MAX - sizeof(large_block_t)) {
+      return NULL;
+    }
+    block = alloc_pool_memory(pool, sizeof(large_block_t) + size);
+    if (block == NULL) {
+      return NULL;
+    }
+    block->size = size;
+    add_held_bytes(pool, size);
+  }
+
+  if (!record_pool_block(pool->allocator, &pool->large_blocks, block)) {
+    free_large_block(pool, block);
+    return NULL;
+  }
+  return block + 1;
+}
+
 void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount)
 {
   if (amount == 0) {
@@ -126,12 +465,10 @@ void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount)
   amount = (amount + 7) & (~7); /* round up to nearest 8-byte boundary */
 
   if (amount > pool->pagesize) {
-    void *result = calloc(1, amount);
-    if (result == NULL) {
-      return NULL;
-    }
-    if (!record_pool_block(&pool->large_blocks, result)) {
-      return NULL;
+    void *result = alloc_large_block(pool, amount);
+    if (result != NULL) {
+      pool->stats.used_bytes += amount;
+      pool->stats.total_allocs++;
     }
     return result;
   }
@@ -142,18 +479,24 @@ void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount)
     if (pool->alloc_used + amount <= pool->pagesize) {
       void *result = pool->alloc_block + pool->alloc_used;
       pool->alloc_used += amount;
+      pool->stats.used_bytes += amount;
+      pool->stats.total_allocs++;
       return result;
     }
   }
 
   if (pool->next_page >= pool->pages.num_blocks) {
-    pool->alloc_block = calloc(1, pool->pagesize);
+    pool->alloc_block = alloc_pool_memory(pool, pool->pagesize);
     if (pool->alloc_block == NULL) {
       return NULL;
     }
-    if (!record_pool_block(&pool->pages, pool->alloc_block)) {
+    if (!record_pool_block(pool->allocator, &pool->pages, pool->alloc_block)) {
+      amqp_mem_free(pool->allocator, pool->alloc_block, pool->pagesize,
+                    AMQP_MEMORY_POOL);
+      pool->alloc_block = NULL;
       return NULL;
     }
+    add_held_bytes(pool, pool->pagesize);
     pool->next_page = pool->pages.num_blocks;
   } else {
     pool->alloc_block = pool->pages.blocklist[pool->next_page];
@@ -161,6 +504,8 @@ void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount)
   }
 
   pool->alloc_used = amount;
+  pool->stats.used_bytes += amount;
+  pool->stats.total_allocs++;
 
   return pool->alloc_block;
 }
@@ -183,7 +528,7 @@ amqp_bytes_t amqp_bytes_malloc_dup(amqp_bytes_t src)
 {
   amqp_bytes_t result;
   result.len = src.len;
-  result.bytes = malloc(src.len);
+  result.bytes = amqp_mem_alloc(default_allocator, src.len, AMQP_MEMORY_BYTES);
   if (result.bytes != NULL) {
     memcpy(result.bytes, src.bytes, src.len);
   }
@@ -194,11 +539,12 @@ amqp_bytes_t amqp_bytes_malloc(size_t amount)
 {
   amqp_bytes_t result;
   result.len = amount;
-  result.bytes = malloc(amount); /* will return NULL if it fails */
+  /* will return NULL if it fails */
+  result.bytes = amqp_mem_alloc(default_allocator, amount, AMQP_MEMORY_BYTES);
   return result;
 }
 
 void amqp_bytes_free(amqp_bytes_t bytes)
 {
-  free(bytes.bytes);
+  amqp_mem_free(default_allocator, bytes.bytes, bytes.len, AMQP_MEMORY_BYTES);
 }
@@ -64,6 +64,7 @@ struct amqp_ssl_socket_t {
   SSL *ssl;
   char *buffer;
   size_t length;
+  const amqp_allocator_t *allocator; /* for buffer */
   amqp_boolean_t verify;
   int last_error;
 };
@@ -109,8 +110,9 @@ amqp_ssl_socket_writev(void *base,
     bytes += iov[i].iov_len;
   }
   if (self->length < bytes) {
-    free(self->buffer);
-    self->buffer = malloc(bytes);
+    amqp_mem_free(self->allocator, self->buffer, self->length,
+                  AMQP_MEMORY_SSL);
+    self->buffer = amqp_mem_alloc(self->allocator, bytes, AMQP_MEMORY_SSL);
     if (!self->buffer) {
       self->length = 0;
       self->last_error = ERROR_NO_MEMORY;
@@ -267,7 +269,8 @@ amqp_ssl_socket_close(void *base)
     SSL_free(self->ssl);
     amqp_os_socket_close(self->sockfd);
     SSL_CTX_free(self->ctx);
-    free(self->buffer);
+    amqp_mem_free(self->allocator, self->buffer, self->length,
+                  AMQP_MEMORY_SSL);
     free(self);
   }
   destroy_openssl();
@@ -294,6 +297,31 @@ amqp_ssl_socket_get_sockfd(void *base)
   return self->sockfd;
 }
 
+static size_t
+amqp_ssl_socket_buffer_size(void *base)
+{
+  struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
+  return self->length;
+}
+
+static size_t
+amqp_ssl_socket_pending(void *base)
+{
+  struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
+  return self->ssl != NULL ? (size_t)SSL_pending(self->ssl) : 0;
+}
+
+static void
+amqp_ssl_socket_set_allocator(void *base, const amqp_allocator_t *allocator)
+{
+  struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
+  amqp_mem_free(self->allocator, self->buffer, self->length,
+                AMQP_MEMORY_SSL);
+  self->buffer = NULL;
+  self->length = 0;
+  self->allocator = allocator;
+}
+
 static const struct amqp_socket_class_t amqp_ssl_socket_class = {
   amqp_ssl_socket_writev, /* writev */
   amqp_ssl_socket_send, /* send */
@@ -301,7 +329,12 @@ static const struct amqp_socket_class_t amqp_ssl_socket_class = {
   amqp_ssl_socket_open, /* open */
   amqp_ssl_socket_close, /* close */
   amqp_ssl_socket_error, /* error */
-  amqp_ssl_socket_get_sockfd /* get_sockfd */
+  amqp_ssl_socket_get_sockfd, /* get_sockfd */
+  NULL, /* readv */
+  amqp_ssl_socket_buffer_size, /* buffer_size */
+  NULL, /* sendfile */
+  amqp_ssl_socket_pending, /* pending */
+  amqp_ssl_socket_set_allocator /* set_allocator */
 };
 
 amqp_socket_t *
@@ -312,6 +345,7 @@ amqp_ssl_socket_new(void)
   if (!self) {
     goto error;
   }
+  self->allocator = amqp_get_default_allocator();
   status = initialize_openssl();
   if (status) {
     goto error;
@@ -69,7 +69,8 @@
 #define ERROR_INCOMPATIBLE_AMQP_VERSION 6
 #define ERROR_CONNECTION_CLOSED 7
 #define ERROR_BAD_AMQP_URL 8
-#define ERROR_MAX 8
+#define ERROR_UNEXPECTED_FRAME 9
+#define ERROR_MAX 9
 
 /* GCC attributes */
 #if __GNUC__ > 2 | (__GNUC__ == 2 && __GNUC_MINOR__ > 4)
@@ -109,12 +110,13 @@ amqp_ssl_error_string(int err);
  * - CONNECTION_STATE_IDLE: The normal state between
  *   frames. Connections may only be reconfigured, and the
  *   connection's pools recycled, when in this state. Whenever we're
- *   in this state, the inbound_buffer's bytes pointer must be NULL;
- *   any other state, and it must point to a block of memory allocated
- *   from the frame_pool.
+ *   in this state, the inbound_buffer's bytes pointer must be NULL.
  *
  * - CONNECTION_STATE_HEADER: Some bytes of an incoming frame have
- *   been seen, but not a complete frame header's worth.
+ *   been seen, but not a complete frame header's worth. They are
+ *   collected in header_buffer, since the size of the frame (and so
+ *   of the block to allocate from its channel's pool) is not known
+ *   yet.
  *
  * - CONNECTION_STATE_BODY: A complete frame header has been seen, but
  *   the frame is not yet complete. When it is completed, it will be
@@ -139,28 +141,223 @@ typedef struct amqp_link_t_ {
   void *data;
 } amqp_link_t;
 
+/* Allocation through an amqp_allocator_t. Blocks must be freed with the
+ * size and tag they were allocated with. */
+static inline void *amqp_mem_alloc(const amqp_allocator_t *allocator,
+                                   size_t size, amqp_memory_tag_t tag)
+{
+  return allocator->alloc(allocator->context, size, tag);
+}
+
+static inline void *amqp_mem_calloc(const amqp_allocator_t *allocator,
+                                    size_t size, amqp_memory_tag_t tag)
+{
+  void *result = allocator->alloc(allocator->context, size, tag);
+  if (result != NULL) {
+    memset(result, 0, size);
+  }
+  return result;
+}
+
+static inline void amqp_mem_free(const amqp_allocator_t *allocator,
+                                 void *ptr, size_t size, amqp_memory_tag_t tag)
+{
+  if (ptr != NULL) {
+    allocator->free(allocator->context, ptr, size, tag);
+  }
+}
+
+void *
+amqp_mem_realloc(const amqp_allocator_t *allocator, void *ptr,
+                 size_t old_size, size_t new_size, amqp_memory_tag_t tag);
+
+/*
+ * Sends a method that carries content, its content header and its body
+ * split into frames, gathered into as few writes as the outbound
+ * buffer allows: one, unless the body needs many frames.
+ */
+int
+amqp_send_method_with_content(amqp_connection_state_t state,
+                              amqp_channel_t channel,
+                              amqp_method_number_t method_id,
+                              void *decoded_method,
+                              uint16_t class_id,
+                              void *decoded_properties,
+                              amqp_bytes_t body);
+
+/*
+ * Releases channel's pool if the connection's release policy says it
+ * is due and nothing still needs it. Called where a message or RPC reply
+ * on channel is known to be finished with.
+ */
+void
+amqp_apply_release_policy(amqp_connection_state_t state,
+                          amqp_channel_t channel);
+
+/* The unit arena memory is handed out in; free runs of it keep their
+   length and the next free run in their first unit */
+typedef union arena_unit_t_ {
+  struct {
+    size_t units;
+    union arena_unit_t_ *next;
+  } free;
+  uint64_t align_u64;
+  double align_double;
+  void *align_ptr;
+} arena_unit_t;
+
+/*
+ * Sets up an allocator, kept at the start of the len bytes at buf, that
+ * hands out the rest of them. It is not thread-safe. Returns NULL if len
+ * is too small to hold it.
+ */
+const amqp_allocator_t *
+amqp_arena_init(void *buf, size_t len);
+
+/* How many bytes of large blocks a pool keeps when recycled, unless
+ * amqp_pool_set_retention says otherwise */
+#define AMQP_DEFAULT_POOL_RETENTION (1024 * 1024)
+
+/* The smallest a socket buffer shrinks to, unless the connection was
+   created with lazy buffers */
+#define MIN_INBOUND_SOCK_BUFFER_SIZE 16384
+
+/* Number of hash buckets for a connection's channel pools */
+#define CHANNEL_POOL_TABLE_SIZE 16
+
+/*
+ * Everything the frames received on one channel refer to: the raw frames
+ * themselves, what is decoded from them, and the links queueing them.
+ * Released independently of other channels by
+ * amqp_maybe_release_buffers_on_channel.
+ */
+typedef struct amqp_channel_pool_t_ {
+  struct amqp_channel_pool_t_ *next;
+  amqp_channel_t channel;
+  amqp_pool_t pool;
+  /* socket buffers that this channel's frames were decoded in place
+   * from, most recent first; links are in pool, data is the buffer's
+   * amqp_shared_buffer_t */
+  amqp_link_t *pinned_sock_buffers;
+  /* the size of those buffers, for AMQP_RELEASE_ABOVE_POOL_USAGE */
+  size_t pinned_bytes;
+  /* frame bytes received since the pool was last released, for
+     AMQP_RELEASE_AFTER_BYTES */
+  size_t received_bytes;
+} amqp_channel_pool_t;
+
+/* Memory handed over by amqp_detach_buffers_on_channel; the same as a
+ * channel pool, minus the channel */
+struct amqp_detached_buffers_t_ {
+  const amqp_allocator_t *allocator;
+  amqp_pool_t pool;
+  amqp_link_t *pinned_sock_buffers;
+};
+
+/* Reference counts that may be dropped from other threads */
+static inline long amqp_atomic_increment(volatile long *value)
+{
+#ifdef _WIN32
+  return InterlockedIncrement(value);
+#else
+  return __sync_add_and_fetch(value, 1);
+#endif
+}
+
+static inline long amqp_atomic_decrement(volatile long *value)
+{
+#ifdef _WIN32
+  return InterlockedDecrement(value);
+#else
+  return __sync_sub_and_fetch(value, 1);
+#endif
+}
+
+/*
+ * Every socket buffer starts with one of these, followed by the data.
+ * The connection holds a pin on its current and spare buffers; channel
+ * pools and detached buffers holding frames decoded in place from a
+ * buffer pin it once each, and amqp_share_body_fragment pins it once per
+ * reference handed out. A buffer pinned by anything but the connection
+ * is not refilled. Whatever drops the last pin frees it, from whichever
+ * thread that happens on.
+ */
+struct amqp_shared_buffer_t_ {
+  const amqp_allocator_t *allocator;
+  size_t size; /* of the data */
+  volatile long pins;
+};
+
+static inline amqp_shared_buffer_t *amqp_sock_buffer_of(amqp_bytes_t buffer)
+{
+  return (amqp_shared_buffer_t *)buffer.bytes - 1;
+}
+
 struct amqp_connection_state_t_ {
-  amqp_pool_t frame_pool;
-  amqp_pool_t decoding_pool;
+  const amqp_allocator_t *allocator;
+  amqp_channel_pool_t *channel_pools[CHANNEL_POOL_TABLE_SIZE];
+  /* a released pool, kept for the next channel that needs one */
+  amqp_channel_pool_t *spare_channel_pool;
+  /* set by amqp_connection_init_in, whose caller frees the state */
+  amqp_boolean_t in_caller_memory;
+  size_t pool_retention;
+
+  amqp_boolean_t lazy_buffers;
+  int idle_release_ms;
+  /* when something was last received, in milliseconds on a monotonic
+     clock, if idle_release_ms is set */
+  uint64_t last_received_ms;
 
   amqp_connection_state_enum state;
 
   int channel_max;
   int frame_max;
   int heartbeat;
+  amqp_boolean_t lazy_method_decoding;
+  amqp_flags_t decoded_properties;
+
+  amqp_release_policy_enum release_policy;
+  size_t release_limit;
+  /* set while frames already returned by the current call could be
+     reclaimed by the release policy */
+  amqp_boolean_t release_held;
+
+  amqp_boolean_t memory_debug;
+  amqp_frame_memory_stats_t method_frame_memory;
+  amqp_frame_memory_stats_t header_frame_memory;
+  amqp_frame_memory_stats_t body_frame_memory;
+  amqp_frame_memory_stats_t heartbeat_frame_memory;
+
   amqp_bytes_t inbound_buffer;
+  /* large enough for a frame header, or the server's protocol header */
+  char header_buffer[HEADER_SIZE + 1];
 
   size_t inbound_offset;
   size_t target_size;
 
   amqp_bytes_t outbound_buffer;
 
+  /* frames held back by amqp_set_output_buffering until amqp_flush, a
+     blocking wait, or output_threshold bytes are waiting */
+  amqp_bytes_t held_output;
+  size_t held_output_len;
+  size_t output_threshold;
+
   amqp_socket_t *socket;
 
   amqp_bytes_t sock_inbound_buffer;
   size_t sock_inbound_offset;
   size_t sock_inbound_limit;
 
+  /* The size sock_inbound_buffer should have when it is next refilled;
+   * it follows how much each read returns. */
+  size_t sock_inbound_size;
+  size_t sock_inbound_min_size;
+  int sock_inbound_small_reads;
+
+  /* a socket buffer nothing pins any more, kept for the next refill */
+  amqp_bytes_t spare_sock_buffer;
+
   amqp_link_t *first_queued_frame;
   amqp_link_t *last_queued_frame;
 
@@ -325,6 +522,59 @@ static inline int amqp_decode_bytes(amqp_bytes_t encoded, size_t *offset,
   }
 }
 
+/* Decodes a frame directly out of received_data, without copying it
+ * into the frame pool, when received_data holds the whole frame. The
+ * decoded frame then points into received_data. Returns the number of
+ * bytes consumed, or 0 if the frame is not complete (in which case
+ * amqp_handle_input must be used). */
+int
+amqp_handle_input_in_place(amqp_connection_state_t state,
+                           amqp_bytes_t received_data,
+                           amqp_frame_t *decoded_frame);
+
+/* Does the release policy's bookkeeping for a frame about to be
+ * received, from its header. It has to come before any of the frame is
+ * put in its channel's pool, which the policy may release. */
+void
+amqp_frame_started(amqp_connection_state_t state, void *raw_frame,
+                   size_t frame_size);
+
+/* Decodes the whole frame raw_frame, which amqp_frame_started has already
+ * been called for, as amqp_handle_input_in_place would. */
+int
+amqp_decode_started_frame(amqp_connection_state_t state,
+                          amqp_bytes_t raw_frame,
+                          amqp_frame_t *decoded_frame);
+
+/* Queues frame ahead of any other queued frames, so that it is the next
+ * one returned by amqp_simple_wait_frame. */
+int
+amqp_put_back_frame(amqp_connection_state_t state,
+                    const amqp_frame_t *frame);
+
+/* Finds the pool for frames on channel, creating it if need be. Returns
+ * NULL if there is no memory for it. */
+amqp_channel_pool_t *
+amqp_get_channel_pool(amqp_connection_state_t state, amqp_channel_t channel);
+
+/* Finds the pool for frames on channel, or NULL if it has none. */
+amqp_channel_pool_t *
+amqp_find_channel_pool(amqp_connection_state_t state, amqp_channel_t channel);
+
+/* Allocates a socket buffer of size bytes; bytes is NULL if there is no
+ * memory for it. */
+amqp_bytes_t
+amqp_alloc_sock_buffer(const amqp_allocator_t *allocator, size_t size);
+
+void
+amqp_free_sock_buffer(amqp_bytes_t buffer);
+
+/* Drops the pins in the list, freeing any retired buffer that nothing
+ * pins any more. state is NULL if the buffers may have outlived their
+ * connection; otherwise one may be kept as the connection's spare. */
+void
+amqp_unpin_sock_buffers(amqp_connection_state_t state, amqp_link_t *pinned);
+
 AMQP_NORETURN
 void
 amqp_abort(const char *fmt, ...);
@@ -49,9 +49,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
+#include <sys/time.h>
 #include <time.h>
 
+#define MAX_INBOUND_SOCK_BUFFER_SIZE 2097152
+/* reads using under a quarter of the buffer before it is halved */
+#define SOCK_BUFFER_SHRINK_READS 32
+
 ssize_t
 amqp_socket_writev(amqp_socket_t *self, const struct iovec *iov, int iovcnt)
 {
@@ -68,6 +74,34 @@ amqp_socket_send(amqp_socket_t *self, const void *buf, size_t len, int flags)
   return self->klass->send(self, buf, len, flags);
 }
 
+int
+amqp_socket_writev_all(amqp_socket_t *self, struct iovec *iov, int iovcnt)
+{
+  while (iovcnt > 0) {
+    ssize_t res;
+
+    if (iovcnt == 1) {
+      res = amqp_socket_send(self, iov->iov_base, iov->iov_len, MSG_NOSIGNAL);
+    } else {
+      res = amqp_socket_writev(self, iov, iovcnt);
+    }
+    if (res < 0) {
+      return -1;
+    }
+
+    while (iovcnt > 0 && (size_t)res >= iov->iov_len) {
+      res -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + res;
+      iov->iov_len -= res;
+    }
+  }
+  return 0;
+}
+
 ssize_t
 amqp_socket_recv(amqp_socket_t *self, void *buf, size_t len, int flags)
 {
@@ -76,6 +110,63 @@ amqp_socket_recv(amqp_socket_t *self, void *buf, size_t len, int flags)
   return self->klass->recv(self, buf, len, flags);
 }
 
+ssize_t
+amqp_socket_readv(amqp_socket_t *self, const struct iovec *iov, int iovcnt)
+{
+  assert(self);
+  assert(self->klass->readv);
+  return self->klass->readv(self, iov, iovcnt);
+}
+
+int
+amqp_socket_can_readv(amqp_socket_t *self)
+{
+  assert(self);
+  return self->klass->readv != NULL;
+}
+
+size_t
+amqp_socket_buffer_size(amqp_socket_t *self)
+{
+  if (self == NULL || self->klass->buffer_size == NULL) {
+    return 0;
+  }
+  return self->klass->buffer_size(self);
+}
+
+ssize_t
+amqp_socket_sendfile(amqp_socket_t *self, int fd, off_t *offset,
+                     size_t count)
+{
+  assert(self);
+  assert(self->klass->sendfile);
+  return self->klass->sendfile(self, fd, offset, count);
+}
+
+int
+amqp_socket_can_sendfile(amqp_socket_t *self)
+{
+  return self != NULL && self->klass->sendfile != NULL;
+}
+
+size_t
+amqp_socket_pending(amqp_socket_t *self)
+{
+  if (self == NULL || self->klass->pending == NULL) {
+    return 0;
+  }
+  return self->klass->pending(self);
+}
+
+void
+amqp_socket_set_allocator(amqp_socket_t *self,
+                          const amqp_allocator_t *allocator)
+{
+  if (self != NULL && self->klass->set_allocator != NULL) {
+    self->klass->set_allocator(self, allocator);
+  }
+}
+
 int
 amqp_socket_open(amqp_socket_t *self, const char *host, int port)
 {
@@ -282,62 +373,915 @@ amqp_boolean_t amqp_data_in_buffer(amqp_connection_state_t state)
   return (state->sock_inbound_offset < state->sock_inbound_limit);
 }
 
-static int wait_frame_inner(amqp_connection_state_t state,
-                            amqp_frame_t *decoded_frame)
+amqp_bytes_t amqp_alloc_sock_buffer(const amqp_allocator_t *allocator,
+                                    size_t size)
 {
-  while (1) {
-    int res;
+  amqp_shared_buffer_t *header =
+    amqp_mem_alloc(allocator, sizeof(amqp_shared_buffer_t) + size,
+                   AMQP_MEMORY_CONNECTION);
+  amqp_bytes_t buffer;
+
+  if (header == NULL) {
+    buffer.len = 0;
+    buffer.bytes = NULL;
+    return buffer;
+  }
+  header->allocator = allocator;
+  header->size = size;
+  header->pins = 1;
 
-    while (amqp_data_in_buffer(state)) {
-      amqp_bytes_t buffer;
-      buffer.len = state->sock_inbound_limit - state->sock_inbound_offset;
-      buffer.bytes = ((char *) state->sock_inbound_buffer.bytes) + state->sock_inbound_offset;
+  buffer.len = size;
+  buffer.bytes = header + 1;
+  return buffer;
+}
 
-      res = amqp_handle_input(state, buffer, decoded_frame);
-      if (res < 0) {
-        return res;
+static void free_sock_buffer_header(amqp_shared_buffer_t *header)
+{
+  amqp_mem_free(header->allocator, header,
+                sizeof(amqp_shared_buffer_t) + header->size,
+                AMQP_MEMORY_CONNECTION);
+}
+
+void amqp_free_sock_buffer(amqp_bytes_t buffer)
+{
+  if (buffer.bytes != NULL) {
+    amqp_shared_buffer_release(amqp_sock_buffer_of(buffer));
+  }
+}
+
+/*
+ * Records that a frame on channel was decoded in place from the socket
+ * buffer, so the buffer must outlive the channel's next release.
+ */
+static int pin_sock_buffer(amqp_connection_state_t state,
+                           amqp_channel_t channel)
+{
+  amqp_channel_pool_t *channel_pool = amqp_get_channel_pool(state, channel);
+  amqp_shared_buffer_t *header =
+    amqp_sock_buffer_of(state->sock_inbound_buffer);
+  amqp_link_t *link;
+
+  if (channel_pool == NULL) {
+    return -ERROR_NO_MEMORY;
+  }
+  /* a pinned buffer can't be freed, so its address can't be reused */
+  if (channel_pool->pinned_sock_buffers != NULL
+      && channel_pool->pinned_sock_buffers->data == header) {
+    return 0;
+  }
+
+  link = amqp_pool_alloc(&channel_pool->pool, sizeof(amqp_link_t));
+  if (link == NULL) {
+    return -ERROR_NO_MEMORY;
+  }
+  link->data = header;
+  link->next = channel_pool->pinned_sock_buffers;
+  channel_pool->pinned_sock_buffers = link;
+  channel_pool->pinned_bytes += header->size;
+  amqp_atomic_increment(&header->pins);
+  return 0;
+}
+
+void amqp_unpin_sock_buffers(amqp_connection_state_t state, amqp_link_t *pinned)
+{
+  amqp_link_t *link;
+
+  for (link = pinned; link != NULL; link = link->next) {
+    amqp_shared_buffer_t *header = link->data;
+
+    if (amqp_atomic_decrement(&header->pins) > 0) {
+      continue;
+    }
+
+    /* keep it as the spare if it is the right size for one */
+    if (state != NULL && state->spare_sock_buffer.bytes == NULL
+        && header->size == state->sock_inbound_size) {
+      header->pins = 1;
+      state->spare_sock_buffer.len = header->size;
+      state->spare_sock_buffer.bytes = header + 1;
+    } else {
+      free_sock_buffer_header(header);
+    }
+  }
+}
+
+void amqp_shared_buffer_retain(amqp_shared_buffer_t *buffer)
+{
+  amqp_atomic_increment(&buffer->pins);
+}
+
+void amqp_shared_buffer_release(amqp_shared_buffer_t *buffer)
+{
+  if (buffer != NULL && amqp_atomic_decrement(&buffer->pins) == 0) {
+    free_sock_buffer_header(buffer);
+  }
+}
+
+amqp_shared_buffer_t *amqp_share_body_fragment(amqp_connection_state_t state,
+                                               const amqp_frame_t *frame,
+                                               amqp_bytes_t *body)
+{
+  amqp_bytes_t fragment = frame->payload.body_fragment;
+  amqp_channel_pool_t *channel_pool;
+  amqp_shared_buffer_t *header;
+  amqp_bytes_t copy;
+  amqp_link_t *link;
+
+  if (frame->frame_type != AMQP_FRAME_BODY) {
+    amqp_abort("Programming error: amqp_share_body_fragment called on a frame of type %d",
+               frame->frame_type);
+  }
+
+  /* a fragment decoded in place is in one of the socket buffers its
+     channel pins */
+  channel_pool = amqp_find_channel_pool(state, frame->channel);
+  if (channel_pool != NULL) {
+    for (link = channel_pool->pinned_sock_buffers; link != NULL;
+         link = link->next) {
+      char *start;
+      header = link->data;
+      start = (char *)(header + 1);
+      if ((char *)fragment.bytes >= start
+          && (char *)fragment.bytes + fragment.len <= start + header->size) {
+        amqp_atomic_increment(&header->pins);
+        *body = fragment;
+        return header;
       }
+    }
+  }
+
+  /* otherwise it was reassembled in the channel's pool, which can't be
+     shared piecemeal */
+  copy = amqp_alloc_sock_buffer(state->allocator, fragment.len);
+  if (copy.bytes == NULL) {
+    return NULL;
+  }
+  memcpy(copy.bytes, fragment.bytes, fragment.len);
+  *body = copy;
+  return amqp_sock_buffer_of(copy);
+}
 
-      state->sock_inbound_offset += res;
+/*
+ * Called with the socket buffer used up. A buffer that is pinned by
+ * anything besides the connection still has frames pointing into it, so
+ * rather than being overwritten it is left to whatever unpins it last.
+ * The buffer is also replaced when it is due to change size.
+ */
+static int replace_sock_buffer(amqp_connection_state_t state)
+{
+  amqp_bytes_t buffer;
+
+  /* there is none after amqp_release_idle_buffers, or with lazy buffers
+     before the first read */
+  if (state->sock_inbound_buffer.bytes != NULL
+      && amqp_sock_buffer_of(state->sock_inbound_buffer)->pins == 1
+      && state->sock_inbound_buffer.len == state->sock_inbound_size) {
+    return 0;
+  }
 
-      if (decoded_frame->frame_type != 0) {
-        /* Complete frame was read. Return it. */
+  if (state->spare_sock_buffer.len == state->sock_inbound_size) {
+    buffer = state->spare_sock_buffer;
+    state->spare_sock_buffer.bytes = NULL;
+    state->spare_sock_buffer.len = 0;
+  } else {
+    buffer = amqp_alloc_sock_buffer(state->allocator, state->sock_inbound_size);
+    if (buffer.bytes == NULL) {
+      /* with no memory to grow into, carry on at the current size */
+      if (state->sock_inbound_buffer.bytes != NULL
+          && amqp_sock_buffer_of(state->sock_inbound_buffer)->pins == 1) {
+        state->sock_inbound_size = state->sock_inbound_buffer.len;
         return 0;
       }
+      return -ERROR_NO_MEMORY;
+    }
+  }
+
+  amqp_free_sock_buffer(state->sock_inbound_buffer);
+
+  state->sock_inbound_buffer = buffer;
+  state->sock_inbound_offset = 0;
+  state->sock_inbound_limit = 0;
+  return 0;
+}
 
-      /* Incomplete or ignored frame. Keep processing input. */
-      assert(res != 0);
+/* Microseconds on a clock that isn't changed by setting the time */
+static uint64_t now_us(void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec now;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == 0) {
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  }
+#endif
+  {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+  }
+}
+
+static uint64_t now_ms(void)
+{
+  return now_us() / 1000;
+}
+
+/*
+ * Grows the socket buffer when a read fills it, since more data was
+ * probably waiting, and shrinks it again after a run of reads that use
+ * only a small part of it.
+ */
+static void adapt_sock_buffer_size(amqp_connection_state_t state,
+                                   size_t received)
+{
+  size_t size = state->sock_inbound_buffer.len;
+
+  if (received == size) {
+    state->sock_inbound_small_reads = 0;
+    if (size < MAX_INBOUND_SOCK_BUFFER_SIZE) {
+      state->sock_inbound_size = size * 2;
+    }
+  } else if (received < size / 4) {
+    if (++state->sock_inbound_small_reads >= SOCK_BUFFER_SHRINK_READS
+        && size > state->sock_inbound_min_size) {
+      state->sock_inbound_small_reads = 0;
+      state->sock_inbound_size = size / 2;
     }
+  } else {
+    state->sock_inbound_small_reads = 0;
+  }
+}
 
+/*
+ * Refills the socket buffer. If a frame is part way through being
+ * received, its remainder is read straight into the block allocated for
+ * it at the same time (where the socket supports readv), instead of
+ * being copied there afterwards; decoded_frame is set if that completes
+ * it.
+ */
+static int refill_sock_buffer(amqp_connection_state_t state,
+                              amqp_frame_t *decoded_frame)
+{
+  struct iovec iov[2];
+  int iovcnt = 0;
+  size_t frame_part = 0;
+  ssize_t res;
+
+  decoded_frame->frame_type = 0;
+
+  res = replace_sock_buffer(state);
+  if (res < 0) {
+    return (int)res;
+  }
+
+  if (state->state == CONNECTION_STATE_BODY
+      && amqp_socket_can_readv(state->socket)) {
+    frame_part = state->target_size - state->inbound_offset;
+    iov[iovcnt].iov_base = amqp_offset(state->inbound_buffer.bytes,
+                                       state->inbound_offset);
+    iov[iovcnt].iov_len = frame_part;
+    iovcnt++;
+  }
+  iov[iovcnt].iov_base = state->sock_inbound_buffer.bytes;
+  iov[iovcnt].iov_len = state->sock_inbound_buffer.len;
+  iovcnt++;
+
+  if (iovcnt > 1) {
+    res = amqp_socket_readv(state->socket, iov, iovcnt);
+  } else {
     res = amqp_socket_recv(state->socket, state->sock_inbound_buffer.bytes,
                            state->sock_inbound_buffer.len, 0);
-    if (res <= 0) {
-      if (res == 0) {
-        return -ERROR_CONNECTION_CLOSED;
+  }
+  if (res <= 0) {
+    if (res == 0) {
+      return -ERROR_CONNECTION_CLOSED;
+    } else {
+      return -amqp_socket_error(state->socket);
+    }
+  }
+
+  if ((size_t)res < frame_part) {
+    frame_part = res;
+  }
+  state->sock_inbound_limit = res - frame_part;
+  state->sock_inbound_offset = 0;
+  if (state->idle_release_ms > 0) {
+    state->last_received_ms = now_ms();
+  }
+  adapt_sock_buffer_size(state, state->sock_inbound_limit);
+
+  if (frame_part > 0) {
+    amqp_bytes_t received;
+    received.bytes = iov[0].iov_base;
+    received.len = frame_part;
+    res = amqp_handle_input(state, received, decoded_frame);
+    if (res < 0) {
+      return (int)res;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Decodes the next frame from data already received, without blocking.
+ * Returns with a frame_type of zero once the buffer is used up.
+ */
+static int decode_buffered_frame(amqp_connection_state_t state,
+                                 amqp_frame_t *decoded_frame)
+{
+  decoded_frame->frame_type = 0;
+
+  while (amqp_data_in_buffer(state)) {
+    amqp_bytes_t buffer;
+    int res;
+
+    buffer.len = state->sock_inbound_limit - state->sock_inbound_offset;
+    buffer.bytes = ((char *) state->sock_inbound_buffer.bytes) + state->sock_inbound_offset;
+
+    res = amqp_handle_input_in_place(state, buffer, decoded_frame);
+    if (res > 0) {
+      /* the frame points into the socket buffer now */
+      if (decoded_frame->frame_type != 0
+          && decoded_frame->frame_type != AMQP_FRAME_HEARTBEAT) {
+        int pinned = pin_sock_buffer(state, decoded_frame->channel);
+        if (pinned < 0) {
+          return pinned;
+        }
+      }
+    } else if (res == 0) {
+      res = amqp_handle_input(state, buffer, decoded_frame);
+    }
+    if (res < 0) {
+      return res;
+    }
+
+    state->sock_inbound_offset += res;
+
+    if (decoded_frame->frame_type != 0) {
+      /* Complete frame was read. Return it. */
+      return 0;
+    }
+
+    /* Incomplete or ignored frame. Keep processing input. */
+    assert(res != 0);
+  }
+
+  return 0;
+}
+
+/*
+ * Waits for the socket to become readable, giving up at deadline, in
+ * now_us() time. Returns 1 if it is readable, 0 if the deadline passed
+ * first, or an error.
+ */
+static int wait_readable(amqp_connection_state_t state,
+                         const uint64_t *deadline)
+{
+  struct pollfd pfd;
+  int res;
+
+  pfd.fd = amqp_socket_get_sockfd(state->socket);
+  pfd.events = POLLIN;
+
+  do {
+    int64_t remaining_us = (int64_t)(*deadline - now_us());
+    int timeout_ms;
+
+    if (remaining_us <= 0) {
+      timeout_ms = 0;
+    } else if (remaining_us / 1000 >= INT_MAX) {
+      timeout_ms = INT_MAX;
+    } else {
+      timeout_ms = (int)((remaining_us + 999) / 1000);
+    }
+
+    res = poll(&pfd, 1, timeout_ms);
+  } while (res < 0 && errno == EINTR);
+
+  if (res < 0) {
+    return -amqp_os_socket_error();
+  }
+  return res > 0;
+}
+
+/*
+ * With idle_release_ms set, waits for the socket to become readable for
+ * no longer than the rest of the idle period, and if it doesn't, releases
+ * the connection's idle buffers before waiting out the deadline. Returns
+ * as wait_readable does, or 1 straight after releasing them if there is
+ * no deadline.
+ */
+static int wait_readable_or_idle(amqp_connection_state_t state,
+                                 const uint64_t *deadline)
+{
+  uint64_t idle_deadline;
+
+  if (state->last_received_ms == 0) {
+    state->last_received_ms = now_ms();
+  }
+  idle_deadline = (state->last_received_ms + state->idle_release_ms) * 1000;
+
+  if (deadline == NULL || idle_deadline < *deadline) {
+    int res = wait_readable(state, &idle_deadline);
+    if (res != 0) {
+      return res;
+    }
+    amqp_release_idle_buffers(state);
+  }
+
+  return deadline != NULL ? wait_readable(state, deadline) : 1;
+}
+
+/*
+ * Decodes the next frame, reading from the socket as needed. With a
+ * deadline, the socket is only read once poll() says it is readable,
+ * or the socket class says it has data buffered,
+ * and if the deadline passes first decoded_frame->frame_type is 0. Any
+ * partly received frame is kept for the next call.
+ */
+static int wait_frame_inner(amqp_connection_state_t state,
+                            amqp_frame_t *decoded_frame,
+                            const uint64_t *deadline)
+{
+  while (1) {
+    int res = decode_buffered_frame(state, decoded_frame);
+    if (res < 0) {
+      return res;
+    }
+
+    if (decoded_frame->frame_type != 0) {
+      return 0;
+    }
+
+    /* whatever is held back may be what the peer is waiting for */
+    res = amqp_flush(state);
+    if (res < 0) {
+      return res;
+    }
+
+    /* poll() can't see what the socket has buffered itself, so that is
+       read without waiting */
+    if (amqp_socket_pending(state->socket) == 0) {
+      if (state->idle_release_ms > 0) {
+        res = wait_readable_or_idle(state, deadline);
+      } else if (deadline != NULL) {
+        res = wait_readable(state, deadline);
       } else {
-        return -amqp_socket_error(state->socket);
+        res = 1;
+      }
+      if (res <= 0) {
+        return res;
       }
     }
 
-    state->sock_inbound_limit = res;
-    state->sock_inbound_offset = 0;
+    res = refill_sock_buffer(state, decoded_frame);
+    if (res < 0) {
+      return res;
+    }
+
+    if (decoded_frame->frame_type != 0) {
+      return 0;
+    }
   }
 }
 
+static void dequeue_frame(amqp_connection_state_t state,
+                          amqp_frame_t *decoded_frame)
+{
+  amqp_frame_t *f = (amqp_frame_t *) state->first_queued_frame->data;
+  state->first_queued_frame = state->first_queued_frame->next;
+  if (state->first_queued_frame == NULL) {
+    state->last_queued_frame = NULL;
+  }
+  *decoded_frame = *f;
+}
+
 int amqp_simple_wait_frame(amqp_connection_state_t state,
                            amqp_frame_t *decoded_frame)
 {
   if (state->first_queued_frame != NULL) {
-    amqp_frame_t *f = (amqp_frame_t *) state->first_queued_frame->data;
-    state->first_queued_frame = state->first_queued_frame->next;
-    if (state->first_queued_frame == NULL) {
-      state->last_queued_frame = NULL;
-    }
-    *decoded_frame = *f;
+    dequeue_frame(state, decoded_frame);
     return 0;
   } else {
-    return wait_frame_inner(state, decoded_frame);
+    return wait_frame_inner(state, decoded_frame, NULL);
+  }
+}
+
+int amqp_simple_wait_frame_timeout(amqp_connection_state_t state,
+                                   amqp_frame_t *decoded_frame,
+                                   struct timeval *timeout)
+{
+  uint64_t deadline;
+
+  if (state->first_queued_frame != NULL) {
+    dequeue_frame(state, decoded_frame);
+    return 0;
+  }
+  if (timeout == NULL) {
+    return wait_frame_inner(state, decoded_frame, NULL);
+  }
+
+  deadline = now_us() + (uint64_t)timeout->tv_sec * 1000000
+             + timeout->tv_usec;
+  return wait_frame_inner(state, decoded_frame, &deadline);
+}
+
+int amqp_try_wait_frame(amqp_connection_state_t state,
+                        amqp_frame_t *decoded_frame)
+{
+  struct timeval zero;
+
+  zero.tv_sec = 0;
+  zero.tv_usec = 0;
+  return amqp_simple_wait_frame_timeout(state, decoded_frame, &zero);
+}
+
+int amqp_simple_wait_frames(amqp_connection_state_t state,
+                            amqp_frame_t *decoded_frames,
+                            int max_frames,
+                            int *num_frames)
+{
+  int count = 0;
+
+  *num_frames = 0;
+  if (max_frames <= 0) {
+    return 0;
+  }
+
+  while (count < max_frames && state->first_queued_frame != NULL) {
+    dequeue_frame(state, &decoded_frames[count++]);
+  }
+
+  if (count == 0) {
+    int res = wait_frame_inner(state, &decoded_frames[0], NULL);
+    if (res < 0) {
+      return res;
+    }
+    count = 1;
+  }
+
+  /* frames still queued were received before anything in the buffer;
+     the release policy must not reclaim frames already returned here */
+  if (state->first_queued_frame == NULL) {
+    state->release_held = 1;
+    while (count < max_frames) {
+      if (decode_buffered_frame(state, &decoded_frames[count]) < 0
+          || decoded_frames[count].frame_type == 0) {
+        break;
+      }
+      count++;
+    }
+    state->release_held = 0;
+  }
+
+  *num_frames = count;
+  return 0;
+}
+
+/* Copies frame into its channel's pool, ready to be queued */
+static amqp_link_t *copy_frame(amqp_connection_state_t state,
+                               const amqp_frame_t *frame)
+{
+  amqp_channel_pool_t *channel_pool =
+    amqp_get_channel_pool(state, frame->channel);
+  amqp_frame_t *frame_copy;
+  amqp_link_t *link;
+
+  if (channel_pool == NULL) {
+    return NULL;
+  }
+  frame_copy = amqp_pool_alloc(&channel_pool->pool, sizeof(amqp_frame_t));
+  link = amqp_pool_alloc(&channel_pool->pool, sizeof(amqp_link_t));
+  if (frame_copy == NULL || link == NULL) {
+    return NULL;
+  }
+
+  *frame_copy = *frame;
+  link->data = frame_copy;
+  return link;
+}
+
+static int enqueue_frame(amqp_connection_state_t state,
+                         const amqp_frame_t *frame)
+{
+  amqp_link_t *link = copy_frame(state, frame);
+
+  if (link == NULL) {
+    return -ERROR_NO_MEMORY;
+  }
+
+  link->next = NULL;
+
+  if (state->last_queued_frame == NULL) {
+    state->first_queued_frame = link;
+  } else {
+    state->last_queued_frame->next = link;
+  }
+  state->last_queued_frame = link;
+  return 0;
+}
+
+int amqp_simple_wait_frame_on_channel(amqp_connection_state_t state,
+                                      amqp_channel_t channel,
+                                      amqp_frame_t *decoded_frame)
+{
+  amqp_link_t *prev = NULL;
+  amqp_link_t *link;
+
+  for (link = state->first_queued_frame; link != NULL; link = link->next) {
+    amqp_frame_t *f = link->data;
+    if (f->channel == channel) {
+      if (prev == NULL) {
+        state->first_queued_frame = link->next;
+      } else {
+        prev->next = link->next;
+      }
+      if (state->last_queued_frame == link) {
+        state->last_queued_frame = prev;
+      }
+      *decoded_frame = *f;
+      return 0;
+    }
+    prev = link;
+  }
+
+  while (1) {
+    int res = wait_frame_inner(state, decoded_frame, NULL);
+    if (res < 0) {
+      return res;
+    }
+
+    if (decoded_frame->channel == channel) {
+      return 0;
+    }
+
+    /* heartbeats carry nothing worth keeping, and queueing them would
+       stop amqp_maybe_release_buffers from ever releasing anything */
+    if (decoded_frame->frame_type != AMQP_FRAME_HEARTBEAT) {
+      res = enqueue_frame(state, decoded_frame);
+      if (res < 0) {
+        return res;
+      }
+    }
+  }
+}
+
+int amqp_put_back_frame(amqp_connection_state_t state,
+                        const amqp_frame_t *frame)
+{
+  amqp_link_t *link = copy_frame(state, frame);
+
+  if (link == NULL) {
+    return -ERROR_NO_MEMORY;
+  }
+
+  link->next = state->first_queued_frame;
+
+  state->first_queued_frame = link;
+  if (state->last_queued_frame == NULL) {
+    state->last_queued_frame = link;
+  }
+  return 0;
+}
+
+/*
+ * Reads exactly len bytes of the stream into dest, taking whatever is
+ * already buffered first and then receiving straight into dest.
+ */
+static int read_exact(amqp_connection_state_t state, void *dest, size_t len)
+{
+  size_t buffered = state->sock_inbound_limit - state->sock_inbound_offset;
+  if (buffered > len) {
+    buffered = len;
+  }
+
+  if (buffered > 0) {
+    memcpy(dest, amqp_offset(state->sock_inbound_buffer.bytes,
+                             state->sock_inbound_offset), buffered);
+    state->sock_inbound_offset += buffered;
+    dest = amqp_offset(dest, buffered);
+    len -= buffered;
+  }
+
+  if (len > 0) {
+    int res = amqp_flush(state);
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  while (len > 0) {
+    int res = amqp_socket_recv(state->socket, dest, len, 0);
+    if (res <= 0) {
+      if (res == 0) {
+        return -ERROR_CONNECTION_CLOSED;
+      } else {
+        return -amqp_socket_error(state->socket);
+      }
+    }
+    dest = amqp_offset(dest, res);
+    len -= res;
+  }
+
+  return 0;
+}
+
+/*
+ * Scatters len bytes of the stream over buffers, starting at *offset
+ * within buffers[*index].
+ */
+static int read_body_payload(amqp_connection_state_t state, size_t len,
+                             amqp_bytes_t *buffers, int *index,
+                             size_t *offset)
+{
+  while (len > 0) {
+    size_t chunk = buffers[*index].len - *offset;
+    int res;
+
+    if (chunk == 0) {
+      (*index)++;
+      *offset = 0;
+      continue;
+    }
+    if (chunk > len) {
+      chunk = len;
+    }
+
+    res = read_exact(state, amqp_offset(buffers[*index].bytes, *offset),
+                     chunk);
+    if (res < 0) {
+      return res;
+    }
+    *offset += chunk;
+    len -= chunk;
   }
+  return 0;
+}
+
+/*
+ * Takes body frames for channel out of the queue, in order, leaving any
+ * other frames queued.
+ */
+static int dequeue_body_frames(amqp_connection_state_t state,
+                               amqp_channel_t channel,
+                               uint64_t *remaining, amqp_bytes_t *buffers,
+                               int *index, size_t *offset)
+{
+  amqp_link_t *prev = NULL;
+  amqp_link_t *link = state->first_queued_frame;
+
+  while (link != NULL && *remaining > 0) {
+    amqp_frame_t *frame = link->data;
+    amqp_bytes_t fragment = frame->payload.body_fragment;
+
+    if (frame->frame_type != AMQP_FRAME_BODY || frame->channel != channel) {
+      prev = link;
+      link = link->next;
+      continue;
+    }
+    if (fragment.len > *remaining) {
+      return -ERROR_BAD_AMQP_DATA;
+    }
+
+    while (fragment.len > 0) {
+      size_t chunk = buffers[*index].len - *offset;
+      if (chunk > fragment.len) {
+        chunk = fragment.len;
+      }
+      memcpy(amqp_offset(buffers[*index].bytes, *offset), fragment.bytes,
+             chunk);
+      fragment.bytes = amqp_offset(fragment.bytes, chunk);
+      fragment.len -= chunk;
+      *offset += chunk;
+      if (*offset == buffers[*index].len) {
+        (*index)++;
+        *offset = 0;
+      }
+    }
+    *remaining -= frame->payload.body_fragment.len;
+
+    link = link->next;
+    if (prev == NULL) {
+      state->first_queued_frame = link;
+    } else {
+      prev->next = link;
+    }
+    if (link == NULL) {
+      state->last_queued_frame = prev;
+    }
+  }
+
+  return 0;
+}
+
+int amqp_simple_wait_body(amqp_connection_state_t state,
+                          amqp_channel_t channel,
+                          uint64_t body_size,
+                          amqp_bytes_t *buffers,
+                          int num_buffers)
+{
+  char header[FOOTER_SIZE + HEADER_SIZE];
+  uint64_t remaining = body_size;
+  uint64_t capacity = 0;
+  size_t offset = 0;
+  int index = 0;
+  int i;
+  int res;
+
+  if (state->state != CONNECTION_STATE_IDLE) {
+    amqp_abort("Programming error: amqp_simple_wait_body called part way through a frame");
+  }
+  for (i = 0; i < num_buffers; i++) {
+    capacity += buffers[i].len;
+  }
+  if (capacity < body_size) {
+    amqp_abort("Programming error: buffers passed to amqp_simple_wait_body are too small");
+  }
+
+  res = dequeue_body_frames(state, channel, &remaining, buffers, &index,
+                            &offset);
+  if (res < 0 || remaining == 0) {
+    return res;
+  }
+
+  /* The first frame header is read on its own; after that, each frame
+     footer is read together with the next header */
+  res = read_exact(state, header + FOOTER_SIZE, HEADER_SIZE);
+
+  while (res == 0) {
+    uint8_t frame_type = amqp_d8(header, FOOTER_SIZE);
+    amqp_channel_t frame_channel = amqp_d16(header, FOOTER_SIZE + 1);
+    uint32_t payload_size = amqp_d32(header, FOOTER_SIZE + 3);
+
+    if (frame_type == AMQP_FRAME_BODY && frame_channel == channel) {
+      if (payload_size > remaining) {
+        return -ERROR_BAD_AMQP_DATA;
+      }
+
+      res = read_body_payload(state, payload_size, buffers, &index, &offset);
+      if (res < 0) {
+        return res;
+      }
+      remaining -= payload_size;
+
+      if (remaining == 0) {
+        res = read_exact(state, header, FOOTER_SIZE);
+      } else {
+        res = read_exact(state, header, FOOTER_SIZE + HEADER_SIZE);
+      }
+      if (res < 0) {
+        return res;
+      }
+      if (amqp_d8(header, 0) != AMQP_FRAME_END) {
+        return -ERROR_BAD_AMQP_DATA;
+      }
+    } else {
+      /* something else arrived in the middle of the body; decode it
+         normally and keep it for amqp_simple_wait_frame. The release
+         policy sees it first, as it may release the pool it goes in. */
+      amqp_channel_pool_t *channel_pool;
+      amqp_frame_t frame;
+      amqp_bytes_t raw_frame;
+
+      raw_frame.len = payload_size + HEADER_SIZE + FOOTER_SIZE;
+      amqp_frame_started(state, header + FOOTER_SIZE, raw_frame.len);
+      channel_pool = amqp_get_channel_pool(state, frame_channel);
+      if (channel_pool == NULL) {
+        return -ERROR_NO_MEMORY;
+      }
+      raw_frame.bytes = amqp_pool_alloc(&channel_pool->pool, raw_frame.len);
+      if (raw_frame.bytes == NULL) {
+        return -ERROR_NO_MEMORY;
+      }
+      memcpy(raw_frame.bytes, header + FOOTER_SIZE, HEADER_SIZE);
+
+      res = read_exact(state, amqp_offset(raw_frame.bytes, HEADER_SIZE),
+                       payload_size + FOOTER_SIZE);
+      if (res < 0) {
+        return res;
+      }
+      res = amqp_decode_started_frame(state, raw_frame, &frame);
+      if (res < 0) {
+        return res;
+      }
+      if (frame.frame_type != 0) {
+        res = enqueue_frame(state, &frame);
+        if (res < 0) {
+          return res;
+        }
+      }
+
+      res = read_exact(state, header + FOOTER_SIZE, HEADER_SIZE);
+    }
+
+    if (remaining == 0) {
+      return 0;
+    }
+  }
+
+  return res;
 }
 
 int amqp_simple_wait_method(amqp_connection_state_t state,
@@ -420,7 +1364,7 @@ amqp_rpc_reply_t amqp_simple_rpc(amqp_connection_state_t state,
     amqp_frame_t frame;
 
 retry:
-    status = wait_frame_inner(state, &frame);
+    status = wait_frame_inner(state, &frame, NULL);
     if (status < 0) {
       result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
       result.library_error = -status;
@@ -445,27 +1389,13 @@ retry:
              && (frame.payload.method.id == AMQP_CONNECTION_CLOSE_METHOD))
           )
          )) {
-      amqp_frame_t *frame_copy = amqp_pool_alloc(&state->decoding_pool, sizeof(amqp_frame_t));
-      amqp_link_t *link = amqp_pool_alloc(&state->decoding_pool, sizeof(amqp_link_t));
-
-      if (frame_copy == NULL || link == NULL) {
+      status = enqueue_frame(state, &frame);
+      if (status < 0) {
         result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-        result.library_error = ERROR_NO_MEMORY;
+        result.library_error = -status;
         return result;
       }
 
-      *frame_copy = frame;
-
-      link->next = NULL;
-      link->data = frame_copy;
-
-      if (state->last_queued_frame == NULL) {
-        state->first_queued_frame = link;
-      } else {
-        state->last_queued_frame->next = link;
-      }
-      state->last_queued_frame = link;
-
       goto retry;
     }
 
@@ -566,9 +1496,14 @@ static amqp_rpc_reply_t amqp_login_inner(amqp_connection_state_t state,
     amqp_table_entry_t default_properties[2];
     amqp_table_t default_table;
     amqp_connection_start_ok_t s;
-    amqp_bytes_t response_bytes = sasl_response(&state->decoding_pool,
-                                  sasl_method, vl);
+    amqp_channel_pool_t *channel_pool = amqp_get_channel_pool(state, 0);
+    amqp_bytes_t response_bytes;
 
+    if (channel_pool == NULL) {
+      res = -ERROR_NO_MEMORY;
+      goto error_res;
+    }
+    response_bytes = sasl_response(&channel_pool->pool, sasl_method, vl);
     if (response_bytes.bytes == NULL) {
       res = -ERROR_NO_MEMORY;
       goto error_res;
@@ -602,7 +1537,7 @@ static amqp_rpc_reply_t amqp_login_inner(amqp_connection_state_t state,
       int i;
       amqp_table_entry_t *current_entry;
 
-      s.client_properties.entries = amqp_pool_alloc(&state->decoding_pool,
+      s.client_properties.entries = amqp_pool_alloc(&channel_pool->pool,
                                     sizeof(amqp_table_entry_t) * (default_table.num_entries + client_properties->num_entries));
       if (NULL == s.client_properties.entries) {
         res = -ERROR_NO_MEMORY;
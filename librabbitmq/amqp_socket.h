@@ -41,6 +41,12 @@ typedef int (*amqp_socket_open_fn)(void *, const char *, int);
 typedef int (*amqp_socket_close_fn)(void *);
 typedef int (*amqp_socket_error_fn)(void *);
 typedef int (*amqp_socket_get_sockfd_fn)(void *);
+typedef ssize_t (*amqp_socket_readv_fn)(void *, const struct iovec *, int);
+typedef size_t (*amqp_socket_buffer_size_fn)(void *);
+typedef ssize_t (*amqp_socket_sendfile_fn)(void *, int, off_t *, size_t);
+typedef size_t (*amqp_socket_pending_fn)(void *);
+typedef void (*amqp_socket_set_allocator_fn)(void *,
+                                             const amqp_allocator_t *);
 
 /** V-table for amqp_socket_t */
 struct amqp_socket_class_t {
@@ -51,6 +57,11 @@ struct amqp_socket_class_t {
   amqp_socket_close_fn close;
   amqp_socket_error_fn error;
   amqp_socket_get_sockfd_fn get_sockfd;
+  amqp_socket_readv_fn readv; /* optional */
+  amqp_socket_buffer_size_fn buffer_size; /* optional */
+  amqp_socket_sendfile_fn sendfile; /* optional */
+  amqp_socket_pending_fn pending; /* optional */
+  amqp_socket_set_allocator_fn set_allocator; /* optional */
 };
 
 /** Abstract base class for amqp_socket_t */
@@ -87,6 +98,21 @@ amqp_socket_writev(amqp_socket_t *self, const struct iovec *iov, int iovcnt);
 ssize_t
 amqp_socket_send(amqp_socket_t *self, const void *buf, size_t len, int flags);
 
+/**
+ * Write all of the data in a vector, carrying on after partial writes.
+ * A single vector is sent with MSG_NOSIGNAL; socket classes' writev
+ * should suppress SIGPIPE likewise.
+ *
+ * \param [in,out] self A socket object.
+ * \param [in,out] iov One or more data vectors, which are used up as they
+ *             are written.
+ * \param [in] iovcnt The number of vectors in \e iov.
+ *
+ * \return Zero, or -1 if an error occurred.
+ */
+int
+amqp_socket_writev_all(amqp_socket_t *self, struct iovec *iov, int iovcnt);
+
 /**
  * Receive a message from a socket.
  *
@@ -102,6 +128,98 @@ amqp_socket_send(amqp_socket_t *self, const void *buf, size_t len, int flags);
 ssize_t
 amqp_socket_recv(amqp_socket_t *self, void *buf, size_t len, int flags);
 
+/**
+ * Read from a socket into several buffers.
+ *
+ * This function is analagous to readv(2). Only socket classes that
+ * provide a readv callback support it; see amqp_socket_can_readv().
+ *
+ * \param [in,out] self A socket object.
+ * \param [in] iov One or more data vecors.
+ * \param [in] iovcnt The number of vectors in \e iov.
+ *
+ * \return The number of bytes received, or -1 if an error occurred.
+ */
+ssize_t
+amqp_socket_readv(amqp_socket_t *self, const struct iovec *iov, int iovcnt);
+
+/**
+ * Check whether a socket supports amqp_socket_readv().
+ *
+ * \param [in] self A socket object.
+ *
+ * \return Non-zero if the socket can read into several buffers at once.
+ */
+int
+amqp_socket_can_readv(amqp_socket_t *self);
+
+/**
+ * Report how much memory a socket holds in buffers of its own.
+ *
+ * For the SSL sockets this is the scratch buffer writev gathers into
+ * before handing a single record to the SSL library.
+ *
+ * \param [in] self A socket object, or NULL.
+ *
+ * \return The number of bytes, or 0 if the socket class keeps no buffers.
+ */
+size_t
+amqp_socket_buffer_size(amqp_socket_t *self);
+
+/**
+ * Send bytes of a file straight from the kernel.
+ *
+ * This function is analagous to sendfile(2). Only socket classes that
+ * write to the socket unchanged provide it; see
+ * amqp_socket_can_sendfile().
+ *
+ * \param [in,out] self A socket object.
+ * \param [in] fd The file to send from.
+ * \param [in,out] offset Where in the file to start, advanced past the
+ *             bytes sent, or NULL to send from and advance the file's
+ *             own position.
+ * \param [in] count The most bytes to send.
+ *
+ * \return The number of bytes sent, or -1 if an error occurred.
+ */
+ssize_t
+amqp_socket_sendfile(amqp_socket_t *self, int fd, off_t *offset,
+                     size_t count);
+
+/**
+ * Check whether a socket supports amqp_socket_sendfile().
+ *
+ * \param [in] self A socket object.
+ *
+ * \return Non-zero if the socket can send from a file.
+ */
+int
+amqp_socket_can_sendfile(amqp_socket_t *self);
+
+/**
+ * Report how much received data a socket holds that can be read
+ * without waiting, although poll() on its descriptor won't show it,
+ * e.g. decrypted SSL records.
+ *
+ * \param [in] self A socket object, or NULL.
+ *
+ * \return The number of bytes, or 0 if the socket class buffers none.
+ */
+size_t
+amqp_socket_pending(amqp_socket_t *self);
+
+/**
+ * Have a socket allocate its own buffers from allocator, as the
+ * connection it is set on does. Buffers it already has from another
+ * allocator are freed first.
+ *
+ * \param [in] self A socket object, or NULL.
+ * \param [in] allocator The allocator to use from now on.
+ */
+void
+amqp_socket_set_allocator(amqp_socket_t *self,
+                          const amqp_allocator_t *allocator);
+
 AMQP_END_DECLS
 
 #endif /* AMQP_SOCKET_H */
@@ -75,7 +75,9 @@ static int amqp_decode_array(amqp_bytes_t encoded,
     return -ERROR_BAD_AMQP_DATA;
   }
 
-  entries = malloc(allocated_entries * sizeof(amqp_field_value_t));
+  entries = amqp_mem_alloc(pool->allocator,
+                           allocated_entries * sizeof(amqp_field_value_t),
+                           AMQP_MEMORY_TABLE);
   if (entries == NULL) {
     return -ERROR_NO_MEMORY;
   }
@@ -84,14 +86,17 @@ static int amqp_decode_array(amqp_bytes_t encoded,
   while (*offset < limit) {
     if (num_entries >= allocated_entries) {
       void *newentries;
-      allocated_entries = allocated_entries * 2;
-      newentries = realloc(entries, allocated_entries * sizeof(amqp_field_value_t));
+      newentries = amqp_mem_realloc(pool->allocator, entries,
+                                    allocated_entries * sizeof(amqp_field_value_t),
+                                    allocated_entries * 2 * sizeof(amqp_field_value_t),
+                                    AMQP_MEMORY_TABLE);
       res = -ERROR_NO_MEMORY;
       if (newentries == NULL) {
         goto out;
       }
 
       entries = newentries;
+      allocated_entries = allocated_entries * 2;
     }
 
     res = amqp_decode_field_value(encoded, pool, &entries[num_entries],
@@ -115,7 +120,9 @@ static int amqp_decode_array(amqp_bytes_t encoded,
   res = 0;
 
 out:
-  free(entries);
+  amqp_mem_free(pool->allocator, entries,
+                allocated_entries * sizeof(amqp_field_value_t),
+                AMQP_MEMORY_TABLE);
   return res;
 }
 
@@ -135,7 +142,9 @@ int amqp_decode_table(amqp_bytes_t encoded,
     return -ERROR_BAD_AMQP_DATA;
   }
 
-  entries = malloc(allocated_entries * sizeof(amqp_table_entry_t));
+  entries = amqp_mem_alloc(pool->allocator,
+                           allocated_entries * sizeof(amqp_table_entry_t),
+                           AMQP_MEMORY_TABLE);
   if (entries == NULL) {
     return -ERROR_NO_MEMORY;
   }
@@ -151,14 +160,17 @@ int amqp_decode_table(amqp_bytes_t encoded,
 
     if (num_entries >= allocated_entries) {
       void *newentries;
-      allocated_entries = allocated_entries * 2;
-      newentries = realloc(entries, allocated_entries * sizeof(amqp_table_entry_t));
+      newentries = amqp_mem_realloc(pool->allocator, entries,
+                                    allocated_entries * sizeof(amqp_table_entry_t),
+                                    allocated_entries * 2 * sizeof(amqp_table_entry_t),
+                                    AMQP_MEMORY_TABLE);
       res = -ERROR_NO_MEMORY;
       if (newentries == NULL) {
         goto out;
       }
 
       entries = newentries;
+      allocated_entries = allocated_entries * 2;
     }
 
     res = -ERROR_BAD_AMQP_DATA;
@@ -187,7 +199,9 @@ int amqp_decode_table(amqp_bytes_t encoded,
   res = 0;
 
 out:
-  free(entries);
+  amqp_mem_free(pool->allocator, entries,
+                allocated_entries * sizeof(amqp_table_entry_t),
+                AMQP_MEMORY_TABLE);
   return res;
 }
 
@@ -283,6 +297,162 @@ out:
 
 /*---------------------------------------------------------------------------*/
 
+static int amqp_skip_field_value(amqp_bytes_t encoded,
+                                 size_t *offset)
+{
+  uint8_t kind;
+  uint32_t len;
+  size_t width;
+
+  if (!amqp_decode_8(encoded, offset, &kind)) {
+    return -ERROR_BAD_AMQP_DATA;
+  }
+
+  switch (kind) {
+  case AMQP_FIELD_KIND_BOOLEAN:
+  case AMQP_FIELD_KIND_I8:
+  case AMQP_FIELD_KIND_U8:
+    width = 1;
+    break;
+
+  case AMQP_FIELD_KIND_I16:
+  case AMQP_FIELD_KIND_U16:
+    width = 2;
+    break;
+
+  case AMQP_FIELD_KIND_I32:
+  case AMQP_FIELD_KIND_U32:
+  case AMQP_FIELD_KIND_F32:
+    width = 4;
+    break;
+
+  case AMQP_FIELD_KIND_I64:
+  case AMQP_FIELD_KIND_U64:
+  case AMQP_FIELD_KIND_F64:
+  case AMQP_FIELD_KIND_TIMESTAMP:
+    width = 8;
+    break;
+
+  case AMQP_FIELD_KIND_DECIMAL:
+    width = 5;
+    break;
+
+  case AMQP_FIELD_KIND_UTF8:
+  case AMQP_FIELD_KIND_BYTES:
+  case AMQP_FIELD_KIND_ARRAY:
+  case AMQP_FIELD_KIND_TABLE:
+    /* All length-prefixed; nested values are never looked at. */
+    if (!amqp_decode_32(encoded, offset, &len)) {
+      return -ERROR_BAD_AMQP_DATA;
+    }
+    width = len;
+    break;
+
+  case AMQP_FIELD_KIND_VOID:
+    width = 0;
+    break;
+
+  default:
+    return -ERROR_BAD_AMQP_DATA;
+  }
+
+  if (encoded.len - *offset < width) {
+    return -ERROR_BAD_AMQP_DATA;
+  }
+  *offset += width;
+  return 0;
+}
+
+int amqp_table_iterator_init(amqp_table_iterator_t *iter,
+                             amqp_bytes_t encoded)
+{
+  uint32_t tablesize;
+
+  iter->encoded = encoded;
+  iter->offset = 0;
+  iter->limit = 0;
+
+  if (!amqp_decode_32(encoded, &iter->offset, &tablesize)
+      || encoded.len - iter->offset < tablesize) {
+    return -ERROR_BAD_AMQP_DATA;
+  }
+
+  iter->limit = iter->offset + tablesize;
+  return 0;
+}
+
+int amqp_table_iterator_next(amqp_table_iterator_t *iter,
+                             amqp_pool_t *pool,
+                             amqp_table_entry_t *entry)
+{
+  amqp_bytes_t table;
+  uint8_t keylen;
+  int res;
+
+  if (iter->offset >= iter->limit) {
+    return 0;
+  }
+
+  /* Never let an entry run past the end of this table, even if the
+     enclosing buffer carries more data after it. */
+  table.bytes = iter->encoded.bytes;
+  table.len = iter->limit;
+
+  if (!amqp_decode_8(table, &iter->offset, &keylen)
+      || !amqp_decode_bytes(table, &iter->offset, &entry->key, keylen)) {
+    return -ERROR_BAD_AMQP_DATA;
+  }
+
+  res = amqp_decode_field_value(table, pool, &entry->value, &iter->offset);
+  if (res < 0) {
+    return res;
+  }
+
+  return 1;
+}
+
+int amqp_table_lookup(amqp_bytes_t encoded,
+                      amqp_bytes_t key,
+                      amqp_pool_t *pool,
+                      amqp_field_value_t *value)
+{
+  amqp_table_iterator_t iter;
+  amqp_bytes_t table;
+  amqp_bytes_t entry_key;
+  uint8_t keylen;
+  int res;
+
+  res = amqp_table_iterator_init(&iter, encoded);
+  if (res < 0) {
+    return res;
+  }
+
+  table.bytes = encoded.bytes;
+  table.len = iter.limit;
+
+  while (iter.offset < iter.limit) {
+    if (!amqp_decode_8(table, &iter.offset, &keylen)
+        || !amqp_decode_bytes(table, &iter.offset, &entry_key, keylen)) {
+      return -ERROR_BAD_AMQP_DATA;
+    }
+
+    if (entry_key.len == key.len
+        && 0 == memcmp(entry_key.bytes, key.bytes, key.len)) {
+      res = amqp_decode_field_value(table, pool, value, &iter.offset);
+      return res < 0 ? res : 1;
+    }
+
+    res = amqp_skip_field_value(table, &iter.offset);
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
 static int amqp_encode_array(amqp_bytes_t encoded,
                              amqp_array_t *input,
                              size_t *offset)
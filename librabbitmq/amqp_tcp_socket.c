@@ -29,6 +29,13 @@
 #include "amqp_tcp_socket.h"
 #include <stdio.h>
 #include <stdlib.h>
+#ifdef HAVE_SENDFILE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#endif
 
 struct amqp_tcp_socket_t {
   const struct amqp_socket_class_t *klass;
@@ -56,6 +63,52 @@ amqp_tcp_socket_recv(void *base, void *buf, size_t len, int flags)
   return recv(self->sockfd, buf, len, flags);
 }
 
+static ssize_t
+amqp_tcp_socket_readv(void *base, const struct iovec *iov, int iovcnt)
+{
+  struct amqp_tcp_socket_t *self = (struct amqp_tcp_socket_t *)base;
+  return amqp_os_socket_readv(self->sockfd, iov, iovcnt);
+}
+
+#ifdef HAVE_SENDFILE
+/*
+ * sendfile has no MSG_NOSIGNAL, so SIGPIPE is blocked around it and one
+ * it raises is taken off the thread again, unless one was already
+ * pending, rather than let it kill the process.
+ */
+static ssize_t
+amqp_tcp_socket_sendfile(void *base, int fd, off_t *offset, size_t count)
+{
+  struct amqp_tcp_socket_t *self = (struct amqp_tcp_socket_t *)base;
+  sigset_t sigpipe;
+  sigset_t pending;
+  sigset_t old_mask;
+  int was_pending;
+  int error;
+  ssize_t res;
+
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  if (pthread_sigmask(SIG_BLOCK, &sigpipe, &old_mask) != 0) {
+    return sendfile(self->sockfd, fd, offset, count);
+  }
+  sigpending(&pending);
+  was_pending = sigismember(&pending, SIGPIPE);
+
+  res = sendfile(self->sockfd, fd, offset, count);
+  error = errno;
+
+  if (res < 0 && error == EPIPE && !was_pending) {
+    struct timespec zero = { 0, 0 };
+    while (sigtimedwait(&sigpipe, NULL, &zero) < 0 && errno == EINTR) {
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  errno = error;
+  return res;
+}
+#endif
+
 static int
 amqp_tcp_socket_open(void *base, const char *host, int port)
 {
@@ -99,7 +152,16 @@ static const struct amqp_socket_class_t amqp_tcp_socket_class = {
   amqp_tcp_socket_open, /* open */
   amqp_tcp_socket_close, /* close */
   amqp_tcp_socket_error, /* error */
-  amqp_tcp_socket_get_sockfd /* get_sockfd */
+  amqp_tcp_socket_get_sockfd, /* get_sockfd */
+  amqp_tcp_socket_readv, /* readv */
+  NULL, /* buffer_size */
+#ifdef HAVE_SENDFILE
+  amqp_tcp_socket_sendfile, /* sendfile */
+#else
+  NULL, /* sendfile */
+#endif
+  NULL, /* pending */
+  NULL /* set_allocator */
 };
 
 amqp_socket_t *
@@ -111,6 +111,50 @@ class BitEncoder(object):
             self.flush()
 
 
+class FieldSkipper(object):
+    """An emitter object that generates code to step over encoded
+    fields, merging runs of fixed-size fields into a single step. It
+    wraps a BitDecoder, so that a bit field that follows skipped bits
+    is read from the right octet."""
+
+    def __init__(self, decoder):
+        self.decoder = decoder
+        self.fixed = 0
+
+    def flush(self):
+        if self.fixed:
+            self.decoder.emitter.emit("offset += %d;" % (self.fixed,))
+            self.fixed = 0
+
+    def emit(self, line):
+        self.flush()
+        self.decoder.emit(line)
+
+    def skip_fixed(self, size):
+        self.decoder.bit = 0
+        self.fixed += size
+
+    def skip_bit(self):
+        if self.decoder.bit == 0:
+            self.fixed += 1
+        self.decoder.bit += 1
+        if self.decoder.bit == 8:
+            self.decoder.bit = 0
+
+    def decode_bit(self, lvalue):
+        """Decode a bit field following skipped ones, which may share its
+        octet."""
+        if self.decoder.bit != 0:
+            self.fixed -= 1
+            self.flush()
+            self.decoder.emitter.emit("if (!amqp_decode_8(encoded, &offset, &bit_buffer)) return -ERROR_BAD_AMQP_DATA;")
+            self.decoder.emitter.emit("%s = (bit_buffer & (1 << %d)) ? 1 : 0;"
+                                      % (lvalue, self.decoder.bit))
+        else:
+            self.flush()
+            self.decoder.decode_bit(lvalue)
+
+
 class SimpleType(object):
     """A AMQP type that corresponds to a simple scalar C value of a
     certain width."""
@@ -125,6 +169,9 @@ class SimpleType(object):
     def encode(self, emitter, value):
         emitter.emit("if (!amqp_encode_%d(encoded, &offset, %s)) return -ERROR_BAD_AMQP_DATA;" % (self.bits, value))
 
+    def skip(self, skipper):
+        skipper.skip_fixed(self.bits // 8)
+
     def literal(self, value):
         return value
 
@@ -148,6 +195,14 @@ class StrType(object):
         emitter.emit("    || !amqp_encode_bytes(encoded, &offset, %s))" % (value,))
         emitter.emit("  return -ERROR_BAD_AMQP_DATA;")
 
+    def skip(self, skipper):
+        skipper.emit("{")
+        skipper.emit("  uint%d_t len;" % (self.lenbits,))
+        skipper.emit("  if (!amqp_decode_%d(encoded, &offset, &len)" % (self.lenbits,))
+        skipper.emit("      || (offset += len) > encoded.len)")
+        skipper.emit("    return -ERROR_BAD_AMQP_DATA;")
+        skipper.emit("}")
+
     def literal(self, value):
         if value != '':
             raise NotImplementedError()
@@ -166,6 +221,9 @@ class BitType(object):
     def encode(self, emitter, value):
         emitter.encode_bit(value)
 
+    def skip(self, skipper):
+        skipper.skip_bit()
+
     def literal(self, value):
         return {True: 1, False: 0}[value]
 
@@ -187,6 +245,9 @@ class TableType(object):
         emitter.emit("  if (res < 0) return res;")
         emitter.emit("}")
 
+    def skip(self, skipper):
+        StrType(32).skip(skipper)
+
     def literal(self, value):
         raise NotImplementedError()
 
@@ -229,6 +290,11 @@ apiMethodInfo  = {
     "amqp_basic_get": False, # get-ok has content
 }
 
+# Methods that applications receive at a high rate can be left encoded
+# (see amqp_set_lazy_method_decoding), with accessor functions that
+# decode individual fields on demand.
+lazyMethods = ["amqp_basic_deliver", "amqp_basic_ack", "amqp_basic_nack"]
+
 # When generating API functions corresponding to synchronous methods,
 # some fields should be suppressed everywhere.  This dict names those
 # fields, and the fixed values to use for them.
@@ -259,6 +325,15 @@ def methodApiPrototype(m):
 
 AmqpMethod.apiPrototype = methodApiPrototype
 
+def fieldAccessorPrototype(m, f):
+    t = typeFor(m.klass.spec, f)
+    if isinstance(t, TableType):
+        pool = "amqp_pool_t *pool, "
+    else:
+        pool = ""
+    return "AMQP_PUBLIC_FUNCTION int AMQP_CALL %s_get_%s(amqp_bytes_t encoded, %s%s *value)" % \
+        (m.fullName(), c_ize(f.name), pool, t.ctype)
+
 def cConstantName(s):
     return 'AMQP_' + '_'.join(re.split('[- ]', s.upper()))
 
@@ -277,6 +352,17 @@ def genErl(spec):
 
     def genDecodeMethodFields(m):
         print "    case %s: {" % (m.defName(),)
+        if m.fullName() in lazyMethods:
+            print "      %s *m = (%s *) amqp_pool_alloc(pool, sizeof(%s));" % \
+                (m.structName(), m.structName(), m.structName())
+            print "      int res;"
+            print "      if (m == NULL) { return -ERROR_NO_MEMORY; }"
+            print "      res = amqp_decode_method_into(methodNumber, encoded, m);"
+            print "      if (res < 0) { return res; }"
+            print "      *decoded = m;"
+            print "      return 0;"
+            print "    }"
+            return
         if m.arguments:
             print "      %s *m = (%s *) amqp_pool_alloc(pool, sizeof(%s));" % \
                 (m.structName(), m.structName(), m.structName())
@@ -292,23 +378,60 @@ def genErl(spec):
         print "      return 0;"
         print "    }"
 
+    def genDecodeMethodInto(m):
+        for f in m.arguments:
+            if isinstance(typeFor(spec, f), TableType):
+                raise Exception("%s cannot be decoded without a pool" % (m.fullName(),))
+
+        print "    case %s: {" % (m.defName(),)
+        print "      %s *m = (%s *) decoded;" % (m.structName(), m.structName())
+
+        emitter = BitDecoder(Emitter("      "))
+        for f in m.arguments:
+            typeFor(spec, f).decode(emitter, "m->"+c_ize(f.name))
+
+        print "      return 0;"
+        print "    }"
+
     def genDecodeProperties(c):
         print "    case %d: {" % (c.index,)
         print "      %s *p = (%s *) amqp_pool_alloc(pool, sizeof(%s));" % \
               (c.structName(), c.structName(), c.structName())
         print "      if (p == NULL) { return -ERROR_NO_MEMORY; }"
-        print "      p->_flags = flags;"
+        print "      p->_flags = flags & wanted;"
 
         emitter = Emitter("      ")
+        inner = Emitter("        ")
         for f in c.fields:
             emitter.emit("if (flags & %s) {" % (cFlagName(c, f),))
-            typeFor(spec, f).decode(emitter, "p->"+c_ize(f.name))
+            inner.emit("if (wanted & %s) {" % (cFlagName(c, f),))
+            typeFor(spec, f).decode(Emitter("          "), "p->"+c_ize(f.name))
+            inner.emit("} else {")
+            skipper = FieldSkipper(BitDecoder(Emitter("          ")))
+            typeFor(spec, f).skip(skipper)
+            skipper.flush()
+            inner.emit("}")
             emitter.emit("}")
 
+        if c.fields:
+            print "      if (offset > encoded.len) return -ERROR_BAD_AMQP_DATA;"
         print "      *decoded = p;"
         print "      return 0;"
         print "    }"
 
+    def genFindProperty(c):
+        print "    case %d:" % (c.index,)
+        emitter = Emitter("      ")
+        for f in c.fields:
+            emitter.emit("if (flags & %s) {" % (cFlagName(c, f),))
+            emitter.emit("  start = offset;")
+            skipper = FieldSkipper(BitDecoder(Emitter("        ")))
+            typeFor(spec, f).skip(skipper)
+            skipper.flush()
+            emitter.emit("  if (flag == %s) goto found;" % (cFlagName(c, f),))
+            emitter.emit("}")
+        print "      break;"
+
     def genEncodeMethodFields(m):
         print "    case %s: {" % (m.defName(),)
         if m.arguments:
@@ -322,6 +445,31 @@ def genErl(spec):
         print "      return offset;"
         print "    }"
 
+    def genFieldAccessor(m, f):
+        print
+        print fieldAccessorPrototype(m, f)
+        print "{"
+        print "  size_t offset = 0;"
+        if spec.resolveDomain(f.domain) == 'bit':
+            print "  uint8_t bit_buffer;"
+        print
+
+        skipper = FieldSkipper(BitDecoder(Emitter("  ")))
+        for g in m.arguments:
+            if g is f:
+                break
+            typeFor(spec, g).skip(skipper)
+
+        t = typeFor(spec, f)
+        if isinstance(t, BitType):
+            skipper.decode_bit("*value")
+        else:
+            skipper.flush()
+            t.decode(skipper.decoder, "(*value)")
+
+        print "  return 0;"
+        print "}"
+
     def genEncodeProperties(c):
         print "    case %d: {" % (c.index,)
         if c.fields:
@@ -423,6 +571,16 @@ amqp_boolean_t amqp_method_has_content(amqp_method_number_t methodNumber) {
   }
 }"""
 
+    print """
+amqp_boolean_t amqp_method_has_field_accessors(amqp_method_number_t methodNumber) {
+  switch (methodNumber) {"""
+    for m in methods:
+        if m.fullName() in lazyMethods:
+            print '    case %s: return 1;' % (m.defName())
+    print """    default: return 0;
+  }
+}"""
+
     print """
 int amqp_decode_method(amqp_method_number_t methodNumber,
                        amqp_pool_t *pool,
@@ -439,30 +597,96 @@ int amqp_decode_method(amqp_method_number_t methodNumber,
 }"""
 
     print """
-int amqp_decode_properties(uint16_t class_id,
-                           amqp_pool_t *pool,
-                           amqp_bytes_t encoded,
-                           void **decoded)
+int amqp_decode_method_into(amqp_method_number_t methodNumber,
+                            amqp_bytes_t encoded,
+                            void *decoded)
 {
   size_t offset = 0;
+  uint8_t bit_buffer;
 
-  amqp_flags_t flags = 0;
+  switch (methodNumber) {"""
+    for m in methods:
+        if m.fullName() in lazyMethods:
+            genDecodeMethodInto(m)
+    print """    default: return -ERROR_UNKNOWN_METHOD;
+  }
+}"""
+
+    print """
+static int amqp_decode_property_flags(amqp_bytes_t encoded,
+                                      size_t *offset,
+                                      amqp_flags_t *flags)
+{
   int flagword_index = 0;
   uint16_t partial_flags;
 
+  *flags = 0;
   do {
-    if (!amqp_decode_16(encoded, &offset, &partial_flags))
+    if (!amqp_decode_16(encoded, offset, &partial_flags))
       return -ERROR_BAD_AMQP_DATA;
-    flags |= (partial_flags << (flagword_index * 16));
+    *flags |= (partial_flags << (flagword_index * 16));
     flagword_index++;
   } while (partial_flags & 1);
 
+  return 0;
+}
+
+int amqp_decode_properties(uint16_t class_id,
+                           amqp_pool_t *pool,
+                           amqp_bytes_t encoded,
+                           void **decoded)
+{
+  return amqp_decode_properties_selective(class_id, pool, encoded,
+                                          ~(amqp_flags_t) 0, decoded);
+}
+
+int amqp_decode_properties_selective(uint16_t class_id,
+                                     amqp_pool_t *pool,
+                                     amqp_bytes_t encoded,
+                                     amqp_flags_t wanted,
+                                     void **decoded)
+{
+  size_t offset = 0;
+  amqp_flags_t flags;
+  int res = amqp_decode_property_flags(encoded, &offset, &flags);
+  if (res < 0) return res;
+
   switch (class_id) {"""
     for c in spec.allClasses(): genDecodeProperties(c)
     print """    default: return -ERROR_UNKNOWN_CLASS;
   }
 }"""
 
+    print """
+int amqp_find_encoded_property(uint16_t class_id,
+                               amqp_bytes_t encoded,
+                               amqp_flags_t flag,
+                               amqp_bytes_t *value)
+{
+  size_t offset = 0;
+  size_t start;
+  amqp_flags_t flags;
+  int res = amqp_decode_property_flags(encoded, &offset, &flags);
+  if (res < 0) return res;
+
+  if (!(flags & flag)) return 0;
+
+  /* skip the properties before the one wanted, then that one too */
+  switch (class_id) {"""
+    for c in spec.allClasses(): genFindProperty(c)
+    print """    default: return -ERROR_UNKNOWN_CLASS;
+  }
+
+  /* flag is not a property of this class */
+  return 0;
+
+found:
+  if (offset > encoded.len) return -ERROR_BAD_AMQP_DATA;
+  value->bytes = amqp_offset(encoded.bytes, start);
+  value->len = offset - start;
+  return 1;
+}"""
+
     print """
 int amqp_encode_method(amqp_method_number_t methodNumber,
                        void *decoded,
@@ -508,6 +732,11 @@ int amqp_encode_properties(uint16_t class_id,
   }
 }"""
 
+    for m in methods:
+        if m.fullName() in lazyMethods:
+            for f in m.arguments:
+                genFieldAccessor(m, f)
+
     for m in methods:
         if not m.isSynchronous:
             continue
@@ -629,6 +858,10 @@ AMQP_PUBLIC_FUNCTION
 amqp_boolean_t
 AMQP_CALL amqp_method_has_content(amqp_method_number_t methodNumber);
 
+AMQP_PUBLIC_FUNCTION
+amqp_boolean_t
+AMQP_CALL amqp_method_has_field_accessors(amqp_method_number_t methodNumber);
+
 AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_decode_method(amqp_method_number_t methodNumber,
@@ -636,6 +869,19 @@ AMQP_CALL amqp_decode_method(amqp_method_number_t methodNumber,
 		   amqp_bytes_t encoded,
 		   void **decoded);
 
+/*
+ * Decodes a method into caller-provided storage, without allocating:
+ * decoded must point to the method's struct, e.g. an amqp_basic_ack_t.
+ * String fields point into encoded. Only methods for which
+ * amqp_method_has_field_accessors is true are supported; any other
+ * method gives -ERROR_UNKNOWN_METHOD.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_decode_method_into(amqp_method_number_t methodNumber,
+		   amqp_bytes_t encoded,
+		   void *decoded);
+
 AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_decode_properties(uint16_t class_id,
@@ -643,6 +889,21 @@ AMQP_CALL amqp_decode_properties(uint16_t class_id,
             amqp_bytes_t encoded,
             void **decoded);
 
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_decode_properties_selective(uint16_t class_id,
+            amqp_pool_t *pool,
+            amqp_bytes_t encoded,
+            amqp_flags_t wanted,
+            void **decoded);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_find_encoded_property(uint16_t class_id,
+            amqp_bytes_t encoded,
+            amqp_flags_t flag,
+            amqp_bytes_t *value);
+
 AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_encode_method(amqp_method_number_t methodNumber,
@@ -686,6 +947,14 @@ AMQP_CALL amqp_encode_properties(uint16_t class_id,
                fieldDeclList(c.fields),
                c.structName())
 
+    print "/* Field accessors for encoded methods */\n"
+
+    for m in methods:
+        if m.fullName() in lazyMethods:
+            for f in m.arguments:
+                print "%s;" % (fieldAccessorPrototype(m, f),)
+    print
+
     print "/* API functions for methods */\n"
 
     for m in methods:
@@ -92,7 +92,39 @@ ssize_t
 amqp_os_socket_writev(int sockfd, const struct iovec *iov,
                       int iovcnt)
 {
-  return writev(sockfd, iov, iovcnt);
+  struct msghdr msg;
+
+  /* sendmsg rather than writev, so that a closed peer gives EPIPE
+     rather than SIGPIPE */
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = (struct iovec *)iov;
+  msg.msg_iovlen = iovcnt;
+  return sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+}
+
+ssize_t
+amqp_os_socket_readv(int sockfd, const struct iovec *iov, int iovcnt)
+{
+  return readv(sockfd, iov, iovcnt);
+}
+
+ssize_t
+amqp_os_file_read(int fd, void *buf, size_t len, int64_t *offset)
+{
+  ssize_t res;
+
+  if (offset == NULL) {
+    return read(fd, buf, len);
+  }
+  if ((off_t)*offset != *offset) {
+    errno = EOVERFLOW;
+    return -1;
+  }
+  res = pread(fd, buf, len, (off_t)*offset);
+  if (res > 0) {
+    *offset += res;
+  }
+  return res;
 }
 
 int
@@ -43,6 +43,7 @@
 #include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <stdint.h>
 #include <sys/uio.h>
 
 int
@@ -60,6 +61,14 @@ amqp_os_socket_close(int sockfd);
 ssize_t
 amqp_os_socket_writev(int sockfd, const struct iovec *iov, int iovcnt);
 
+ssize_t
+amqp_os_socket_readv(int sockfd, const struct iovec *iov, int iovcnt);
+
+/* Reads from fd at *offset, advancing it, or from the file's own
+   position if offset is NULL; errors are left in errno */
+ssize_t
+amqp_os_file_read(int fd, void *buf, size_t len, int64_t *offset);
+
 #define amqp_socket_setsockopt setsockopt
 
 #if defined(SO_NOSIGPIPE) && !defined(MSG_NOSIGNAL)
@@ -43,7 +43,10 @@
 
 #include "amqp_private.h"
 #include "socket.h"
+#include <io.h>
+#include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <windows.h>
 
@@ -109,6 +112,36 @@ amqp_os_socket_writev(int sock, struct iovec *iov, int nvecs)
   }
 }
 
+ssize_t
+amqp_os_socket_readv(int sock, struct iovec *iov, int nvecs)
+{
+  DWORD ret;
+  DWORD flags = 0;
+  if (WSARecv(sock, (LPWSABUF)iov, nvecs, &ret, &flags, NULL, NULL) == 0) {
+    return ret;
+  } else {
+    return -1;
+  }
+}
+
+ssize_t
+amqp_os_file_read(int fd, void *buf, size_t len, int64_t *offset)
+{
+  int res;
+
+  if (len > INT_MAX) {
+    len = INT_MAX;
+  }
+  if (offset != NULL && _lseeki64(fd, *offset, SEEK_SET) < 0) {
+    return -1;
+  }
+  res = _read(fd, buf, (unsigned int)len);
+  if (offset != NULL && res > 0) {
+    *offset += res;
+  }
+  return res;
+}
+
 int
 amqp_os_socket_error(void)
 {
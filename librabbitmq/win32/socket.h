@@ -66,6 +66,14 @@ amqp_os_socket_close(int sockfd);
 ssize_t
 amqp_os_socket_writev(int sock, struct iovec *iov, int nvecs);
 
+ssize_t
+amqp_os_socket_readv(int sock, struct iovec *iov, int nvecs);
+
+/* Reads from fd at *offset, advancing it, or from the file's own
+   position if offset is NULL; errors are left in errno */
+ssize_t
+amqp_os_file_read(int fd, void *buf, size_t len, int64_t *offset);
+
 int
 amqp_os_socket_error(void);
 
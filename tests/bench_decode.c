@@ -0,0 +1,185 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+/*
+ * Compares the generic, pool-allocating amqp_decode_method with the
+ * allocation-free amqp_decode_method_into for the high-rate methods.
+ *
+ *   bench_decode [iterations]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+
+#define DEFAULT_ITERATIONS 5000000
+/* how many methods are decoded between amqp_maybe_release_buffers calls */
+#define RELEASE_INTERVAL 1000
+
+static double now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static amqp_bytes_t encode(amqp_method_number_t id, void *decoded,
+                           char *buf, size_t len)
+{
+  amqp_bytes_t encoded;
+  int res;
+
+  encoded.bytes = buf;
+  encoded.len = len;
+  res = amqp_encode_method(id, decoded, encoded);
+  if (res < 0) {
+    fprintf(stderr, "encoding %s failed: %d\n", amqp_method_name(id), res);
+    exit(1);
+  }
+  encoded.len = res;
+  return encoded;
+}
+
+static void report(const char *path, amqp_method_number_t id,
+                   long iterations, double elapsed)
+{
+  printf("%-8s %-24s %8.1f ns/method\n", path, amqp_method_name(id),
+         elapsed * 1e9 / iterations);
+}
+
+static uint64_t bench_generic(amqp_method_number_t id, amqp_bytes_t encoded,
+                              long iterations)
+{
+  amqp_pool_t pool;
+  uint64_t sum = 0;
+  double start;
+  long i;
+
+  init_amqp_pool(&pool, 131072);
+  start = now_seconds();
+  for (i = 0; i < iterations; i++) {
+    void *decoded;
+    if (amqp_decode_method(id, &pool, encoded, &decoded) < 0) {
+      fprintf(stderr, "decoding %s failed\n", amqp_method_name(id));
+      exit(1);
+    }
+    /* every method benchmarked starts with its delivery tag */
+    sum += id == AMQP_BASIC_DELIVER_METHOD
+           ? ((amqp_basic_deliver_t *)decoded)->delivery_tag
+           : ((amqp_basic_ack_t *)decoded)->delivery_tag;
+    if (i % RELEASE_INTERVAL == 0) {
+      recycle_amqp_pool(&pool);
+    }
+  }
+  report("generic", id, iterations, now_seconds() - start);
+  empty_amqp_pool(&pool);
+  return sum;
+}
+
+static uint64_t bench_into(amqp_method_number_t id, amqp_bytes_t encoded,
+                           long iterations)
+{
+  union {
+    amqp_basic_deliver_t deliver;
+    amqp_basic_ack_t ack;
+    amqp_basic_nack_t nack;
+  } storage;
+  uint64_t sum = 0;
+  double start;
+  long i;
+
+  start = now_seconds();
+  for (i = 0; i < iterations; i++) {
+    if (amqp_decode_method_into(id, encoded, &storage) < 0) {
+      fprintf(stderr, "decoding %s failed\n", amqp_method_name(id));
+      exit(1);
+    }
+    sum += id == AMQP_BASIC_DELIVER_METHOD
+           ? storage.deliver.delivery_tag : storage.ack.delivery_tag;
+  }
+  report("into", id, iterations, now_seconds() - start);
+  return sum;
+}
+
+int main(int argc, char **argv)
+{
+  char deliver_buf[256], ack_buf[64], nack_buf[64];
+  amqp_basic_deliver_t deliver;
+  amqp_basic_ack_t ack;
+  amqp_basic_nack_t nack;
+  amqp_method_number_t ids[3];
+  amqp_bytes_t encoded[3];
+  long iterations = DEFAULT_ITERATIONS;
+  int i;
+
+  if (argc > 1) {
+    iterations = atol(argv[1]);
+  }
+
+  deliver.consumer_tag = amqp_cstring_bytes("amq.ctag-bench");
+  deliver.delivery_tag = 12345;
+  deliver.redelivered = 0;
+  deliver.exchange = amqp_cstring_bytes("amq.direct");
+  deliver.routing_key = amqp_cstring_bytes("bench.routing.key");
+  ack.delivery_tag = 12345;
+  ack.multiple = 1;
+  nack.delivery_tag = 12345;
+  nack.multiple = 0;
+  nack.requeue = 1;
+
+  ids[0] = AMQP_BASIC_DELIVER_METHOD;
+  encoded[0] = encode(ids[0], &deliver, deliver_buf, sizeof(deliver_buf));
+  ids[1] = AMQP_BASIC_ACK_METHOD;
+  encoded[1] = encode(ids[1], &ack, ack_buf, sizeof(ack_buf));
+  ids[2] = AMQP_BASIC_NACK_METHOD;
+  encoded[2] = encode(ids[2], &nack, nack_buf, sizeof(nack_buf));
+
+  for (i = 0; i < 3; i++) {
+    if (bench_generic(ids[i], encoded[i], iterations)
+        != bench_into(ids[i], encoded[i], iterations)) {
+      fprintf(stderr, "%s: decoders disagree\n", amqp_method_name(ids[i]));
+      return 1;
+    }
+  }
+
+  return 0;
+}
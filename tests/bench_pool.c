@@ -0,0 +1,117 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+/*
+ * Measures what zero-filling fresh pool pages costs: each round fills
+ * a new pool with page-sized writes, the way frames are read into the
+ * frame pool, then empties it so the next round gets fresh pages. The
+ * pages are the size of the default frame pool's and few enough that
+ * malloc hands back warm memory, so page faults don't hide the memset.
+ *
+ *   bench_pool [rounds]
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <amqp.h>
+
+#define DEFAULT_ROUNDS 200000
+#define PAGE_SIZE 65536
+#define PAGES_PER_ROUND 2
+
+static double now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned bench(amqp_boolean_t zero_fill, long rounds)
+{
+  static char frame[PAGE_SIZE];
+  unsigned sum = 0;
+  double start;
+  double elapsed;
+  long i;
+  int j;
+
+  memset(frame, 0x5a, sizeof(frame));
+
+  start = now_seconds();
+  for (i = 0; i < rounds; i++) {
+    amqp_pool_t pool;
+
+    init_amqp_pool(&pool, PAGE_SIZE);
+    amqp_pool_set_zero_fill(&pool, zero_fill);
+    for (j = 0; j < PAGES_PER_ROUND; j++) {
+      unsigned char *p = amqp_pool_alloc(&pool, PAGE_SIZE);
+      if (p == NULL) {
+        fprintf(stderr, "amqp_pool_alloc failed\n");
+        exit(1);
+      }
+      memcpy(p, frame, PAGE_SIZE);
+      sum += p[j];
+    }
+    empty_amqp_pool(&pool);
+  }
+  elapsed = now_seconds() - start;
+
+  printf("%-10s %8.1f us/page %8.2f GB/s\n",
+         zero_fill ? "zero-fill" : "no-fill",
+         elapsed * 1e6 / (rounds * PAGES_PER_ROUND),
+         (double)rounds * PAGES_PER_ROUND * PAGE_SIZE / elapsed / 1e9);
+  return sum;
+}
+
+int main(int argc, char **argv)
+{
+  long rounds = DEFAULT_ROUNDS;
+
+  if (argc > 1) {
+    rounds = atol(argv[1]);
+  }
+
+  if (bench(1, rounds) != bench(0, rounds)) {
+    fprintf(stderr, "pools disagree\n");
+    return 1;
+  }
+  return 0;
+}
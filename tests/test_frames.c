@@ -0,0 +1,2148 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_socket.h>
+#include <amqp_tcp_socket.h>
+
+#define BODY_FRAME_COUNT 2000
+#define SMALL_FRAME_COUNT 10000
+#define LARGE_FRAME_COUNT 20
+#define LARGE_FRAME_SIZE 300007
+#define RELEASE_FRAME_COUNT 20000
+#define DETACH_FRAME_COUNT 10
+#define SHARE_FRAME_COUNT 40
+
+static void die(const char *fmt, const char *what, int value)
+{
+  fprintf(stderr, fmt, what, value);
+  fputc('\n', stderr);
+  abort();
+}
+
+static void match_int(const char *what, int expect, int got)
+{
+  if (got != expect) {
+    fprintf(stderr, "Expected %s '%d', got '%d'\n", what, expect, got);
+    abort();
+  }
+}
+
+static void write_all(int fd, const char *data, size_t len)
+{
+  while (len > 0) {
+    ssize_t res = write(fd, data, len);
+    if (res < 0) {
+      die("%s failed: %d", "write", (int)res);
+    }
+    data += res;
+    len -= res;
+  }
+}
+
+static void encode_frame_header(char *out, int type, int channel,
+                                size_t len)
+{
+  out[0] = (char)type;
+  out[1] = (char)(channel >> 8);
+  out[2] = (char)channel;
+  out[3] = (char)(len >> 24);
+  out[4] = (char)(len >> 16);
+  out[5] = (char)(len >> 8);
+  out[6] = (char)len;
+  out[7 + len] = (char)AMQP_FRAME_END;
+}
+
+/* Encodes a frame whose payload is len copies of fill */
+static size_t encode_frame(char *out, int type, int channel, size_t len,
+                           unsigned char fill)
+{
+  memset(out + 7, fill, len);
+  encode_frame_header(out, type, channel, len);
+  return len + 8;
+}
+
+static size_t encode_body_frame(char *out, size_t len, unsigned char fill)
+{
+  return encode_frame(out, AMQP_FRAME_BODY, 1, len, fill);
+}
+
+/* Encodes a basic class header frame on channel 1, with no properties */
+static size_t encode_header_frame(char *out, size_t body_size)
+{
+  size_t len = encode_frame(out, AMQP_FRAME_HEADER, 1, 14, 0);
+  out[7] = 0;
+  out[8] = 60;
+  out[15] = (char)(body_size >> 24);
+  out[16] = (char)(body_size >> 16);
+  out[17] = (char)(body_size >> 8);
+  out[18] = (char)body_size;
+  return len;
+}
+
+static size_t body_len(int i)
+{
+  return 100 + (i * 37) % 1500;
+}
+
+/* Gives conn one end of a socket pair of the given type, and returns
+   the other */
+static int attach_pair_of_type(amqp_connection_state_t conn, int type)
+{
+  int fds[2];
+  amqp_socket_t *socket = amqp_tcp_socket_new();
+
+  if (conn == NULL || socket == NULL) {
+    die("%s failed: %d", "allocation", 0);
+  }
+  if (socketpair(AF_UNIX, type, 0, fds) < 0) {
+    die("%s failed: %d", "socketpair", 0);
+  }
+
+  amqp_tcp_socket_set_sockfd(socket, fds[0]);
+  amqp_set_socket(conn, socket);
+  return fds[1];
+}
+
+static int attach_pair(amqp_connection_state_t conn)
+{
+  return attach_pair_of_type(conn, SOCK_STREAM);
+}
+
+/* A socket that, like an SSL one, reads ahead from its descriptor and
+   hands what it read out no more than max_read bytes at a time */
+typedef struct buffering_socket_t_ {
+  const struct amqp_socket_class_t *klass;
+  int sockfd;
+  size_t max_read;
+  size_t offset;
+  size_t limit;
+  char buffer[65536];
+} buffering_socket_t;
+
+static ssize_t buffering_writev(void *base, const struct iovec *iov,
+                                int iovcnt)
+{
+  return writev(((buffering_socket_t *)base)->sockfd, iov, iovcnt);
+}
+
+static ssize_t buffering_send(void *base, const void *buf, size_t len,
+                              int flags)
+{
+  return send(((buffering_socket_t *)base)->sockfd, buf, len, flags);
+}
+
+static ssize_t buffering_recv(void *base, void *buf, size_t len,
+                              int flags)
+{
+  buffering_socket_t *self = base;
+
+  (void)flags;
+  if (self->offset == self->limit) {
+    ssize_t res = read(self->sockfd, self->buffer, sizeof(self->buffer));
+    if (res <= 0) {
+      return res;
+    }
+    self->offset = 0;
+    self->limit = res;
+  }
+  if (len > self->limit - self->offset) {
+    len = self->limit - self->offset;
+  }
+  if (len > self->max_read) {
+    len = self->max_read;
+  }
+  memcpy(buf, self->buffer + self->offset, len);
+  self->offset += len;
+  return len;
+}
+
+static int buffering_open(void *base, const char *host, int port)
+{
+  (void)base;
+  (void)host;
+  (void)port;
+  return -1;
+}
+
+static int buffering_close(void *base)
+{
+  close(((buffering_socket_t *)base)->sockfd);
+  free(base);
+  return 0;
+}
+
+static int buffering_error(void *base)
+{
+  (void)base;
+  return errno;
+}
+
+static int buffering_get_sockfd(void *base)
+{
+  return ((buffering_socket_t *)base)->sockfd;
+}
+
+static size_t buffering_pending(void *base)
+{
+  buffering_socket_t *self = base;
+  return self->limit - self->offset;
+}
+
+static const struct amqp_socket_class_t buffering_socket_class = {
+  buffering_writev, /* writev */
+  buffering_send, /* send */
+  buffering_recv, /* recv */
+  buffering_open, /* open */
+  buffering_close, /* close */
+  buffering_error, /* error */
+  buffering_get_sockfd, /* get_sockfd */
+  NULL, /* readv */
+  NULL, /* buffer_size */
+  NULL, /* sendfile */
+  buffering_pending, /* pending */
+  NULL /* set_allocator */
+};
+
+/* Like attach_pair, with a buffering socket */
+static int attach_buffering_pair(amqp_connection_state_t conn,
+                                 size_t max_read)
+{
+  buffering_socket_t *socket = calloc(1, sizeof(buffering_socket_t));
+  int fds[2];
+
+  if (conn == NULL || socket == NULL) {
+    die("%s failed: %d", "allocation", 0);
+  }
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    die("%s failed: %d", "socketpair", 0);
+  }
+
+  socket->klass = &buffering_socket_class;
+  socket->sockfd = fds[0];
+  socket->max_read = max_read;
+  amqp_set_socket(conn, (amqp_socket_t *)socket);
+  return fds[1];
+}
+
+static amqp_connection_state_t connect_pair(int *peer)
+{
+  amqp_connection_state_t conn = amqp_new_connection();
+  *peer = attach_pair(conn);
+  return conn;
+}
+
+/* Like connect_pair, but over a socket that keeps writes apart, so that
+   each recv on *peer returns what one write sent */
+static amqp_connection_state_t connect_packet_pair(int *peer)
+{
+  amqp_connection_state_t conn = amqp_new_connection();
+  *peer = attach_pair_of_type(conn, SOCK_SEQPACKET);
+  return conn;
+}
+
+/* Frames are fed in batches that end part way through a frame, so that
+   some are decoded in place from the socket buffer and some are
+   reassembled. None of them may be overwritten before the buffers are
+   released. */
+static void test_frames_survive_refill(void)
+{
+  static amqp_bytes_t bodies[BODY_FRAME_COUNT];
+  static size_t frame_end[BODY_FRAME_COUNT];
+  char *wire = malloc(BODY_FRAME_COUNT * 1608);
+  size_t wire_len = 0;
+  size_t written = 0;
+  int peer;
+  int i;
+  amqp_connection_state_t conn = connect_pair(&peer);
+
+  for (i = 0; i < BODY_FRAME_COUNT; i++) {
+    wire_len += encode_body_frame(wire + wire_len, body_len(i),
+                                  (unsigned char)i);
+    frame_end[i] = wire_len;
+  }
+
+  for (i = 0; i < BODY_FRAME_COUNT; i++) {
+    amqp_frame_t frame;
+    int res;
+
+    if (written < frame_end[i]) {
+      /* runs ahead by an amount that usually ends part way into a frame */
+      size_t chunk = frame_end[i] + 30011 - written;
+      if (chunk > wire_len - written) {
+        chunk = wire_len - written;
+      }
+      write_all(peer, wire + written, chunk);
+      written += chunk;
+    }
+
+    res = amqp_simple_wait_frame(conn, &frame);
+    if (res < 0) {
+      die("%s failed: %d", "amqp_simple_wait_frame", res);
+    }
+    match_int("frame type", AMQP_FRAME_BODY, frame.frame_type);
+    match_int("channel", 1, frame.channel);
+    match_int("body length", (int)body_len(i),
+              (int)frame.payload.body_fragment.len);
+    bodies[i] = frame.payload.body_fragment;
+  }
+
+  for (i = 0; i < BODY_FRAME_COUNT; i++) {
+    size_t j;
+    for (j = 0; j < bodies[i].len; j++) {
+      if (((unsigned char *)bodies[i].bytes)[j] != (unsigned char)i) {
+        die("%s %d was overwritten", "body", i);
+      }
+    }
+  }
+
+  amqp_release_buffers(conn);
+  amqp_destroy_connection(conn);
+  close(peer);
+  free(wire);
+}
+
+/* Each small frame must only take up its own size in the frame pool, not
+   a whole frame_max sized page */
+static void test_small_frames_share_pool_pages(void)
+{
+  char wire[16];
+  size_t frame_len = encode_body_frame(wire, 4, 0xAB);
+  amqp_pool_stats_t stats;
+  int i;
+  amqp_connection_state_t conn = amqp_new_connection();
+
+  for (i = 0; i < SMALL_FRAME_COUNT; i++) {
+    amqp_frame_t frame;
+    amqp_bytes_t input;
+    amqp_bytes_t body;
+    uint64_t allocs;
+    int res;
+
+    input.bytes = wire;
+    input.len = frame_len;
+    res = amqp_handle_input(conn, input, &frame);
+    match_int("bytes consumed", (int)frame_len, res);
+    match_int("frame type", AMQP_FRAME_BODY, frame.frame_type);
+    match_int("body length", 4, (int)frame.payload.body_fragment.len);
+    body = frame.payload.body_fragment;
+
+    /* a heartbeat in between must not take any pool memory at all */
+    amqp_get_channel_memory_stats(conn, 1, &stats);
+    allocs = stats.total_allocs;
+    input.len = encode_body_frame(wire, 0, 0);
+    wire[0] = AMQP_FRAME_HEARTBEAT;
+    res = amqp_handle_input(conn, input, &frame);
+    match_int("heartbeat type", AMQP_FRAME_HEARTBEAT, frame.frame_type);
+    amqp_get_channel_memory_stats(conn, 1, &stats);
+    match_int("heartbeat allocations", (int)allocs, (int)stats.total_allocs);
+    encode_body_frame(wire, 4, 0xAB);
+
+    match_int("body", 0xAB, ((unsigned char *)body.bytes)[0]);
+  }
+
+  /* each frame takes 16 bytes, so whatever the page size many of them
+     share each page */
+  amqp_get_channel_memory_stats(conn, 1, &stats);
+  match_int("frames allocated", SMALL_FRAME_COUNT, (int)stats.total_allocs);
+  match_int("large blocks", 0, stats.large_blocks);
+  if (stats.pages < 1 || stats.pages > SMALL_FRAME_COUNT / 64) {
+    die("%s frames spread over %d pool pages", "small", stats.pages);
+  }
+
+  amqp_release_buffers(conn);
+  amqp_destroy_connection(conn);
+}
+
+static void test_wait_frames_drains_buffer(void)
+{
+  static amqp_frame_t frames[200];
+  char wire[250 * 24];
+  size_t wire_len = 0;
+  int peer;
+  int num_frames;
+  int total = 0;
+  int i;
+  amqp_connection_state_t conn = connect_pair(&peer);
+
+  for (i = 0; i < 250; i++) {
+    wire_len += encode_body_frame(wire + wire_len, 8 + i % 8,
+                                  (unsigned char)i);
+  }
+  write_all(peer, wire, wire_len);
+
+  /* everything arrives in one read, so it comes back in two calls */
+  while (total < 250) {
+    int res = amqp_simple_wait_frames(conn, frames, 200, &num_frames);
+    if (res < 0) {
+      die("%s failed: %d", "amqp_simple_wait_frames", res);
+    }
+    match_int("frames returned", total == 0 ? 200 : 50, num_frames);
+
+    for (i = 0; i < num_frames; i++, total++) {
+      match_int("frame type", AMQP_FRAME_BODY, frames[i].frame_type);
+      match_int("body length", 8 + total % 8,
+                (int)frames[i].payload.body_fragment.len);
+      match_int("body", (unsigned char)total,
+                ((unsigned char *)frames[i].payload.body_fragment.bytes)[0]);
+    }
+  }
+
+  amqp_destroy_connection(conn);
+  close(peer);
+}
+
+static void check_body(amqp_bytes_t *buffers, size_t *frame_lens,
+                       int num_frames)
+{
+  size_t offset = 0;
+  int index = 0;
+  int i;
+
+  for (i = 0; i < num_frames; i++) {
+    size_t j;
+    for (j = 0; j < frame_lens[i]; j++) {
+      if (offset == buffers[index].len) {
+        index++;
+        offset = 0;
+      }
+      if (((unsigned char *)buffers[index].bytes)[offset++] != (unsigned char)i) {
+        die("%s of body frame %d is wrong", "content", i);
+      }
+    }
+  }
+}
+
+static void expect_frame(amqp_connection_state_t conn, int type, int channel)
+{
+  amqp_frame_t frame;
+  int res = amqp_simple_wait_frame(conn, &frame);
+  if (res < 0) {
+    die("%s failed: %d", "amqp_simple_wait_frame", res);
+  }
+  match_int("frame type", type, frame.frame_type);
+  match_int("channel", channel, frame.channel);
+}
+
+static void test_wait_body(void)
+{
+  static size_t frame_lens[3] = { 40000, 40000, 20000 };
+  static char first[2 * 1024];
+  static char second[100 * 1024];
+  amqp_bytes_t buffers[2];
+  char *wire = malloc(3 * 40008 + 1024);
+  size_t wire_len;
+  int peer;
+  int pass;
+  amqp_connection_state_t conn = connect_pair(&peer);
+
+  buffers[0].bytes = first;
+  buffers[0].len = sizeof(first);
+  buffers[1].bytes = second;
+  buffers[1].len = sizeof(second);
+
+  /* on the first pass the whole message is already buffered; on the
+     second the body is written only after the header was read, so it is
+     received directly into the buffers */
+  for (pass = 0; pass < 2; pass++) {
+    int res;
+
+    wire_len = encode_header_frame(wire, 100000);
+    if (pass == 1) {
+      write_all(peer, wire, wire_len);
+      expect_frame(conn, AMQP_FRAME_HEADER, 1);
+      wire_len = 0;
+    }
+    wire_len += encode_body_frame(wire + wire_len, frame_lens[0], 0);
+    wire_len += encode_frame(wire + wire_len, AMQP_FRAME_HEARTBEAT, 0, 0, 0);
+    wire_len += encode_frame(wire + wire_len, AMQP_FRAME_BODY, 2, 10, 9);
+    wire_len += encode_body_frame(wire + wire_len, frame_lens[1], 1);
+    wire_len += encode_body_frame(wire + wire_len, frame_lens[2], 2);
+    write_all(peer, wire, wire_len);
+    if (pass == 0) {
+      expect_frame(conn, AMQP_FRAME_HEADER, 1);
+    }
+
+    memset(first, 0xFF, sizeof(first));
+    memset(second, 0xFF, sizeof(second));
+    res = amqp_simple_wait_body(conn, 1, 100000, buffers, 2);
+    if (res < 0) {
+      die("%s failed: %d", "amqp_simple_wait_body", res);
+    }
+    check_body(buffers, frame_lens, 3);
+
+    /* the frames that came in between are still there, in order */
+    expect_frame(conn, AMQP_FRAME_HEARTBEAT, 0);
+    expect_frame(conn, AMQP_FRAME_BODY, 2);
+    if (amqp_frames_enqueued(conn) || amqp_data_in_buffer(conn)) {
+      die("%s left over after pass %d", "frames", pass);
+    }
+    amqp_release_buffers(conn);
+  }
+
+  amqp_destroy_connection(conn);
+  close(peer);
+  free(wire);
+}
+
+/* Frames bigger than the socket buffer arrive over many reads; the
+   writer is a separate process since they do not fit in the socket */
+static void test_large_frames(void)
+{
+  int peer;
+  int i;
+  pid_t child;
+  int status;
+  amqp_connection_state_t conn = connect_pair(&peer);
+
+  child = fork();
+  if (child < 0) {
+    die("%s failed: %d", "fork", (int)child);
+  }
+  if (child == 0) {
+    char *wire = malloc(LARGE_FRAME_SIZE + 8);
+    for (i = 0; i < LARGE_FRAME_COUNT; i++) {
+      size_t len = encode_body_frame(wire, LARGE_FRAME_SIZE - i,
+                                     (unsigned char)i);
+      /* split unevenly, as the network would */
+      write_all(peer, wire, 1000 + i);
+      write_all(peer, wire + 1000 + i, len - 1000 - i);
+      len = encode_body_frame(wire, 10, (unsigned char)i);
+      write_all(peer, wire, len);
+    }
+    free(wire);
+    _exit(0);
+  }
+
+  for (i = 0; i < LARGE_FRAME_COUNT * 2; i++) {
+    amqp_frame_t frame;
+    size_t expected_len = i % 2 ? 10 : (size_t)(LARGE_FRAME_SIZE - i / 2);
+    size_t j;
+    int res = amqp_simple_wait_frame(conn, &frame);
+    if (res < 0) {
+      die("%s failed: %d", "amqp_simple_wait_frame", res);
+    }
+    match_int("frame type", AMQP_FRAME_BODY, frame.frame_type);
+    match_int("body length", (int)expected_len,
+              (int)frame.payload.body_fragment.len);
+    for (j = 0; j < expected_len; j++) {
+      if (((unsigned char *)frame.payload.body_fragment.bytes)[j]
+          != (unsigned char)(i / 2)) {
+        die("%s of frame %d is wrong", "content", i);
+      }
+    }
+    amqp_maybe_release_buffers(conn);
+  }
+
+  waitpid(child, &status, 0);
+  amqp_destroy_connection(conn);
+  close(peer);
+}
+
+/* Encodes a method frame on channel 1 */
+static size_t encode_method_frame(char *out, amqp_method_number_t id,
+                                  void *decoded)
+{
+  amqp_bytes_t encoded;
+  int len;
+
+  out[7] = (char)(id >> 24);
+  out[8] = (char)(id >> 16);
+  out[9] = (char)(id >> 8);
+  out[10] = (char)id;
+
+  encoded.bytes = out + 11;
+  encoded.len = 256;
+  len = amqp_encode_method(id, decoded, encoded);
+  if (len < 0) {
+    die("%s failed: %d", "amqp_encode_method", len);
+  }
+
+  encode_frame_header(out, AMQP_FRAME_METHOD, 1, len + 4);
+  return len + 12;
+}
+
+static amqp_frame_t decode_one(amqp_connection_state_t conn, char *wire,
+                               size_t len)
+{
+  amqp_frame_t frame;
+  amqp_bytes_t input;
+  int res;
+
+  input.bytes = wire;
+  input.len = len;
+  res = amqp_handle_input(conn, input, &frame);
+  match_int("bytes consumed", (int)len, res);
+  match_int("frame type", AMQP_FRAME_METHOD, frame.frame_type);
+  return frame;
+}
+
+static void test_lazy_method_decoding(void)
+{
+  char wire[300];
+  size_t len;
+  amqp_frame_t frame;
+  amqp_basic_deliver_t deliver;
+  amqp_basic_nack_t nack;
+  amqp_bytes_t bytes;
+  uint64_t tag;
+  amqp_boolean_t flag;
+  amqp_connection_state_t conn = amqp_new_connection();
+
+  deliver.consumer_tag = amqp_cstring_bytes("ctag");
+  deliver.delivery_tag = 0x0102030405060708ULL;
+  deliver.redelivered = 1;
+  deliver.exchange = amqp_cstring_bytes("exchange");
+  deliver.routing_key = amqp_cstring_bytes("key");
+  len = encode_method_frame(wire, AMQP_BASIC_DELIVER_METHOD, &deliver);
+
+  /* eager by default, with the raw arguments available too */
+  frame = decode_one(conn, wire, len);
+  if (frame.payload.method.decoded == NULL) {
+    die("%s was not decoded (%d)", "basic.deliver", 0);
+  }
+  amqp_basic_deliver_get_delivery_tag(frame.payload.encoded_method.raw, &tag);
+  if (tag != deliver.delivery_tag) {
+    die("%s has the wrong delivery tag (%d)", "basic.deliver", (int)tag);
+  }
+
+  amqp_set_lazy_method_decoding(conn, 1);
+  frame = decode_one(conn, wire, len);
+  match_int("method", AMQP_BASIC_DELIVER_METHOD, frame.payload.method.id);
+  if (frame.payload.method.decoded != NULL) {
+    die("%s was decoded in lazy mode (%d)", "basic.deliver", 0);
+  }
+
+  match_int("accessor", 0, amqp_basic_deliver_get_consumer_tag(
+              frame.payload.encoded_method.raw, &bytes));
+  match_int("consumer tag", 0, memcmp(bytes.bytes, "ctag", 4));
+  match_int("accessor", 0, amqp_basic_deliver_get_delivery_tag(
+              frame.payload.encoded_method.raw, &tag));
+  if (tag != deliver.delivery_tag) {
+    die("%s has the wrong delivery tag (%d)", "basic.deliver", (int)tag);
+  }
+  match_int("accessor", 0, amqp_basic_deliver_get_redelivered(
+              frame.payload.encoded_method.raw, &flag));
+  match_int("redelivered", 1, flag);
+  match_int("accessor", 0, amqp_basic_deliver_get_exchange(
+              frame.payload.encoded_method.raw, &bytes));
+  match_int("exchange", 0, memcmp(bytes.bytes, "exchange", 8));
+  match_int("accessor", 0, amqp_basic_deliver_get_routing_key(
+              frame.payload.encoded_method.raw, &bytes));
+  match_int("routing key length", 3, (int)bytes.len);
+  match_int("routing key", 0, memcmp(bytes.bytes, "key", 3));
+
+  /* a field past the end of truncated arguments is an error */
+  bytes = frame.payload.encoded_method.raw;
+  bytes.len -= 2;
+  match_int("truncated accessor", -1,
+            amqp_basic_deliver_get_routing_key(bytes, &bytes) < 0 ? -1 : 0);
+
+  /* bits packed into the same octet */
+  nack.delivery_tag = 42;
+  nack.multiple = 0;
+  nack.requeue = 1;
+  len = encode_method_frame(wire, AMQP_BASIC_NACK_METHOD, &nack);
+  frame = decode_one(conn, wire, len);
+  amqp_basic_nack_get_multiple(frame.payload.encoded_method.raw, &flag);
+  match_int("multiple", 0, flag);
+  amqp_basic_nack_get_requeue(frame.payload.encoded_method.raw, &flag);
+  match_int("requeue", 1, flag);
+
+  /* the whole method can be decoded into caller storage, too */
+  memset(&nack, 0, sizeof(nack));
+  match_int("decode into", 0, amqp_decode_method_into(
+              AMQP_BASIC_NACK_METHOD, frame.payload.encoded_method.raw, &nack));
+  match_int("delivery tag", 42, (int)nack.delivery_tag);
+  match_int("requeue", 1, nack.requeue);
+
+  /* methods without accessors are still decoded */
+  match_int("has accessors", 0,
+            amqp_method_has_field_accessors(AMQP_BASIC_CONSUME_OK_METHOD));
+  match_int("decode into", -1, amqp_decode_method_into(
+              AMQP_BASIC_CONSUME_OK_METHOD, frame.payload.encoded_method.raw,
+              &nack) < 0 ? -1 : 0);
+
+  amqp_destroy_connection(conn);
+}
+
+static void test_selective_properties(void)
+{
+  char buf[512];
+  amqp_bytes_t encoded;
+  amqp_bytes_t headers;
+  amqp_basic_properties_t props;
+  amqp_basic_properties_t *decoded;
+  amqp_table_entry_t entries[5];
+  amqp_table_entry_t nested_entry;
+  amqp_field_value_t array_values[2];
+  amqp_table_iterator_t iter;
+  amqp_table_entry_t entry;
+  amqp_field_value_t value;
+  amqp_pool_t pool;
+  int len, res, count;
+  static const char *keys[] = { "a", "b", "nested", "arr", "z" };
+
+  nested_entry.key = amqp_cstring_bytes("k");
+  nested_entry.value.kind = AMQP_FIELD_KIND_U8;
+  nested_entry.value.value.u8 = 7;
+  array_values[0].kind = AMQP_FIELD_KIND_I64;
+  array_values[0].value.i64 = -1;
+  array_values[1].kind = AMQP_FIELD_KIND_VOID;
+
+  entries[0].key = amqp_cstring_bytes(keys[0]);
+  entries[0].value.kind = AMQP_FIELD_KIND_I32;
+  entries[0].value.value.i32 = 1;
+  entries[1].key = amqp_cstring_bytes(keys[1]);
+  entries[1].value.kind = AMQP_FIELD_KIND_UTF8;
+  entries[1].value.value.bytes = amqp_cstring_bytes("xyz");
+  entries[2].key = amqp_cstring_bytes(keys[2]);
+  entries[2].value.kind = AMQP_FIELD_KIND_TABLE;
+  entries[2].value.value.table.num_entries = 1;
+  entries[2].value.value.table.entries = &nested_entry;
+  entries[3].key = amqp_cstring_bytes(keys[3]);
+  entries[3].value.kind = AMQP_FIELD_KIND_ARRAY;
+  entries[3].value.value.array.num_entries = 2;
+  entries[3].value.value.array.entries = array_values;
+  entries[4].key = amqp_cstring_bytes(keys[4]);
+  entries[4].value.kind = AMQP_FIELD_KIND_BOOLEAN;
+  entries[4].value.value.boolean = 1;
+
+  memset(&props, 0, sizeof(props));
+  props._flags = AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_HEADERS_FLAG |
+                 AMQP_BASIC_DELIVERY_MODE_FLAG | AMQP_BASIC_MESSAGE_ID_FLAG;
+  props.content_type = amqp_cstring_bytes("text/plain");
+  props.headers.num_entries = 5;
+  props.headers.entries = entries;
+  props.delivery_mode = 2;
+  props.message_id = amqp_cstring_bytes("id-1");
+
+  encoded.bytes = buf;
+  encoded.len = sizeof(buf);
+  len = amqp_encode_properties(AMQP_BASIC_CLASS, &props, encoded);
+  if (len < 0) {
+    die("%s failed: %d", "amqp_encode_properties", len);
+  }
+  encoded.len = len;
+
+  init_amqp_pool(&pool, 4096);
+
+  /* only the wanted fields are decoded; the headers are skipped over */
+  res = amqp_decode_properties_selective(
+          AMQP_BASIC_CLASS, &pool, encoded,
+          AMQP_BASIC_DELIVERY_MODE_FLAG | AMQP_BASIC_MESSAGE_ID_FLAG |
+          AMQP_BASIC_PRIORITY_FLAG, (void **)&decoded);
+  match_int("selective decode", 0, res);
+  match_int("decoded flags",
+            AMQP_BASIC_DELIVERY_MODE_FLAG | AMQP_BASIC_MESSAGE_ID_FLAG,
+            decoded->_flags);
+  match_int("delivery mode", 2, decoded->delivery_mode);
+  match_int("message id", 0, memcmp(decoded->message_id.bytes, "id-1", 4));
+
+  match_int("absent property", 0,
+            amqp_find_encoded_property(AMQP_BASIC_CLASS, encoded,
+                                       AMQP_BASIC_PRIORITY_FLAG, &headers));
+  match_int("headers present", 1,
+            amqp_find_encoded_property(AMQP_BASIC_CLASS, encoded,
+                                       AMQP_BASIC_HEADERS_FLAG, &headers));
+
+  /* iterate without decoding the table up front */
+  match_int("iterator init", 0, amqp_table_iterator_init(&iter, headers));
+  count = 0;
+  while ((res = amqp_table_iterator_next(&iter, &pool, &entry)) == 1) {
+    match_int("key length", (int)strlen(keys[count]), (int)entry.key.len);
+    match_int("key", 0, memcmp(entry.key.bytes, keys[count], entry.key.len));
+    match_int("kind", entries[count].value.kind, entry.value.kind);
+    count++;
+  }
+  match_int("iterator end", 0, res);
+  match_int("entry count", 5, count);
+
+  match_int("lookup", 1, amqp_table_lookup(headers, amqp_cstring_bytes("z"),
+                                           &pool, &value));
+  match_int("boolean", 1, value.value.boolean);
+  match_int("lookup", 1, amqp_table_lookup(headers, amqp_cstring_bytes("b"),
+                                           &pool, &value));
+  match_int("string", 0, memcmp(value.value.bytes.bytes, "xyz", 3));
+  match_int("lookup", 1, amqp_table_lookup(
+              headers, amqp_cstring_bytes("nested"), &pool, &value));
+  match_int("nested entries", 1, value.value.table.num_entries);
+  match_int("nested value", 7, value.value.table.entries[0].value.value.u8);
+  match_int("missing key", 0, amqp_table_lookup(
+              headers, amqp_cstring_bytes("y"), &pool, &value));
+
+  /* a table cut short is rejected rather than read past its end */
+  headers.len -= 1;
+  match_int("truncated table", -1,
+            amqp_table_lookup(headers, amqp_cstring_bytes("y"),
+                              &pool, &value) < 0 ? -1 : 0);
+
+  empty_amqp_pool(&pool);
+}
+
+static void test_consume_message(void)
+{
+  char wire[8 * 1024];
+  size_t wire_len = 0;
+  char *header;
+  amqp_bytes_t encoded;
+  amqp_basic_deliver_t deliver;
+  amqp_basic_cancel_t cancel;
+  amqp_basic_properties_t props;
+  amqp_envelope_t envelope;
+  amqp_rpc_reply_t reply;
+  int peer;
+  int len;
+  size_t i;
+  amqp_connection_state_t conn = connect_pair(&peer);
+
+  wire_len += encode_frame(wire, AMQP_FRAME_HEARTBEAT, 0, 0, 0);
+
+  deliver.consumer_tag = amqp_cstring_bytes("ctag");
+  deliver.delivery_tag = 99;
+  deliver.redelivered = 0;
+  deliver.exchange = amqp_cstring_bytes("exchange");
+  deliver.routing_key = amqp_cstring_bytes("key");
+  wire_len += encode_method_frame(wire + wire_len, AMQP_BASIC_DELIVER_METHOD,
+                                  &deliver);
+
+  /* another channel's frames may come between those of a message */
+  wire_len += encode_frame(wire + wire_len, AMQP_FRAME_BODY, 2, 5, 0xaa);
+
+  props._flags = AMQP_BASIC_CONTENT_TYPE_FLAG;
+  props.content_type = amqp_cstring_bytes("text/plain");
+  header = wire + wire_len;
+  encode_header_frame(header, 3000);
+  encoded.bytes = header + 19;
+  encoded.len = 256;
+  len = amqp_encode_properties(AMQP_BASIC_CLASS, &props, encoded);
+  if (len < 0) {
+    die("%s failed: %d", "amqp_encode_properties", len);
+  }
+  encode_frame_header(header, AMQP_FRAME_HEADER, 1, 12 + len);
+  wire_len += 20 + len;
+
+  wire_len += encode_body_frame(wire + wire_len, 1000, 0);
+  wire_len += encode_body_frame(wire + wire_len, 2000, 1);
+
+  cancel.consumer_tag = amqp_cstring_bytes("ctag");
+  cancel.nowait = 0;
+  wire_len += encode_method_frame(wire + wire_len, AMQP_BASIC_CANCEL_METHOD,
+                                  &cancel);
+  write_all(peer, wire, wire_len);
+
+  reply = amqp_consume_message(conn, &envelope);
+  match_int("reply type", AMQP_RESPONSE_NORMAL, reply.reply_type);
+  /* the envelope owns its memory, so reusing the buffers is fine */
+  memset(wire, 0, sizeof(wire));
+
+  match_int("channel", 1, envelope.channel);
+  match_int("delivery tag", 99, (int)envelope.delivery_tag);
+  match_int("consumer tag", 0, memcmp(envelope.consumer_tag.bytes, "ctag", 4));
+  match_int("routing key length", 3, (int)envelope.routing_key.len);
+  match_int("routing key", 0, memcmp(envelope.routing_key.bytes, "key", 3));
+  match_int("property flags", AMQP_BASIC_CONTENT_TYPE_FLAG,
+            envelope.properties._flags);
+  match_int("content type", 0,
+            memcmp(envelope.properties.content_type.bytes, "text/plain", 10));
+  match_int("body length", 3000, (int)envelope.body.len);
+  for (i = 0; i < 3000; i++) {
+    if (((unsigned char *)envelope.body.bytes)[i] != (i < 1000 ? 0 : 1)) {
+      die("%s at offset %d is wrong", "body", (int)i);
+    }
+  }
+  amqp_destroy_envelope(&envelope);
+
+  /* anything but a delivery is left for amqp_simple_wait_frame */
+  reply = amqp_consume_message(conn, &envelope);
+  match_int("reply type", AMQP_RESPONSE_LIBRARY_EXCEPTION, reply.reply_type);
+  expect_frame(conn, AMQP_FRAME_BODY, 2);
+  reply = amqp_consume_message(conn, &envelope);
+  match_int("reply type", AMQP_RESPONSE_LIBRARY_EXCEPTION, reply.reply_type);
+  match_int("amqp_frames_enqueued", 1, amqp_frames_enqueued(conn) != 0);
+  expect_frame(conn, AMQP_FRAME_METHOD, 1);
+
+  amqp_destroy_connection(conn);
+  close(peer);
+}
+
+/* Data a socket has read ahead is used without waiting for more */
+static void test_wait_socket_buffered(void)
+{
+  amqp_connection_state_t conn = amqp_new_connection();
+  int peer = attach_buffering_pair(conn, 64);
+  char wire[96];
+  amqp_frame_t frame;
+  int i;
+
+  /* two frames of 48 bytes, of which the first read gets 64 */
+  encode_body_frame(wire, 40, 1);
+  encode_body_frame(wire + 48, 40, 2);
+  write_all(peer, wire, sizeof(wire));
+
+  for (i = 1; i <= 2; i++) {
+    match_int("amqp_try_wait_frame", 0, amqp_try_wait_frame(conn, &frame));
+    match_int("frame type", AMQP_FRAME_BODY, frame.frame_type);
+    match_int("body", i,
+              ((unsigned char *)frame.payload.body_fragment.bytes)[0]);
+  }
+
+  amqp_destroy_connection(conn);
+  close(peer);
+}
+
+static void test_wait_frame_timeout(void)
+{
+  char wire[64];
+  size_t len;
+  struct timeval timeout;
+  struct timeval start, end;
+  amqp_frame_t frame;
+  long elapsed_ms;
+  int peer;
+  int res;
+  amqp_connection_state_t conn = connect_pair(&peer);
+
+  /* nothing to read: returns straight away, without a frame */
+  res = amqp_try_wait_frame(conn, &frame);
+  match_int("amqp_try_wait_frame", 0, res);
+  match_int("frame type", 0, frame.frame_type);
+
+  timeout.tv_sec = 0;
+  timeout.tv_usec = 50000;
+  gettimeofday(&start, NULL);
+  res = amqp_simple_wait_frame_timeout(conn, &frame, &timeout);
+  gettimeofday(&end, NULL);
+  match_int("amqp_simple_wait_frame_timeout", 0, res);
+  match_int("frame type", 0, frame.frame_type);
+  elapsed_ms = (end.tv_sec - start.tv_sec) * 1000
+               + (end.tv_usec - start.tv_usec) / 1000;
+  if (elapsed_ms < 45 || elapsed_ms > 5000) {
+    die("%s took %d ms", "timed out wait", (int)elapsed_ms);
+  }
+
+  /* half a frame is kept until the rest of it arrives */
+  len = encode_body_frame(wire, 20, 7);
+  write_all(peer, wire, 10);
+  res = amqp_simple_wait_frame_timeout(conn, &frame, &timeout);
+  match_int("amqp_simple_wait_frame_timeout", 0, res);
+  match_int("frame type", 0, frame.frame_type);
+  res = amqp_try_wait_frame(conn, &frame);
+  match_int("frame type", 0, frame.frame_type);
+
+  write_all(peer, wire + 10, len - 10);
+  res = amqp_simple_wait_frame_timeout(conn, &frame, &timeout);
+  match_int("amqp_simple_wait_frame_timeout", 0, res);
+  match_int("frame type", AMQP_FRAME_BODY, frame.frame_type);
+  match_int("body length", 20, (int)frame.payload.body_fragment.len);
+  match_int("body", 7, ((unsigned char *)frame.payload.body_fragment.bytes)[19]);
+
+  /* a closed connection is still reported as an error */
+  close(peer);
+  res = amqp_simple_wait_frame_timeout(conn, &frame, &timeout);
+  match_int("closed connection", -1, res < 0 ? -1 : 0);
+
+  amqp_destroy_connection(conn);
+}
+
+/* tracks how much memory a connection holds at its peak */
+typedef struct peak_allocator_t_ {
+  amqp_allocator_t allocator;
+  size_t outstanding;
+  size_t peak;
+} peak_allocator_t;
+
+static void *peak_alloc(void *context, size_t size, amqp_memory_tag_t tag)
+{
+  peak_allocator_t *counter = context;
+  (void)tag;
+  counter->outstanding += size;
+  if (counter->outstanding > counter->peak) {
+    counter->peak = counter->outstanding;
+  }
+  return malloc(size);
+}
+
+static void peak_free(void *context, void *ptr, size_t size,
+                      amqp_memory_tag_t tag)
+{
+  peak_allocator_t *counter = context;
+  (void)tag;
+  counter->outstanding -= size;
+  free(ptr);
+}
+
+static void init_peak_allocator(peak_allocator_t *counter)
+{
+  memset(counter, 0, sizeof(*counter));
+  counter->allocator.alloc = peak_alloc;
+  counter->allocator.free = peak_free;
+  counter->allocator.context = counter;
+}
+
+/* Channel 2's frame is held on to for the whole test, as is a queued
+   frame on channel 3, while channel 1 streams many frames and releases
+   its buffers after each one. Memory has to stay bounded, and the
+   frames held must not be overwritten. */
+static void test_release_on_channel(void)
+{
+  peak_allocator_t counter;
+  char *wire = malloc(RELEASE_FRAME_COUNT * 1608 + 4096);
+  size_t *frame_end = malloc(RELEASE_FRAME_COUNT * sizeof(size_t));
+  size_t wire_len = 0;
+  size_t written = 0;
+  amqp_frame_t held, queued;
+  amqp_connection_state_t conn;
+  int peer;
+  int i;
+  int res;
+
+  init_peak_allocator(&counter);
+  amqp_set_default_allocator(&counter.allocator);
+  conn = connect_pair(&peer);
+
+  wire_len += encode_frame(wire + wire_len, AMQP_FRAME_BODY, 2, 1000, 0xEE);
+  wire_len += encode_frame(wire + wire_len, AMQP_FRAME_BODY, 3, 500, 0xDD);
+  for (i = 0; i < RELEASE_FRAME_COUNT; i++) {
+    wire_len += encode_body_frame(wire + wire_len, body_len(i),
+                                  (unsigned char)i);
+    frame_end[i] = wire_len;
+  }
+
+  write_all(peer, wire, frame_end[0]);
+  written = frame_end[0];
+  res = amqp_simple_wait_frame(conn, &held);
+  match_int("amqp_simple_wait_frame", 0, res);
+  match_int("held channel", 2, held.channel);
+
+  for (i = 0; i < RELEASE_FRAME_COUNT; i++) {
+    amqp_frame_t frame;
+    size_t j;
+
+    if (written < frame_end[i]) {
+      size_t chunk = frame_end[i] + 30011 - written;
+      if (chunk > wire_len - written) {
+        chunk = wire_len - written;
+      }
+      write_all(peer, wire + written, chunk);
+      written += chunk;
+    }
+
+    /* the first time round, channel 3's frame is queued on the way */
+    res = amqp_simple_wait_frame_on_channel(conn, 1, &frame);
+    if (res < 0) {
+      die("%s failed: %d", "amqp_simple_wait_frame_on_channel", res);
+    }
+    match_int("body length", (int)body_len(i),
+              (int)frame.payload.body_fragment.len);
+    for (j = 0; j < frame.payload.body_fragment.len; j++) {
+      if (((unsigned char *)frame.payload.body_fragment.bytes)[j]
+          != (unsigned char)i) {
+        die("%s %d is corrupt", "body", i);
+      }
+    }
+
+    amqp_maybe_release_buffers_on_channel(conn, 1);
+    /* nothing happens while a frame on the channel is queued */
+    amqp_maybe_release_buffers_on_channel(conn, 3);
+  }
+
+  if (counter.peak > 8 * 1024 * 1024) {
+    die("%s peaked at %d bytes", "connection memory", (int)counter.peak);
+  }
+  match_int("held body", 0xEE,
+            ((unsigned char *)held.payload.body_fragment.bytes)[999]);
+
+  res = amqp_simple_wait_frame(conn, &queued);
+  match_int("amqp_simple_wait_frame", 0, res);
+  match_int("queued channel", 3, queued.channel);
+  match_int("queued body", 0xDD,
+            ((unsigned char *)queued.payload.body_fragment.bytes)[499]);
+
+  amqp_release_buffers(conn);
+  amqp_destroy_connection(conn);
+  amqp_set_default_allocator(NULL);
+  match_int("outstanding bytes", 0, (int)counter.outstanding);
+  close(peer);
+  free(frame_end);
+  free(wire);
+}
+
+/* Frames detached from channel 1 have to survive the buffers being
+   released and reused, and even the connection being destroyed */
+/* Channels that have been released keep no pools of their own */
+static void test_many_channels(void)
+{
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_memory_stats_t stats;
+  char wire[32];
+  int channel;
+
+  for (channel = 1; channel <= 200; channel++) {
+    amqp_frame_t frame;
+    amqp_bytes_t input;
+
+    input.bytes = wire;
+    input.len = encode_frame(wire, AMQP_FRAME_BODY, channel, 12, 0x11);
+    match_int("bytes consumed", (int)input.len,
+              amqp_handle_input(conn, input, &frame));
+    match_int("frame type", AMQP_FRAME_BODY, frame.frame_type);
+  }
+  amqp_get_memory_stats(conn, &stats);
+  match_int("channel pools", 200, stats.channel_pool_count);
+
+  amqp_maybe_release_buffers(conn);
+  amqp_get_memory_stats(conn, &stats);
+  match_int("channel pools", 0, stats.channel_pool_count);
+  if (stats.channel_pools.held_bytes > 8192) {
+    die("%s pools hold %d bytes", "released",
+        (int)stats.channel_pools.held_bytes);
+  }
+
+  amqp_destroy_connection(conn);
+}
+
+static void test_detach_buffers(void)
+{
+  peak_allocator_t counter;
+  static char wire[DETACH_FRAME_COUNT * 2100];
+  amqp_frame_t frames[DETACH_FRAME_COUNT];
+  amqp_detached_buffers_t *detached[2];
+  amqp_connection_state_t conn;
+  size_t wire_len = 0;
+  int peer;
+  int round;
+  int i;
+
+  init_peak_allocator(&counter);
+  amqp_set_default_allocator(&counter.allocator);
+  conn = connect_pair(&peer);
+
+  for (round = 0; round < 2; round++) {
+    wire_len = 0;
+    for (i = 0; i < DETACH_FRAME_COUNT; i++) {
+      wire_len += encode_body_frame(wire + wire_len, 2000,
+                                    (unsigned char)(round * 16 + i));
+    }
+    write_all(peer, wire, wire_len);
+
+    for (i = 0; i < DETACH_FRAME_COUNT; i++) {
+      int res = amqp_simple_wait_frame(conn, &frames[i]);
+      match_int("amqp_simple_wait_frame", 0, res);
+    }
+    detached[round] = amqp_detach_buffers_on_channel(conn, 1);
+    if (detached[round] == NULL) {
+      die("%s failed: %d", "amqp_detach_buffers_on_channel", round);
+    }
+    amqp_release_buffers(conn);
+
+    /* plenty of traffic over the released buffers */
+    for (i = 0; i < DETACH_FRAME_COUNT * 8; i++) {
+      amqp_frame_t frame;
+      encode_body_frame(wire, 2000, 0x55);
+      write_all(peer, wire, 2008);
+      match_int("amqp_simple_wait_frame", 0,
+                amqp_simple_wait_frame(conn, &frame));
+      amqp_release_buffers(conn);
+    }
+
+    for (i = 0; i < DETACH_FRAME_COUNT; i++) {
+      unsigned char *body = frames[i].payload.body_fragment.bytes;
+      match_int("detached body", round * 16 + i, body[0]);
+      match_int("detached body", round * 16 + i, body[1999]);
+    }
+  }
+
+  amqp_free_detached_buffers(detached[0]);
+  amqp_destroy_connection(conn);
+  /* the second set outlives the connection */
+  match_int("detached body", 16, ((unsigned char *)
+            frames[0].payload.body_fragment.bytes)[0]);
+  amqp_free_detached_buffers(detached[1]);
+  amqp_set_default_allocator(NULL);
+  match_int("outstanding bytes", 0, (int)counter.outstanding);
+  close(peer);
+}
+
+/* Shared body fragments, whether decoded in place or reassembled, have
+   to outlive the connection's buffers and the connection itself */
+static void test_share_body_fragments(void)
+{
+  peak_allocator_t counter;
+  static char wire[SHARE_FRAME_COUNT * 2100];
+  amqp_shared_buffer_t *shared[SHARE_FRAME_COUNT];
+  amqp_bytes_t bodies[SHARE_FRAME_COUNT];
+  amqp_connection_state_t conn;
+  size_t wire_len = 0;
+  int peer;
+  int i;
+
+  init_peak_allocator(&counter);
+  amqp_set_default_allocator(&counter.allocator);
+  conn = connect_pair(&peer);
+
+  for (i = 0; i < SHARE_FRAME_COUNT; i++) {
+    wire_len += encode_body_frame(wire + wire_len, 2000, (unsigned char)i);
+  }
+
+  for (i = 0; i < SHARE_FRAME_COUNT; i++) {
+    amqp_frame_t frame;
+
+    /* writing a frame and a half at a time splits every other frame
+       over two reads */
+    if (i % 2 == 0) {
+      size_t offset = (size_t)i * 2008;
+      size_t chunk = i + 2 < SHARE_FRAME_COUNT ? 3012 : wire_len - offset;
+      write_all(peer, wire + offset, chunk);
+    } else if (i + 1 < SHARE_FRAME_COUNT) {
+      write_all(peer, wire + (size_t)i * 2008 + 1004, 1004);
+    }
+
+    match_int("amqp_simple_wait_frame", 0,
+              amqp_simple_wait_frame(conn, &frame));
+    shared[i] = amqp_share_body_fragment(conn, &frame, &bodies[i]);
+    if (shared[i] == NULL) {
+      die("%s failed: %d", "amqp_share_body_fragment", i);
+    }
+    if (i % 3 == 0) {
+      /* a second reference, as for a second worker */
+      amqp_shared_buffer_retain(shared[i]);
+      amqp_shared_buffer_release(shared[i]);
+    }
+    amqp_release_buffers(conn);
+  }
+
+  for (i = 0; i < SHARE_FRAME_COUNT; i++) {
+    amqp_frame_t frame;
+    encode_body_frame(wire, 2000, 0x55);
+    write_all(peer, wire, 2008);
+    match_int("amqp_simple_wait_frame", 0,
+              amqp_simple_wait_frame(conn, &frame));
+    amqp_release_buffers(conn);
+  }
+  amqp_destroy_connection(conn);
+
+  for (i = 0; i < SHARE_FRAME_COUNT; i++) {
+    match_int("shared body length", 2000, (int)bodies[i].len);
+    match_int("shared body", i, ((unsigned char *)bodies[i].bytes)[0]);
+    match_int("shared body", i, ((unsigned char *)bodies[i].bytes)[1999]);
+    amqp_shared_buffer_release(shared[i]);
+  }
+
+  amqp_set_default_allocator(NULL);
+  match_int("outstanding bytes", 0, (int)counter.outstanding);
+  close(peer);
+}
+
+static void test_memory_stats(void)
+{
+  static char wire[4 * 2100];
+  amqp_memory_stats_t stats;
+  amqp_pool_stats_t channel_stats;
+  amqp_connection_state_t conn;
+  size_t wire_len = 0;
+  int peer;
+  int i;
+
+  conn = connect_pair(&peer);
+  amqp_set_memory_debug(conn, 1);
+
+  wire_len += encode_header_frame(wire, 3 * 2000);
+  for (i = 0; i < 3; i++) {
+    wire_len += encode_body_frame(wire + wire_len, 2000, (unsigned char)i);
+  }
+  wire_len += encode_frame(wire + wire_len, AMQP_FRAME_HEARTBEAT, 0, 0, 0);
+  write_all(peer, wire, wire_len);
+
+  for (i = 0; i < 5; i++) {
+    amqp_frame_t frame;
+    match_int("amqp_simple_wait_frame", 0,
+              amqp_simple_wait_frame(conn, &frame));
+  }
+
+  amqp_get_memory_stats(conn, &stats);
+  match_int("header frames", 1, (int)stats.header_frames.frames);
+  match_int("header frame bytes", 22, (int)stats.header_frames.frame_bytes);
+  match_int("body frames", 3, (int)stats.body_frames.frames);
+  match_int("body frame bytes", 3 * 2008, (int)stats.body_frames.frame_bytes);
+  match_int("heartbeat frames", 1, (int)stats.heartbeat_frames.frames);
+  match_int("method frames", 0, (int)stats.method_frames.frames);
+  if (stats.header_frames.decoded_bytes == 0 ||
+      stats.channel_pools.used_bytes < stats.header_frames.decoded_bytes ||
+      stats.sock_inbound_bytes == 0) {
+    die("%s: %d", "unexpected memory stats", 0);
+  }
+
+  amqp_get_channel_memory_stats(conn, 1, &channel_stats);
+  match_int("channel 1 allocs", (int)channel_stats.total_allocs,
+            (int)stats.channel_pools.total_allocs);
+  amqp_get_channel_memory_stats(conn, 2, &channel_stats);
+  match_int("channel 2 allocs", 0, (int)channel_stats.total_allocs);
+
+  amqp_release_buffers(conn);
+  amqp_get_memory_stats(conn, &stats);
+  match_int("used bytes", 0, (int)stats.channel_pools.used_bytes);
+  if (stats.channel_pools.peak_used_bytes == 0) {
+    die("%s: %d", "peak not kept after release", 0);
+  }
+
+  amqp_destroy_connection(conn);
+  close(peer);
+}
+
+/* A lazily buffered connection starts out holding next to nothing,
+   has to cope with frames bigger than its buffers, and gives its buffers
+   back once idle */
+static void test_lazy_buffers(void)
+{
+  peak_allocator_t counter;
+  static char wire[8 * 2100];
+  char big_value[6000];
+  amqp_connection_options_t options;
+  amqp_memory_stats_t stats;
+  amqp_table_entry_t entry;
+  amqp_exchange_declare_t declare;
+  amqp_connection_state_t conn;
+  struct timeval timeout;
+  amqp_frame_t frame;
+  size_t wire_len = 0;
+  size_t created;
+  int peer;
+  int i;
+
+  init_peak_allocator(&counter);
+
+  amqp_default_connection_options(&options);
+  options.allocator = &counter.allocator;
+  options.lazy_buffers = 1;
+  options.idle_release_ms = 50;
+  conn = amqp_new_connection_with_options(&options);
+  created = counter.outstanding;
+  peer = attach_pair(conn);
+  if (created > 8192) {
+    die("%s: %d", "lazy connection too big", (int)created);
+  }
+
+  /* bigger than the starting socket buffer and pool pages */
+  for (i = 0; i < 8; i++) {
+    wire_len += encode_body_frame(wire + wire_len, 2000, (unsigned char)i);
+  }
+  write_all(peer, wire, wire_len);
+  for (i = 0; i < 8; i++) {
+    match_int("amqp_simple_wait_frame", 0,
+              amqp_simple_wait_frame(conn, &frame));
+    match_int("body", i, ((unsigned char *)
+                          frame.payload.body_fragment.bytes)[1999]);
+  }
+
+  /* a method bigger than the starting outbound buffer */
+  memset(big_value, 'x', sizeof(big_value));
+  entry.key = amqp_cstring_bytes("big");
+  entry.value.kind = AMQP_FIELD_KIND_BYTES;
+  entry.value.value.bytes.bytes = big_value;
+  entry.value.value.bytes.len = sizeof(big_value);
+  memset(&declare, 0, sizeof(declare));
+  declare.exchange = amqp_cstring_bytes("exchange");
+  declare.type = amqp_cstring_bytes("direct");
+  declare.arguments.num_entries = 1;
+  declare.arguments.entries = &entry;
+  match_int("amqp_send_method", 0,
+            amqp_send_method(conn, 1, AMQP_EXCHANGE_DECLARE_METHOD, &declare));
+
+  amqp_release_buffers(conn);
+  amqp_get_memory_stats(conn, &stats);
+  if (stats.sock_inbound_bytes == 0 || stats.outbound_bytes < 6000) {
+    die("%s: %d", "buffers missing", 0);
+  }
+
+  /* nothing arrives for longer than the idle period */
+  timeout.tv_sec = 0;
+  timeout.tv_usec = 150000;
+  match_int("amqp_simple_wait_frame_timeout", 0,
+            amqp_simple_wait_frame_timeout(conn, &frame, &timeout));
+  match_int("frame type", 0, frame.frame_type);
+  amqp_get_memory_stats(conn, &stats);
+  match_int("socket buffer", 0, (int)stats.sock_inbound_bytes);
+  match_int("outbound buffer", 0, (int)stats.outbound_bytes);
+  match_int("pool bytes", 0, (int)stats.channel_pools.held_bytes);
+  if (counter.outstanding > created + 1024) {
+    die("%s: %d", "idle connection too big", (int)counter.outstanding);
+  }
+
+  /* and it carries on as before */
+  encode_body_frame(wire, 2000, 0x55);
+  write_all(peer, wire, 2008);
+  match_int("amqp_simple_wait_frame", 0,
+            amqp_simple_wait_frame(conn, &frame));
+  match_int("body", 0x55, ((unsigned char *)
+                           frame.payload.body_fragment.bytes)[0]);
+
+  amqp_destroy_connection(conn);
+  match_int("outstanding bytes", 0, (int)counter.outstanding);
+  close(peer);
+}
+
+/* Nothing may come from the heap once the connection is set up in
+   memory of its own, and running out of that memory has to be an
+   ordinary error */
+/* With idle release on, a frame the socket has read ahead is not held
+   up until the idle period ends */
+static void test_idle_wait_socket_buffered(void)
+{
+  static char wire[6008 + 16];
+  amqp_connection_options_t options;
+  amqp_connection_state_t conn;
+  struct timeval start;
+  struct timeval end;
+  amqp_frame_t frame;
+  size_t wire_len;
+  int peer;
+
+  amqp_default_connection_options(&options);
+  options.lazy_buffers = 1;
+  options.idle_release_ms = 2000;
+  conn = amqp_new_connection_with_options(&options);
+  /* as an SSL socket hands out a 16 KiB record */
+  peer = attach_buffering_pair(conn, 4096);
+
+  /* bigger than the lazy socket buffer, then one that fits */
+  wire_len = encode_body_frame(wire, 6000, 1);
+  wire_len += encode_body_frame(wire + wire_len, 8, 2);
+  write_all(peer, wire, wire_len);
+
+  gettimeofday(&start, NULL);
+  match_int("amqp_simple_wait_frame", 0, amqp_simple_wait_frame(conn, &frame));
+  match_int("body length", 6000, (int)frame.payload.body_fragment.len);
+  match_int("amqp_simple_wait_frame", 0, amqp_simple_wait_frame(conn, &frame));
+  match_int("body", 2, ((unsigned char *)frame.payload.body_fragment.bytes)[0]);
+  gettimeofday(&end, NULL);
+  if ((end.tv_sec - start.tv_sec) * 1000
+      + (end.tv_usec - start.tv_usec) / 1000 >= 1000) {
+    die("%s: %d", "buffered frame waited for idle release", 0);
+  }
+
+  amqp_destroy_connection(conn);
+  close(peer);
+}
+
+static void test_caller_memory(void)
+{
+  static char memory[1024 * 1024];
+  static char wire[64 * 2100];
+  peak_allocator_t counter;
+  amqp_connection_options_t options;
+  amqp_connection_state_t conn;
+  amqp_basic_qos_t qos;
+  amqp_frame_t frame;
+  size_t wire_len = 0;
+  int peer;
+  int round;
+  int i;
+
+  init_peak_allocator(&counter);
+  amqp_set_default_allocator(&counter.allocator);
+
+  conn = amqp_connection_init_in(memory, sizeof(memory), NULL);
+  peer = attach_pair(conn);
+  for (i = 0; i < 64; i++) {
+    wire_len += encode_body_frame(wire + wire_len, body_len(i),
+                                  (unsigned char)i);
+  }
+  memset(&qos, 0, sizeof(qos));
+  qos.prefetch_count = 10;
+
+  for (round = 0; round < 20; round++) {
+    write_all(peer, wire, wire_len);
+    for (i = 0; i < 64; i++) {
+      match_int("amqp_simple_wait_frame", 0,
+                amqp_simple_wait_frame(conn, &frame));
+      match_int("body", i, ((unsigned char *)
+                            frame.payload.body_fragment.bytes)[0]);
+    }
+    match_int("amqp_send_method", 0,
+              amqp_send_method(conn, 1, AMQP_BASIC_QOS_METHOD, &qos));
+    amqp_release_buffers(conn);
+  }
+  match_int("heap allocations", 0, (int)counter.peak);
+  amqp_destroy_connection(conn);
+  amqp_set_default_allocator(NULL);
+  close(peer);
+
+  /* too small to set up at all */
+  if (amqp_connection_init_in(memory, 64, NULL) != NULL) {
+    die("%s: %d", "amqp_connection_init_in succeeded in", 64);
+  }
+
+  /* room for the lazy buffers, but not for a 20000 byte frame */
+  amqp_default_connection_options(&options);
+  options.lazy_buffers = 1;
+  conn = amqp_connection_init_in(memory, 20000, &options);
+  if (conn == NULL) {
+    die("%s failed: %d", "amqp_connection_init_in", 20000);
+  }
+  peer = attach_pair(conn);
+  wire_len = encode_body_frame(wire, 100, 1);
+  write_all(peer, wire, wire_len);
+  match_int("amqp_simple_wait_frame", 0,
+            amqp_simple_wait_frame(conn, &frame));
+  amqp_release_buffers(conn);
+
+  wire_len = encode_body_frame(wire, 20000 - 8, 2);
+  write_all(peer, wire, wire_len);
+  if (amqp_simple_wait_frame(conn, &frame) >= 0) {
+    die("%s: %d", "oversized frame decoded", 0);
+  }
+  amqp_destroy_connection(conn);
+  close(peer);
+}
+
+/* A delivery on channel 1 with two 3000 byte body frames filled with
+   fill */
+static size_t encode_delivery(char *out, int tag, unsigned char fill)
+{
+  amqp_basic_deliver_t deliver;
+  size_t len;
+
+  deliver.consumer_tag = amqp_cstring_bytes("ctag");
+  deliver.delivery_tag = tag;
+  deliver.redelivered = 0;
+  deliver.exchange = amqp_cstring_bytes("exchange");
+  deliver.routing_key = amqp_cstring_bytes("key");
+  len = encode_method_frame(out, AMQP_BASIC_DELIVER_METHOD, &deliver);
+  len += encode_header_frame(out + len, 6000);
+  len += encode_body_frame(out + len, 3000, fill);
+  len += encode_body_frame(out + len, 3000, fill);
+  return len;
+}
+
+/* Nothing is released by hand here, yet memory has to stay bounded,
+   and frames have to stay valid until their message is done */
+static void test_release_policy(void)
+{
+  peak_allocator_t counter;
+  static char wire[10 * 6200];
+  amqp_connection_state_t conn;
+  size_t start;
+  int policy;
+  int peer;
+
+  init_peak_allocator(&counter);
+  amqp_set_default_allocator(&counter.allocator);
+
+  for (policy = AMQP_RELEASE_EACH_MESSAGE;
+       policy <= AMQP_RELEASE_ABOVE_POOL_USAGE; policy++) {
+    int round;
+
+    conn = connect_pair(&peer);
+    amqp_set_release_policy(conn, (amqp_release_policy_enum)policy,
+                            64 * 1024);
+    start = counter.outstanding;
+    counter.peak = start;
+
+    for (round = 0; round < 300; round++) {
+      size_t wire_len = 0;
+      int i;
+
+      for (i = 0; i < 10; i++) {
+        wire_len += encode_delivery(wire + wire_len, round * 10 + i,
+                                    (unsigned char)i);
+      }
+      write_all(peer, wire, wire_len);
+
+      for (i = 0; i < 10; i++) {
+        amqp_frame_t method, header, body[2];
+        int j;
+
+        if (policy == AMQP_RELEASE_EACH_MESSAGE) {
+          amqp_envelope_t envelope;
+          amqp_rpc_reply_t reply = amqp_consume_message(conn, &envelope);
+          match_int("reply type", AMQP_RESPONSE_NORMAL, reply.reply_type);
+          match_int("delivery tag", round * 10 + i,
+                    (int)envelope.delivery_tag);
+          match_int("body", i, ((unsigned char *)envelope.body.bytes)[5999]);
+          amqp_destroy_envelope(&envelope);
+          continue;
+        }
+
+        match_int("amqp_simple_wait_frame", 0,
+                  amqp_simple_wait_frame(conn, &method));
+        match_int("amqp_simple_wait_frame", 0,
+                  amqp_simple_wait_frame(conn, &header));
+        for (j = 0; j < 2; j++) {
+          match_int("amqp_simple_wait_frame", 0,
+                    amqp_simple_wait_frame(conn, &body[j]));
+        }
+        /* the whole message is still there */
+        match_int("delivery tag", round * 10 + i, (int)
+                  ((amqp_basic_deliver_t *)
+                   method.payload.method.decoded)->delivery_tag);
+        match_int("body size", 6000,
+                  (int)header.payload.properties.body_size);
+        for (j = 0; j < 2; j++) {
+          match_int("body", i, ((unsigned char *)
+                                body[j].payload.body_fragment.bytes)[0]);
+        }
+      }
+    }
+
+    /* without a policy every socket buffer would stay pinned, about
+       19 MB of them */
+    if (counter.peak > start + 1024 * 1024) {
+      die("%s: %d", "memory grew to", (int)counter.peak);
+    }
+
+    /* a delivery on channel 2 arriving between the body frames of one
+       on channel 1 has to be kept whole while that body is read */
+    for (round = 0; round < 3; round++) {
+      static char other[300];
+      amqp_basic_deliver_t deliver;
+      amqp_basic_deliver_t *decoded;
+      amqp_envelope_t envelope;
+      amqp_rpc_reply_t reply;
+      amqp_frame_t frame;
+      size_t wire_len = encode_delivery(wire, round, 7);
+      size_t other_len;
+
+      deliver.consumer_tag = amqp_cstring_bytes("consumer-tag-xyz");
+      deliver.delivery_tag = 1000 + round;
+      deliver.redelivered = 0;
+      deliver.exchange = amqp_cstring_bytes("exchange");
+      deliver.routing_key = amqp_cstring_bytes("key");
+      other_len = encode_method_frame(other, AMQP_BASIC_DELIVER_METHOD,
+                                      &deliver);
+      other[2] = 2;
+      write_all(peer, wire, wire_len - 3008);
+      write_all(peer, other, other_len);
+      write_all(peer, wire + wire_len - 3008, 3008);
+
+      reply = amqp_consume_message(conn, &envelope);
+      match_int("reply type", AMQP_RESPONSE_NORMAL, reply.reply_type);
+      match_int("delivery tag", round, (int)envelope.delivery_tag);
+      match_int("body", 7, ((unsigned char *)envelope.body.bytes)[5999]);
+      amqp_destroy_envelope(&envelope);
+
+      match_int("amqp_simple_wait_frame", 0,
+                amqp_simple_wait_frame(conn, &frame));
+      match_int("channel", 2, frame.channel);
+      decoded = frame.payload.method.decoded;
+      match_int("delivery tag", 1000 + round, (int)decoded->delivery_tag);
+      match_int("consumer tag length", 16, (int)decoded->consumer_tag.len);
+      match_int("consumer tag", 0, memcmp(decoded->consumer_tag.bytes,
+                                          "consumer-tag-xyz", 16));
+    }
+    amqp_destroy_connection(conn);
+    close(peer);
+  }
+
+  amqp_set_default_allocator(NULL);
+  match_int("outstanding bytes", 0, (int)counter.outstanding);
+}
+
+/* Over a socket that keeps writes apart, a whole message has to arrive
+   as one, method, header and body frames in order */
+static void test_publish_single_write(void)
+{
+  static unsigned char received[120000];
+  static char body_data[100000];
+  amqp_basic_properties_t props;
+  amqp_connection_state_t conn;
+  size_t sizes[] = { 200, sizeof(body_data) };
+  size_t s;
+  int peer;
+
+  conn = connect_packet_pair(&peer);
+  memset(body_data, 0x5a, sizeof(body_data));
+  props._flags = AMQP_BASIC_CONTENT_TYPE_FLAG;
+  props.content_type = amqp_cstring_bytes("text/plain");
+
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    amqp_bytes_t body;
+    size_t offset = 0;
+    size_t body_seen = 0;
+    ssize_t len;
+    int frames = 0;
+
+    body.bytes = body_data;
+    body.len = sizes[s];
+    match_int("amqp_basic_publish", 0,
+              amqp_basic_publish(conn, 1, amqp_cstring_bytes("exchange"),
+                                 amqp_cstring_bytes("key"), 0, 0, &props,
+                                 body));
+
+    len = recv(peer, received, sizeof(received), 0);
+    while (offset < (size_t)len) {
+      size_t payload = ((size_t)received[offset + 3] << 24)
+                       | ((size_t)received[offset + 4] << 16)
+                       | ((size_t)received[offset + 5] << 8)
+                       | received[offset + 6];
+      int expected_type = frames == 0 ? AMQP_FRAME_METHOD
+                          : frames == 1 ? AMQP_FRAME_HEADER : AMQP_FRAME_BODY;
+
+      match_int("frame type", expected_type, received[offset]);
+      match_int("channel", 1, received[offset + 2]);
+      match_int("frame end", AMQP_FRAME_END, received[offset + 7 + payload]);
+      if (expected_type == AMQP_FRAME_BODY) {
+        match_int("body", 0x5a, received[offset + 7]);
+        body_seen += payload;
+      }
+      offset += payload + 8;
+      frames++;
+    }
+    match_int("bytes in the write", (int)len, (int)offset);
+    match_int("body bytes in the write", (int)sizes[s], (int)body_seen);
+  }
+
+  amqp_destroy_connection(conn);
+  close(peer);
+}
+
+/* Counts the whole frames in a record, checking each one's end */
+static int count_frames(const unsigned char *data, size_t len)
+{
+  size_t offset = 0;
+  int frames = 0;
+
+  while (offset < len) {
+    size_t payload = ((size_t)data[offset + 3] << 24)
+                     | ((size_t)data[offset + 4] << 16)
+                     | ((size_t)data[offset + 5] << 8)
+                     | data[offset + 6];
+    match_int("frame end", AMQP_FRAME_END, data[offset + 7 + payload]);
+    offset += payload + 8;
+    frames++;
+  }
+  match_int("bytes in the record", (int)len, (int)offset);
+  return frames;
+}
+
+/* A gathered write to a closed peer fails, rather than raising SIGPIPE */
+static void test_publish_to_closed_peer(void)
+{
+  static char body_data[4096];
+  amqp_connection_state_t conn;
+  amqp_bytes_t body;
+  int peer;
+
+  conn = connect_pair(&peer);
+  close(peer);
+  memset(body_data, 0x5a, sizeof(body_data));
+  body.bytes = body_data;
+  body.len = sizeof(body_data);
+
+  if (amqp_basic_publish(conn, 1, amqp_cstring_bytes("exchange"),
+                         amqp_cstring_bytes("key"), 0, 0, NULL, body) >= 0) {
+    die("%s succeeded: %d", "publish to a closed peer", 0);
+  }
+  amqp_destroy_connection(conn);
+}
+
+static void test_output_buffering(void)
+{
+  static unsigned char received[120000];
+  static char body_data[40000];
+  amqp_connection_state_t conn;
+  amqp_bytes_t small;
+  amqp_bytes_t large;
+  amqp_frame_t frame;
+  struct timeval timeout;
+  ssize_t len;
+  int peer;
+  int i;
+
+  conn = connect_packet_pair(&peer);
+  memset(body_data, 0x5a, sizeof(body_data));
+  small.bytes = body_data;
+  small.len = 100;
+  large.bytes = body_data;
+  large.len = sizeof(body_data);
+
+  match_int("amqp_set_output_buffering", 0,
+            amqp_set_output_buffering(conn, 32768));
+
+  /* held until flushed */
+  for (i = 0; i < 3; i++) {
+    match_int("amqp_basic_publish", 0,
+              amqp_basic_publish(conn, 1, amqp_cstring_bytes("exchange"),
+                                 amqp_cstring_bytes("key"), 0, 0, NULL,
+                                 small));
+  }
+  match_int("nothing sent", -1,
+            (int)recv(peer, received, sizeof(received), MSG_DONTWAIT));
+  match_int("amqp_flush", 0, amqp_flush(conn));
+  len = recv(peer, received, sizeof(received), MSG_DONTWAIT);
+  match_int("frames in one write", 9, count_frames(received, (size_t)len));
+
+  /* sent together once the threshold is reached */
+  match_int("amqp_basic_publish", 0,
+            amqp_basic_publish(conn, 1, amqp_cstring_bytes("exchange"),
+                               amqp_cstring_bytes("key"), 0, 0, NULL, small));
+  match_int("amqp_basic_publish", 0,
+            amqp_basic_publish(conn, 1, amqp_cstring_bytes("exchange"),
+                               amqp_cstring_bytes("key"), 0, 0, NULL, large));
+  len = recv(peer, received, sizeof(received), MSG_DONTWAIT);
+  match_int("frames in one write", 6, count_frames(received, (size_t)len));
+
+  /* and before waiting to receive */
+  match_int("amqp_basic_publish", 0,
+            amqp_basic_publish(conn, 1, amqp_cstring_bytes("exchange"),
+                               amqp_cstring_bytes("key"), 0, 0, NULL, small));
+  timeout.tv_sec = 0;
+  timeout.tv_usec = 1000;
+  match_int("amqp_simple_wait_frame_timeout", 0,
+            amqp_simple_wait_frame_timeout(conn, &frame, &timeout));
+  match_int("no frame", 0, frame.frame_type);
+  len = recv(peer, received, sizeof(received), MSG_DONTWAIT);
+  match_int("frames in one write", 3, count_frames(received, (size_t)len));
+
+  /* turning it off sends straight away */
+  match_int("amqp_set_output_buffering", 0,
+            amqp_set_output_buffering(conn, 0));
+  match_int("amqp_basic_publish", 0,
+            amqp_basic_publish(conn, 1, amqp_cstring_bytes("exchange"),
+                               amqp_cstring_bytes("key"), 0, 0, NULL, small));
+  len = recv(peer, received, sizeof(received), MSG_DONTWAIT);
+  match_int("frames in one write", 3, count_frames(received, (size_t)len));
+
+  amqp_destroy_connection(conn);
+  close(peer);
+}
+
+static void test_publish_batch(void)
+{
+  static unsigned char received[120000];
+  static char body_data[40000];
+  static char long_key[200000];
+  static amqp_message_spec_t msgs[201];
+  amqp_basic_properties_t props;
+  amqp_connection_state_t conn;
+  size_t sent;
+  ssize_t len;
+  int peer;
+  int i;
+
+  conn = connect_packet_pair(&peer);
+  memset(body_data, 0x5a, sizeof(body_data));
+  props._flags = AMQP_BASIC_CONTENT_TYPE_FLAG;
+  props.content_type = amqp_cstring_bytes("text/plain");
+
+  for (i = 0; i < 201; i++) {
+    msgs[i].exchange = amqp_cstring_bytes("exchange");
+    msgs[i].routing_key = amqp_cstring_bytes("key");
+    msgs[i].mandatory = 0;
+    msgs[i].immediate = 0;
+    msgs[i].properties = i % 2 == 0 ? &props : NULL;
+    msgs[i].body.bytes = body_data;
+    msgs[i].body.len = 100;
+  }
+  /* one large enough to be sent from where it is */
+  msgs[200].body.len = sizeof(body_data);
+
+  match_int("amqp_basic_publish_batch", 0,
+            amqp_basic_publish_batch(conn, 1, msgs, 201, &sent));
+  match_int("messages sent", 201, (int)sent);
+  len = recv(peer, received, sizeof(received), MSG_DONTWAIT);
+  match_int("frames in one write", 603, count_frames(received, (size_t)len));
+  match_int("nothing more", -1,
+            (int)recv(peer, received, sizeof(received), MSG_DONTWAIT));
+
+  /* a routing key too long for any frame: the two messages before it
+     still go out, and nothing of it or the one after it */
+  memset(long_key, 'k', sizeof(long_key));
+  msgs[2].routing_key.bytes = long_key;
+  msgs[2].routing_key.len = sizeof(long_key);
+  if (amqp_basic_publish_batch(conn, 1, msgs, 4, &sent) >= 0) {
+    die("%s succeeded: %d", "publishing an unencodable message", 0);
+  }
+  match_int("messages sent", 2, (int)sent);
+  len = recv(peer, received, sizeof(received), MSG_DONTWAIT);
+  match_int("frames of whole messages", 6,
+            count_frames(received, (size_t)len));
+  match_int("nothing more", -1,
+            (int)recv(peer, received, sizeof(received), MSG_DONTWAIT));
+
+  amqp_destroy_connection(conn);
+  close(peer);
+}
+
+static void test_publish_template(void)
+{
+  static unsigned char expected[1000];
+  static unsigned char received[1000];
+  static char body_data[300];
+  static char long_value[200000];
+  amqp_table_entry_t header;
+  amqp_basic_properties_t props;
+  amqp_publish_template_t tmpl;
+  amqp_connection_state_t conn;
+  amqp_bytes_t body;
+  ssize_t expected_len;
+  ssize_t len;
+  int pass;
+  int peer;
+
+  conn = connect_packet_pair(&peer);
+  memset(body_data, 0x5a, sizeof(body_data));
+  body.bytes = body_data;
+  body.len = sizeof(body_data);
+
+  header.key = amqp_cstring_bytes("source");
+  header.value.kind = AMQP_FIELD_KIND_UTF8;
+  header.value.value.bytes = amqp_cstring_bytes("test");
+  props._flags = AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_HEADERS_FLAG;
+  props.content_type = amqp_cstring_bytes("text/plain");
+  props.headers.num_entries = 1;
+  props.headers.entries = &header;
+
+  match_int("amqp_publish_template_init", 0,
+            amqp_publish_template_init(&tmpl, amqp_cstring_bytes("exchange"),
+                                       amqp_cstring_bytes("key"), 1, 0,
+                                       &props));
+
+  /* the same bytes as amqp_basic_publish, before and after the
+     properties change */
+  for (pass = 0; pass < 2; pass++) {
+    match_int("amqp_basic_publish", 0,
+              amqp_basic_publish(conn, 3, amqp_cstring_bytes("exchange"),
+                                 amqp_cstring_bytes("key"), 1, 0, &props,
+                                 body));
+    expected_len = recv(peer, expected, sizeof(expected), MSG_DONTWAIT);
+
+    match_int("amqp_basic_publish_with_template", 0,
+              amqp_basic_publish_with_template(conn, 3, &tmpl, body));
+    len = recv(peer, received, sizeof(received), MSG_DONTWAIT);
+    match_int("length", (int)expected_len, (int)len);
+    match_int("bytes", 0, memcmp(expected, received, (size_t)len));
+
+    props._flags |= AMQP_BASIC_DELIVERY_MODE_FLAG;
+    props.delivery_mode = 2;
+    match_int("amqp_publish_template_set_properties", 0,
+              amqp_publish_template_set_properties(&tmpl, &props));
+  }
+
+  /* properties too large for any frame: nothing at all is sent, not
+     even the method frame */
+  memset(long_value, 'v', sizeof(long_value));
+  header.value.value.bytes.bytes = long_value;
+  header.value.value.bytes.len = sizeof(long_value);
+  match_int("amqp_publish_template_set_properties", 0,
+            amqp_publish_template_set_properties(&tmpl, &props));
+  if (amqp_basic_publish_with_template(conn, 3, &tmpl, body) >= 0) {
+    die("%s succeeded: %d", "publishing oversized properties", 0);
+  }
+  match_int("nothing sent", -1,
+            (int)recv(peer, received, sizeof(received), MSG_DONTWAIT));
+
+  amqp_publish_template_destroy(&tmpl);
+  amqp_destroy_connection(conn);
+  close(peer);
+}
+
+/* Reads a published message off conn, checking its body is len bytes
+   of the pattern test_publish_fd writes, starting from start */
+static void expect_file_message(amqp_connection_state_t conn, size_t start,
+                                size_t len)
+{
+  amqp_frame_t frame;
+  size_t received = 0;
+
+  match_int("amqp_simple_wait_frame", 0, amqp_simple_wait_frame(conn, &frame));
+  match_int("method", (int)AMQP_BASIC_PUBLISH_METHOD,
+            (int)frame.payload.method.id);
+  match_int("amqp_simple_wait_frame", 0, amqp_simple_wait_frame(conn, &frame));
+  match_int("body size", (int)len, (int)frame.payload.properties.body_size);
+
+  while (received < len) {
+    size_t i;
+
+    match_int("amqp_simple_wait_frame", 0,
+              amqp_simple_wait_frame(conn, &frame));
+    match_int("frame type", AMQP_FRAME_BODY, frame.frame_type);
+    for (i = 0; i < frame.payload.body_fragment.len; i++) {
+      match_int("body", (int)((start + received + i) % 251),
+                ((unsigned char *)frame.payload.body_fragment.bytes)[i]);
+    }
+    received += frame.payload.body_fragment.len;
+  }
+  match_int("body length", (int)len, (int)received);
+  amqp_maybe_release_buffers(conn);
+}
+
+static void test_publish_fd(void)
+{
+  static unsigned char data[200000];
+  amqp_connection_state_t reader = amqp_new_connection();
+  FILE *file = tmpfile();
+  int pipe_fds[2];
+  int status;
+  pid_t child;
+  int peer;
+  size_t i;
+
+  for (i = 0; i < sizeof(data); i++) {
+    data[i] = (unsigned char)(i % 251);
+  }
+  if (file == NULL || fwrite(data, 1, sizeof(data), file) != sizeof(data)
+      || fflush(file) != 0) {
+    die("%s failed: %d", "tmpfile", 0);
+  }
+  if (pipe(pipe_fds) < 0) {
+    die("%s failed: %d", "pipe", 0);
+  }
+  /* small enough for the pipe to hold */
+  write_all(pipe_fds[1], (const char *)data, 20000);
+  close(pipe_fds[1]);
+
+  peer = attach_pair(reader);
+  child = fork();
+  if (child < 0) {
+    die("%s failed: %d", "fork", (int)child);
+  }
+  if (child == 0) {
+    amqp_connection_state_t conn = amqp_new_connection();
+    amqp_socket_t *socket = amqp_tcp_socket_new();
+
+    amqp_tcp_socket_set_sockfd(socket, peer);
+    amqp_set_socket(conn, socket);
+    /* several frames, from part way into the file */
+    match_int("amqp_basic_publish_fd", 0,
+              amqp_basic_publish_fd(conn, 1, amqp_cstring_bytes("exchange"),
+                                    amqp_cstring_bytes("key"), 0, 0, NULL,
+                                    fileno(file), 1000, 150000));
+    /* a pipe, which has to be read */
+    match_int("amqp_basic_publish_fd", 0,
+              amqp_basic_publish_fd(conn, 1, amqp_cstring_bytes("exchange"),
+                                    amqp_cstring_bytes("key"), 0, 0, NULL,
+                                    pipe_fds[0], -1, 20000));
+    amqp_destroy_connection(conn);
+    _exit(0);
+  }
+  close(peer);
+
+  expect_file_message(reader, 1000, 150000);
+  expect_file_message(reader, 0, 20000);
+  if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status)
+      || WEXITSTATUS(status) != 0) {
+    die("%s failed: %d", "publisher", status);
+  }
+
+  close(pipe_fds[0]);
+  fclose(file);
+  amqp_destroy_connection(reader);
+}
+
+#ifdef HAVE_SENDFILE
+static void test_sendfile_to_closed_peer(void)
+{
+  amqp_socket_t *socket = amqp_tcp_socket_new();
+  FILE *file = tmpfile();
+  char data[4096];
+  sigset_t pending;
+  off_t offset = 0;
+  int fds[2];
+
+  memset(data, 0x5a, sizeof(data));
+  if (file == NULL || fwrite(data, 1, sizeof(data), file) != sizeof(data)
+      || fflush(file) != 0) {
+    die("%s failed: %d", "tmpfile", 0);
+  }
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    die("%s failed: %d", "socketpair", 0);
+  }
+  close(fds[1]);
+  amqp_tcp_socket_set_sockfd(socket, fds[0]);
+
+  /* with SIGPIPE at its default this kills the test */
+  if (socket->klass->sendfile(socket, fileno(file), &offset,
+                              sizeof(data)) >= 0) {
+    die("%s succeeded: %d", "sendfile to a closed peer", 0);
+  }
+  match_int("sendfile errno", EPIPE, errno);
+  if (sigpending(&pending) < 0 || sigismember(&pending, SIGPIPE)) {
+    die("%s left pending: %d", "SIGPIPE", 0);
+  }
+
+  amqp_socket_close(socket);
+  fclose(file);
+}
+#endif
+
+int main(void)
+{
+  test_frames_survive_refill();
+  test_small_frames_share_pool_pages();
+  test_wait_frames_drains_buffer();
+  test_wait_body();
+  test_large_frames();
+  test_lazy_method_decoding();
+  test_selective_properties();
+  test_consume_message();
+  test_wait_frame_timeout();
+  test_wait_socket_buffered();
+  test_release_on_channel();
+  test_many_channels();
+  test_detach_buffers();
+  test_share_body_fragments();
+  test_memory_stats();
+  test_lazy_buffers();
+  test_idle_wait_socket_buffered();
+  test_caller_memory();
+  test_release_policy();
+  test_publish_single_write();
+  test_publish_to_closed_peer();
+  test_output_buffering();
+  test_publish_batch();
+  test_publish_template();
+  test_publish_fd();
+#ifdef HAVE_SENDFILE
+  test_sendfile_to_closed_peer();
+#endif
+  return 0;
+}
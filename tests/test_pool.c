@@ -0,0 +1,289 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <amqp.h>
+
+static void match_int(const char *what, int expect, int got)
+{
+  if (got != expect) {
+    fprintf(stderr, "Expected %s '%d', got '%d'\n", what, expect, got);
+    abort();
+  }
+}
+
+static void *alloc_or_die(amqp_pool_t *pool, size_t amount)
+{
+  void *result = amqp_pool_alloc(pool, amount);
+  if (result == NULL) {
+    fprintf(stderr, "amqp_pool_alloc of %d bytes failed\n", (int)amount);
+    abort();
+  }
+  return result;
+}
+
+static void test_large_blocks_are_reused(void)
+{
+  amqp_pool_t pool;
+  void *block;
+  void *other;
+
+  init_amqp_pool(&pool, 4096);
+
+  block = alloc_or_die(&pool, 5000);
+  memset(block, 0xab, 5000);
+  recycle_amqp_pool(&pool);
+  match_int("retained bytes", 5120, (int)pool.retained_bytes);
+
+  /* anything in the same size class gets the same block back */
+  match_int("reused", 1, alloc_or_die(&pool, 4800) == block);
+  match_int("retained bytes", 0, (int)pool.retained_bytes);
+
+  /* a bigger class needs a block of its own */
+  other = alloc_or_die(&pool, 9000);
+  match_int("reused", 0, other == block);
+  recycle_amqp_pool(&pool);
+  match_int("retained bytes", 5120 + 10240, (int)pool.retained_bytes);
+  match_int("reused", 1, alloc_or_die(&pool, 10000) == other);
+  match_int("reused", 1, alloc_or_die(&pool, 5120) == block);
+
+  /* too big to be size-classed, so never kept */
+  alloc_or_die(&pool, 64 * 1024 * 1024);
+  recycle_amqp_pool(&pool);
+  match_int("retained bytes", 5120 + 10240, (int)pool.retained_bytes);
+
+  empty_amqp_pool(&pool);
+  match_int("retained bytes", 0, (int)pool.retained_bytes);
+}
+
+static void test_retention_limit(void)
+{
+  amqp_pool_t pool;
+  int i;
+
+  init_amqp_pool(&pool, 4096);
+  amqp_pool_set_retention(&pool, 12000);
+
+  for (i = 0; i < 3; i++) {
+    alloc_or_die(&pool, 5000);
+  }
+  recycle_amqp_pool(&pool);
+  match_int("retained bytes", 2 * 5120, (int)pool.retained_bytes);
+
+  amqp_pool_set_retention(&pool, 0);
+  for (i = 0; i < 3; i++) {
+    alloc_or_die(&pool, 5000);
+  }
+  recycle_amqp_pool(&pool);
+  match_int("retained bytes", 0, (int)pool.retained_bytes);
+
+  /* plenty of blocks in one cycle */
+  for (i = 0; i < 1000; i++) {
+    alloc_or_die(&pool, 4097 + i);
+  }
+  empty_amqp_pool(&pool);
+}
+
+static void test_pool_stats(void)
+{
+  amqp_pool_t pool;
+  amqp_pool_stats_t stats;
+
+  init_amqp_pool(&pool, 4096);
+  alloc_or_die(&pool, 100);
+  alloc_or_die(&pool, 100);
+  alloc_or_die(&pool, 5000);
+
+  amqp_pool_get_stats(&pool, &stats);
+  match_int("used bytes", 104 + 104 + 5000, (int)stats.used_bytes);
+  match_int("held bytes", 4096 + 5120, (int)stats.held_bytes);
+  match_int("pages", 1, stats.pages);
+  match_int("large blocks", 1, stats.large_blocks);
+  match_int("total allocs", 3, (int)stats.total_allocs);
+
+  /* recycling keeps the memory but not the usage */
+  recycle_amqp_pool(&pool);
+  alloc_or_die(&pool, 16);
+  amqp_pool_get_stats(&pool, &stats);
+  match_int("used bytes", 16, (int)stats.used_bytes);
+  match_int("peak used bytes", 104 + 104 + 5000, (int)stats.peak_used_bytes);
+  match_int("held bytes", 4096 + 5120, (int)stats.held_bytes);
+  match_int("large blocks", 0, stats.large_blocks);
+  match_int("total allocs", 4, (int)stats.total_allocs);
+  match_int("total bytes", 104 + 104 + 5000 + 16, (int)stats.total_bytes);
+
+  empty_amqp_pool(&pool);
+  amqp_pool_get_stats(&pool, &stats);
+  match_int("held bytes", 0, (int)stats.held_bytes);
+  match_int("peak held bytes", 4096 + 5120, (int)stats.peak_held_bytes);
+  match_int("pages", 0, stats.pages);
+}
+
+/* keeps outstanding bytes per tag, so sized frees have to add up */
+typedef struct counting_allocator_t_ {
+  amqp_allocator_t allocator;
+  long outstanding[AMQP_MEMORY_TAG_COUNT];
+  int allocations[AMQP_MEMORY_TAG_COUNT];
+} counting_allocator_t;
+
+static void *counting_alloc(void *context, size_t size, amqp_memory_tag_t tag)
+{
+  counting_allocator_t *counter = context;
+  counter->outstanding[tag] += (long)size;
+  counter->allocations[tag]++;
+  return malloc(size);
+}
+
+static void counting_free(void *context, void *ptr, size_t size,
+                          amqp_memory_tag_t tag)
+{
+  counting_allocator_t *counter = context;
+  counter->outstanding[tag] -= (long)size;
+  free(ptr);
+}
+
+static void init_counting_allocator(counting_allocator_t *counter)
+{
+  memset(counter, 0, sizeof(*counter));
+  counter->allocator.alloc = counting_alloc;
+  counter->allocator.realloc = NULL;
+  counter->allocator.free = counting_free;
+  counter->allocator.context = counter;
+}
+
+static void match_nothing_outstanding(counting_allocator_t *counter)
+{
+  int tag;
+  for (tag = 0; tag < AMQP_MEMORY_TAG_COUNT; tag++) {
+    match_int("outstanding bytes", 0, (int)counter->outstanding[tag]);
+  }
+}
+
+static void test_pool_allocator(void)
+{
+  counting_allocator_t counter;
+  amqp_pool_t pool;
+  int i;
+
+  init_counting_allocator(&counter);
+  init_amqp_pool_with_allocator(&pool, 4096, &counter.allocator);
+
+  for (i = 0; i < 100; i++) {
+    alloc_or_die(&pool, 100);
+    alloc_or_die(&pool, 4097 + i);
+  }
+  recycle_amqp_pool(&pool);
+  for (i = 0; i < 100; i++) {
+    alloc_or_die(&pool, 8000);
+  }
+  match_int("pool allocations", 1, counter.allocations[AMQP_MEMORY_POOL] > 0);
+  empty_amqp_pool(&pool);
+  match_nothing_outstanding(&counter);
+}
+
+static void test_table_allocator(void)
+{
+  counting_allocator_t counter;
+  amqp_pool_t pool;
+  amqp_table_entry_t entries[100];
+  amqp_table_t table;
+  amqp_table_t decoded;
+  char buffer[4096];
+  amqp_bytes_t encoded;
+  size_t offset = 0;
+  int i;
+
+  for (i = 0; i < 100; i++) {
+    entries[i].key = amqp_cstring_bytes("key");
+    entries[i].value.kind = AMQP_FIELD_KIND_I32;
+    entries[i].value.value.i32 = i;
+  }
+  table.num_entries = 100;
+  table.entries = entries;
+
+  encoded.bytes = buffer;
+  encoded.len = sizeof(buffer);
+  match_int("encode", 0, amqp_encode_table(encoded, &table, &offset));
+
+  init_counting_allocator(&counter);
+  init_amqp_pool_with_allocator(&pool, 4096, &counter.allocator);
+
+  /* the scratch array has to grow without a realloc hook */
+  encoded.len = offset;
+  offset = 0;
+  match_int("decode", 0, amqp_decode_table(encoded, &pool, &decoded, &offset));
+  match_int("entries", 100, decoded.num_entries);
+  match_int("last entry", 99, decoded.entries[99].value.value.i32);
+  match_int("table allocations", 1,
+            counter.allocations[AMQP_MEMORY_TABLE] > 1);
+
+  empty_amqp_pool(&pool);
+  match_nothing_outstanding(&counter);
+}
+
+static void test_connection_allocator(void)
+{
+  counting_allocator_t counter;
+  amqp_connection_state_t conn;
+
+  init_counting_allocator(&counter);
+  conn = amqp_new_connection_with_allocator(&counter.allocator);
+  if (conn == NULL) {
+    fprintf(stderr, "amqp_new_connection_with_allocator failed\n");
+    abort();
+  }
+  match_int("connection allocations", 1,
+            counter.allocations[AMQP_MEMORY_CONNECTION] > 0);
+
+  amqp_destroy_connection(conn);
+  match_nothing_outstanding(&counter);
+}
+
+int main(void)
+{
+  test_large_blocks_are_reused();
+  test_retention_limit();
+  test_pool_stats();
+  test_pool_allocator();
+  test_table_allocator();
+  test_connection_allocator();
+  return 0;
+}
@@ -41,6 +41,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
 
 #include "common.h"
 
@@ -55,6 +58,33 @@ static void do_publish(amqp_connection_state_t conn,
   die_amqp_error(res, "basic.publish");
 }
 
+/* Publishes the rest of fd, if it is a regular file, without reading it
+   into memory. Returns 0 if it is something else. */
+static int publish_file(amqp_connection_state_t conn,
+                        char *exchange, char *routing_key,
+                        amqp_basic_properties_t *props, int fd)
+{
+  struct stat st;
+  off_t offset;
+  int res;
+
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    return 0;
+  }
+  offset = lseek(fd, 0, SEEK_CUR);
+  if (offset < 0 || offset > st.st_size) {
+    return 0;
+  }
+
+  res = amqp_basic_publish_fd(conn, 1,
+                              cstring_bytes(exchange),
+                              cstring_bytes(routing_key),
+                              0, 0, props, fd, offset,
+                              (size_t)(st.st_size - offset));
+  die_amqp_error(res, "basic.publish");
+  return 1;
+}
+
 int main(int argc, const char **argv)
 {
   amqp_connection_state_t conn;
@@ -124,13 +154,10 @@ int main(int argc, const char **argv)
 
   if (body) {
     body_bytes = amqp_cstring_bytes(body);
-  } else {
+    do_publish(conn, exchange, routing_key, &props, body_bytes);
+  } else if (!publish_file(conn, exchange, routing_key, &props, 0)) {
     body_bytes = read_all(0);
-  }
-
-  do_publish(conn, exchange, routing_key, &props, body_bytes);
-
-  if (!body) {
+    do_publish(conn, exchange, routing_key, &props, body_bytes);
     free(body_bytes.bytes);
   }
 